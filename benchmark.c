@@ -1,10 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <canvas.h>
 #include <render.h>
 #include <obj_loader.h>
+#include <kdtree.h>
 
 #define CANVAS_W 400
 #define CANVAS_H 400
@@ -48,8 +50,15 @@ void
 generate_random_spheres(Scene * scene,
                         int count);
 
+/*
+ * With --tune parameters of kd-tree are chosen by tune_kd_tree for each scene
+ */
 int
-main(void) {
+main(int argc,
+     char * argv[]) {
+    
+    const Boolean tune = (argc > 1) && !strcmp(argv[1], "--tune");
+    
     Camera * camera = create_camera();
     
     Canvas * canvas = new_canvas(CANVAS_W,
@@ -68,8 +77,19 @@ main(void) {
         //generate_random_spheres(scene, i * 400);
 
         prepare_scene(scene);
+        
+        if(tune) {
+            KDTreeParams params = tune_kd_tree(scene, camera, CANVAS_W, CANVAS_H);
+            printf("Tuned kd-tree: max depth %i, objects in leaf %i, traversal cost %.2f, intersection cost %.2f\n",
+                   params.max_depth, params.objects_in_leaf,
+                   (double) params.traversal_cost, (double) params.intersection_cost);
+        }
     
         printf("Number of polygons: %i. ", scene->last_object_index + 1);
+        
+        KDTreeStats stats = get_kd_tree_stats(scene->kd_tree);
+        printf("\n");
+        print_kd_tree_stats(&stats);
     
         render_scene(scene,
                      camera,
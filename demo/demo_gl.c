@@ -122,6 +122,12 @@ init_scene_and_camera(void) {
                         z_angle,
                         focus);
     
+    #ifdef TUNE_KD_TREE
+    // Chooses parameters of kd-tree for this CPU and this view:
+    // builds 12 kd-trees, so start takes about 12 times longer
+    tune_kd_tree(scene, camera, TEX_WIDTH, TEX_HEIGHT);
+    #endif // TUNE_KD_TREE
+    
     camera_state_changed = True;
     
     canv = new_canvas(TEX_WIDTH,
@@ -2,6 +2,7 @@
 #include <math.h>
 
 #include <obj_loader.h>
+#include <kdtree.h>
 #include <canvas.h>
 
 #include "scene.h"
@@ -106,24 +107,63 @@ Scene * makeScene(void) {
     //load_minicooper(scene);
     
     //add_skybox(scene, point3d(-2000, -2000, -2000), 4000);
+    
+    // Kd-tree is built only on the first start
+    //set_kd_tree_cache(scene, "scene.kdtree");
+    
+    //set_acceleration_structure(scene, BVH_STRUCTURE);
 
     printf("\nNumber of polygons: %i\n", scene->last_object_index + 1);
     printf("\nBuilding Kd-Tree. Wait, please...\n");
     prepare_scene(scene);    
     printf("\nScene created\n");
+    
+    #ifdef PRINT_KD_TREE_STATS
+    if(scene->kd_tree) {
+        KDTreeStats stats = get_kd_tree_stats(scene->kd_tree);
+        print_kd_tree_stats(&stats);
+    }
+    #endif // PRINT_KD_TREE_STATS
 
     return scene;
 }
 
+/*
+ * Model is loaded as indexed mesh: its triangles are placed into the scene kd-tree
+ * by indexes, vertexes are shared. With MODELS_AS_TRIANGLES each face
+ * is added to the scene as separate triangle object
+ */
+static void
+load_model(Scene * scene,
+           const char * filename,
+           SceneFaceHandlerParams * load_params) {
+    
+#ifndef MODELS_AS_TRIANGLES
+    TriangleMesh * mesh = new_triangle_mesh(True, NULL);
+    
+    load_params->scene = NULL;
+    load_params->triangle_mesh = mesh;
+    load_params->triangle_mesh_material =
+            add_triangle_mesh_material(mesh, load_params->default_color, load_params->default_material);
+    load_obj(filename,
+             scene_face_handler,
+             load_params);
+    
+    add_object(scene, new_triangle_mesh_object(mesh));
+#else
+    load_obj(filename,
+             scene_face_handler,
+             load_params);
+#endif
+}
+
 void load_lamp(Scene * scene) {
     SceneFaceHandlerParams load_params =
     new_scene_face_handler_params(scene,
                                   33, 30, -100, 30, 0, 0, 0,
                                   rgb(20, 250, 100),
                                   material(1, 3, 5, 0, 0, 10));
-    load_obj("./models/lamp.obj",
-             scene_face_handler,
-             &load_params);
+    load_model(scene, "./models/lamp.obj", &load_params);
 }
 
 void load_teapot(Scene * scene) {
@@ -132,9 +172,7 @@ void load_teapot(Scene * scene) {
                                   25, 100, 100, 32, 0, 0, 0,
                                   rgb(250, 200, 50),
                                   material(1, 3, 4, 7, 0, 10));
-    load_obj("./models/teapot.obj",
-             scene_face_handler,
-             &load_params);
+    load_model(scene, "./models/teapot.obj", &load_params);
 }
 
 void load_man(Scene * scene) {
@@ -143,9 +181,7 @@ void load_man(Scene * scene) {
                                   110, 100, -100, -80, 0, 0, 0,
                                   rgb(120, 120, 250),
                                   material(1, 5, 0, 0, 0, 10));
-    load_obj("./models/man.obj",
-             scene_face_handler,
-             &load_params);
+    load_model(scene, "./models/man.obj", &load_params);
 }
 
 void load_atenea(Scene * scene) {
@@ -156,9 +192,7 @@ void load_atenea(Scene * scene) {
                                   //reflective surface
                                   material(2, 3, 7, 3, 0, 10));
                                   //material(4, 3, 7, 0, 0, 10));
-    load_obj("./models/ateneal.obj",
-             scene_face_handler,
-             &load_params);
+    load_model(scene, "./models/ateneal.obj", &load_params);
 }
 
 void load_venus(Scene * scene) {
@@ -167,9 +201,7 @@ void load_venus(Scene * scene) {
                                   0.05, 100, -100, -80, 0, 0, 1.3,
                                   rgb(200, 200, 150),
                                   material(2, 3, 0, 0, 0, 0));
-    load_obj("./models/venusl.obj",
-             scene_face_handler,
-             &load_params);
+    load_model(scene, "./models/venusl.obj", &load_params);
 }
 
 void load_elephant(Scene * scene) {
@@ -178,9 +210,7 @@ void load_elephant(Scene * scene) {
                                   0.3, -350, -150, -100, 0, 0, 0,
                                   rgb(50, 150, 250),
                                   material(2, 3, 0, 0, 0, 10));
-    load_obj("./models/elephal.obj",
-             scene_face_handler,
-             &load_params);
+    load_model(scene, "./models/elephal.obj", &load_params);
 }
 
 void load_car(Scene * scene) {
@@ -189,9 +219,7 @@ void load_car(Scene * scene) {
                                   3, 200, -100, -100, M_PI / 4, M_PI / 2, 0,
                                   rgb(190, 190, 220),
                                   material(3, 3, 7, 5, 0, 10));
-    load_obj("./models/car.obj",
-             scene_face_handler,
-             &load_params);
+    load_model(scene, "./models/car.obj", &load_params);
 }
 
 void load_minicooper(Scene * scene) {
@@ -200,9 +228,7 @@ void load_minicooper(Scene * scene) {
                                   3, -100, -350, -100, 0, M_PI / 2, 0,
                                   rgb(220, 220, 220),
                                   material(2, 3, 7, 5, 0, 10));
-    load_obj("./models/minicooper.obj",
-             scene_face_handler,
-             &load_params);
+    load_model(scene, "./models/minicooper.obj", &load_params);
 }
 
 void create_serpinsky_pyramid(Scene * scene) {
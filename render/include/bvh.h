@@ -0,0 +1,67 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <render.h>
+
+BVH *
+build_bvh(Object3d ** objects,
+          const int objects_count);
+
+void
+release_bvh(BVH * bvh);
+
+/*
+ * Update hierarchy after adding (removing) object to (from) the array of objects.
+ * Return True if the hierarchy has to be rebuilt
+ */
+Boolean
+insert_bvh_object(BVH * const bvh,
+                  const int index);
+
+Boolean
+remove_bvh_object(BVH * const bvh,
+                  const int index);
+
+/*
+ * Nearest intersection replaces the hit, if it is closer than hit->t
+ */
+Boolean
+find_intersection_bvh(const BVH * const bvh,
+                      const Point3d vector_start,
+                      const Vector3d vector,
+                      Object3d ** const nearest_obj_ptr,
+                      HitRecord * const nearest_hit);
+
+/*
+ * True if any object is intersected by the ray
+ * not farther than max_dist from its start
+ */
+Boolean
+is_intersect_anything_bvh(const BVH * const bvh,
+                          const Point3d vector_start,
+                          const Vector3d vector,
+                          const Float max_dist);
+
+/*
+ * Nearest intersections of rays of packet, which are set in mask, replace
+ * their hits as in find_intersection_bvh. Arrays of results are indexed by rays.
+ * Returns mask of intersected rays
+ */
+int
+find_intersection_bvh_packet(const BVH * const bvh,
+                             const RayPacket * const packet,
+                             const int mask,
+                             Object3d ** const nearest_objs,
+                             HitRecord * const nearest_hits);
+
+/*
+ * Mask of rays, which intersect any object
+ * not farther than max_dists[ray] from the start
+ */
+int
+is_intersect_anything_bvh_packet(const BVH * const bvh,
+                                 const RayPacket * const packet,
+                                 const int mask,
+                                 const Float * const max_dists);
+
+#endif
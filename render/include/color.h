@@ -74,6 +74,17 @@ mul_color(Color c,
 	return rgb((Byte) (c.r * k), (Byte) (c.g * k), (Byte) (c.b * k));
 }
 
+// Channels, which exceed the maximum, are saturated
+static inline Color
+rgb_saturated(double r,
+              double g,
+              double b) {
+    
+    return rgb((Byte) ((r < MAX_R) ? r : MAX_R),
+               (Byte) ((g < MAX_G) ? g : MAX_G),
+               (Byte) ((b < MAX_B) ? b : MAX_B));
+}
+
 static inline Color
 grayscale(Color c) {
     // https://en.wikipedia.org/wiki/Grayscale
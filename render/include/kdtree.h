@@ -3,19 +3,277 @@
 
 #include <render.h>
 
+// Axis aligned bounding boxes of objects, stored as structure of arrays
+typedef
+struct {
+    Float * x_min;
+    Float * y_min;
+    Float * z_min;
+    
+    Float * x_max;
+    Float * y_max;
+    Float * z_max;
+    
+    // Index of the object in the array of objects
+    int * index;
+    
+    int count;
+}
+BoundingBoxes;
+
+// Sizes of histograms of KDTreeStats
+#define KD_TREE_STATS_DEPTHS 64
+#define KD_TREE_STATS_LEAF_SIZES 16
+
+// Quality of built tree
+typedef
+struct {
+    int nodes_count;
+    int leaves_count;
+    int empty_leaves_count;
+    int max_depth;
+    int max_leaf_size;
+    
+    // Number of leaves at each depth (the last element - at this depth and deeper)
+    int leaves_by_depth[KD_TREE_STATS_DEPTHS];
+    
+    // [0] - empty leaves, [i] - leaves with 2^(i-1) .. 2^i - 1 objects
+    int leaves_by_size[KD_TREE_STATS_LEAF_SIZES];
+    
+    // Sum of sizes of all leaves
+    int references_count;
+    int objects_count;
+    
+    // Average number of leaves, which contain the same object
+    Float duplication;
+    
+    // Volume of empty leaves, relative to the volume of the whole tree
+    Float empty_volume;
+    
+    // Expected cost of tracing of ray: SAH cost of tree divided by its area
+    // (in units of ray-object intersection test)
+    Float sah_cost;
+    
+    // Memory, which is used by nodes, indexes of objects and groups of leaves
+    size_t nodes_bytes;
+    
+    // Memory, which is used by copies of geometry: primitives and triangle groups
+    size_t primitives_bytes;
+}
+KDTreeStats;
+
+BoundingBoxes *
+new_bounding_boxes(Object3d ** objects,
+                   int objects_count);
+
+void
+release_bounding_boxes(BoundingBoxes * boxes);
+
+KDTreeParams
+default_kd_tree_params(void);
+
+/*
+ * Boxes are the boxes of objects (see new_bounding_boxes).
+ * Triangles of MESH_OBJECT objects are placed into leaves instead of the objects
+ */
 KDTree *
 build_kd_tree(Object3d ** objects,
-              int objects_count);
+              const BoundingBoxes * boxes,
+              const KDTreeParams * const params);
+
+/*
+ * Tree of triangles of mesh, which are referenced by indexes
+ */
+KDTree *
+build_mesh_kd_tree(const TriangleMesh * const mesh,
+                   const KDTreeParams * const params);
 
 void
 release_kd_tree(KDTree * tree);
 
+KDTreeStats
+get_kd_tree_stats(const KDTree * const tree);
+
+void
+print_kd_tree_stats(const KDTreeStats * const stats);
+
+/*
+ * Update tree after adding (removing) object to (from) the array of objects.
+ * Return True if the tree has to be rebuilt
+ */
+Boolean
+insert_kd_tree_object(KDTree * const tree,
+                      const int index);
+
+Boolean
+remove_kd_tree_object(KDTree * const tree,
+                      const int index);
+
+/*
+ * Hash of bounding boxes, geometry of triangles and spheres
+ * and parameters of building, which identifies the tree in the cache file
+ */
+unsigned long long
+kd_tree_key(Object3d ** objects,
+            const BoundingBoxes * const boxes,
+            const KDTreeParams * const params);
+
+void
+save_kd_tree(const KDTree * const tree,
+             const unsigned long long key,
+             const char * const file_name);
+
+/*
+ * Returns NULL if file doesn't exist, it contains another tree or it is corrupted
+ */
+KDTree *
+load_kd_tree(Object3d ** objects,
+             const int objects_count,
+             const KDTreeParams * const params,
+             const unsigned long long key,
+             const char * const file_name);
+
+/*
+ * Chooses parameters of building, which give the fastest tracing of sample rays
+ */
+KDTreeParams
+tune_kd_tree_params(Object3d ** objects,
+                    const BoundingBoxes * const boxes,
+                    const Point3d * const starts,
+                    const Vector3d * const vectors,
+                    const int rays_count);
+
+/*
+ * Nearest intersection replaces the hit, if it is closer than hit->t
+ * (hit->t is FLOAT_MAX, if nothing was intersected before)
+ */
 Boolean
 find_intersection_tree(KDTree * const tree,
                        const Point3d vector_start,
                        const Vector3d vector,
                        Object3d ** const nearest_obj_ptr,
-                       Point3d * const nearest_intersection_point_ptr,
-                       Float * const nearest_intersection_point_dist_ptr);
+                       HitRecord * const nearest_hit);
+
+/*
+ * Index of the nearest intersected object (-1 if there is no intersection),
+ * its hit is written to nearest_hit. For trees of meshes, which don't have Object3d
+ */
+int
+find_intersection_index_tree(KDTree * const tree,
+                             const Point3d vector_start,
+                             const Vector3d vector,
+                             HitRecord * const nearest_hit);
+
+/*
+ * True if any object is intersected by the ray
+ * not farther than max_dist from its start
+ */
+Boolean
+is_intersect_anything_tree(KDTree * const tree,
+                           const Point3d vector_start,
+                           const Vector3d vector,
+                           const Float max_dist);
+
+/*
+ * Nearest intersections of rays of packet, which are set in mask, replace
+ * their hits as in find_intersection_tree. Arrays of results are indexed by rays.
+ * Returns mask of intersected rays
+ */
+int
+find_intersection_tree_packet(KDTree * const tree,
+                              const RayPacket * const packet,
+                              const int mask,
+                              Object3d ** const nearest_objs,
+                              HitRecord * const nearest_hits);
+
+/*
+ * Indexes of the nearest intersected objects and their hits are written
+ * to the arrays, which are indexed by rays. Returns mask of intersected rays
+ */
+int
+find_intersection_index_tree_packet(KDTree * const tree,
+                                    const RayPacket * const packet,
+                                    const int mask,
+                                    int * const nearest_indexes,
+                                    HitRecord * const nearest_hits);
+
+/*
+ * Mask of rays, which intersect any object
+ * not farther than max_dists[ray] from the start
+ */
+int
+is_intersect_anything_tree_packet(KDTree * const tree,
+                                  const RayPacket * const packet,
+                                  const int mask,
+                                  const Float * const max_dists);
+
+/*
+ * Triangles of mesh for its kd-tree (see triangle.c)
+ */
+
+Voxel
+get_mesh_triangle_box(const TriangleMesh * const mesh,
+                      const int index);
+
+Boolean
+clip_mesh_triangle_by_voxel(const TriangleMesh * const mesh,
+                            const int index,
+                            const Voxel v,
+                            Voxel * const clipped_box);
+
+Boolean
+intersect_mesh_triangle(const TriangleMesh * const mesh,
+                        const int index,
+                        const Point3d vector_start,
+                        const Vector3d vector,
+                        HitRecord * const hit);
+
+int
+intersect_mesh_triangle_packet(const TriangleMesh * const mesh,
+                               const int index,
+                               const RayPacket * const packet,
+                               const int mask,
+                               HitRecord * const hits);
+
+/*
+ * Sets normal vector (and index of triangle) of the hit,
+ * whose distance and weights are found by the test of group of triangles
+ */
+void
+set_mesh_triangle_hit_norm(const TriangleMesh * const mesh,
+                           const int index,
+                           HitRecord * const hit);
+
+/*
+ * Built-in primitives of kd-tree (see triangle.c and sphere.c)
+ */
+
+KDPrimitive
+new_triangle_primitive(const Object3d * const obj);
+
+Boolean
+intersect_triangle_primitive(const KDPrimitive * const primitive,
+                             const Point3d vector_start,
+                             const Vector3d vector,
+                             HitRecord * const hit);
+
+int
+intersect_triangle_primitive_packet(const KDPrimitive * const primitive,
+                                    const RayPacket * const packet,
+                                    const int mask,
+                                    HitRecord * const hits);
+
+void
+set_triangle_primitive_hit_norm(const KDPrimitive * const primitive,
+                                HitRecord * const hit);
+
+KDPrimitive
+new_sphere_primitive(const Object3d * const obj);
+
+Boolean
+intersect_sphere_primitive(const KDPrimitive * const primitive,
+                           const Point3d vector_start,
+                           const Vector3d vector,
+                           HitRecord * const hit);
 
 #endif
\ No newline at end of file
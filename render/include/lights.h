@@ -0,0 +1,71 @@
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+
+#include <render.h>
+
+// Tree is balanced, so its depth doesn't exceed number of bits of int
+#define LIGHT_TREE_STACK_SIZE 64
+
+// Point of hit, for which light sources are chosen
+typedef
+struct {
+    Point3d point;
+    
+    // Unit normal vector for shading and unit reflected ray
+    // (it is required only if material has specular component)
+    Vector3d norm;
+    Vector3d reflected_ray;
+    
+    const Material * material;
+}
+LightsQuery;
+
+// State of enumeration of lights, which aren't culled
+typedef
+struct {
+    const LightTree * tree;
+    const LightsQuery * query;
+    Float threshold;
+    
+    int stack[LIGHT_TREE_STACK_SIZE];
+    int stack_size;
+    
+    // Range of lights of subtree, which is accepted without tests
+    int next;
+    int end;
+}
+LightsCulling;
+
+LightTree *
+build_light_tree(LightSource3d ** light_sources,
+                 const int light_sources_count);
+
+void
+release_light_tree(LightTree * tree);
+
+void
+start_lights_culling(LightsCulling * const culling,
+                     const LightTree * const tree,
+                     const LightsQuery * const query,
+                     const Float threshold);
+
+/*
+ * Index of the next light source, which can add at least threshold
+ * to a channel of diffuse or specular color. -1 - if there are no more lights
+ */
+int
+next_light(LightsCulling * const culling);
+
+/*
+ * Index of light source, which is chosen with probability proportional
+ * to the bound of its contribution, or -1 if no light on the path of sample can contribute.
+ * Random numbers depend on the point and on the number of sample,
+ * so the same hit always gets the same lights
+ */
+int
+sample_light(const LightTree * const tree,
+             const LightsQuery * const query,
+             const int sample,
+             Float * const probability);
+
+#endif
@@ -16,6 +16,14 @@ struct {
     
     Scene * scene;
     
+    // If not NULL - faces are added to the mesh instead of the scene
+    Mesh * mesh;
+    
+    // If not NULL - faces are added to the indexed mesh
+    // as triangles with material triangle_mesh_material
+    TriangleMesh * triangle_mesh;
+    int triangle_mesh_material;
+    
     Float sin_al_x;
     Float cos_al_x;
     
@@ -59,6 +67,9 @@ new_scene_face_handler_params(Scene * scene,
     
     SceneFaceHandlerParams params =
                     {.scene = scene,
+                     .mesh = NULL,
+                     .triangle_mesh = NULL,
+                     .triangle_mesh_material = 0,
                      .scale = scale,
                      .dx = dx,
                      .dy = dy,
@@ -74,4 +85,44 @@ new_scene_face_handler_params(Scene * scene,
     return  params;
 }
 
+/*
+ * Faces are added to the mesh without transformation
+ */
+static inline SceneFaceHandlerParams
+new_mesh_face_handler_params(Mesh * mesh,
+                             Color default_color,
+                             Material default_material) {
+    
+    SceneFaceHandlerParams params =
+                    new_scene_face_handler_params(NULL, 1, 0, 0, 0, 0, 0, 0,
+                                                  default_color, default_material);
+    params.mesh = mesh;
+    return params;
+}
+
+/*
+ * Faces are added to the indexed mesh with the same transformation,
+ * as by scene_face_handler. Vertexes with the same position and normal
+ * are shared by all faces of the file
+ */
+static inline SceneFaceHandlerParams
+new_triangle_mesh_face_handler_params(TriangleMesh * triangle_mesh,
+                                      Float scale,
+                                      Float dx,
+                                      Float dy,
+                                      Float dz,
+                                      Float al_x,
+                                      Float al_y,
+                                      Float al_z,
+                                      Color default_color,
+                                      Material default_material) {
+    
+    SceneFaceHandlerParams params =
+                    new_scene_face_handler_params(NULL, scale, dx, dy, dz, al_x, al_y, al_z,
+                                                  default_color, default_material);
+    params.triangle_mesh = triangle_mesh;
+    params.triangle_mesh_material = add_triangle_mesh_material(triangle_mesh, default_color, default_material);
+    return params;
+}
+
 #endif
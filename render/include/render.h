@@ -8,10 +8,20 @@
 #include <canvas.h>
 
 #ifdef RAY_INTERSECTIONS_STAT
-long
+// Counters of rendering (see render.c)
+extern long
 intersections_per_ray;
+
+extern long
+shadow_rays;
 #endif // RAY_INTERSECTIONS_STAT
 
+// Each thread keeps the chain of reflections of its ray,
+// so the limit of recursion can't exceed this size
+#ifndef RAY_STACK_SIZE
+    #define RAY_STACK_SIZE 64
+#endif // RAY_STACK_SIZE
+
 typedef
 int
 Boolean;
@@ -19,15 +29,49 @@ Boolean;
 #define True 1
 #define False 0
 
+#ifdef SINGLE_PRECISION
+
+// Twice as many rays per packet and half of memory of geometry,
+// secondary rays start at offset points (see offset_ray_origin)
+typedef
+float
+Float;
+
+// Integer of the same size as Float (lanes of comparisons of vectors)
+typedef
+int
+FloatBits;
+
+#define EPSILON 1e-5f
+
+#define FLOAT_MAX FLT_MAX
+
+#define FLOAT_EPSILON FLT_EPSILON
+
+// Conversion of scanf
+#define FLOAT_FORMAT "%f"
+
+#else
+
 // Using double for satisfactory accuracy
 typedef
 double
 Float;
 
+typedef
+long long
+FloatBits;
+
 #define EPSILON 1e-5
 
 #define FLOAT_MAX DBL_MAX
 
+#define FLOAT_EPSILON DBL_EPSILON
+
+#define FLOAT_FORMAT "%lf"
+
+#endif // SINGLE_PRECISION
+
 typedef
 struct {
     Float x;
@@ -51,6 +95,57 @@ struct {
 }
 Vector3d;
 
+// Number of rays, which are traced together by SIMD instructions:
+// as many Floats, as fit into the vector register
+// (doubles: SSE2 - 2, AVX - 4, AVX-512 - 8; floats - twice as many)
+#ifndef PACKET_SIZE
+    #if defined(__AVX512F__)
+        #define PACKET_SIZE (8 * 8 / sizeof(Float))
+    #elif defined(__AVX__)
+        #define PACKET_SIZE (4 * 8 / sizeof(Float))
+    #else
+        #define PACKET_SIZE (2 * 8 / sizeof(Float))
+    #endif
+#endif // PACKET_SIZE
+
+// Mask (bit per ray) of all rays of packet
+#define PACKET_MASK ((1 << PACKET_SIZE) - 1)
+
+// One coordinate of all rays of packet (GCC vector extension)
+typedef
+Float
+PacketFloat __attribute__((vector_size(PACKET_SIZE * sizeof(Float))));
+
+// Result of comparison of PacketFloat: -1 (all bits) or 0 for each ray
+typedef
+FloatBits
+PacketMask __attribute__((vector_size(PACKET_SIZE * sizeof(FloatBits))));
+
+typedef
+struct {
+    PacketFloat x;
+    PacketFloat y;
+    PacketFloat z;
+}
+PacketVector;
+
+// Coherent rays (e.g. primary rays of block of pixels) as structure of arrays
+typedef
+struct {
+    PacketVector start;
+    PacketVector vector;
+    
+    // Permutation of axes and shear of vectors (see ray_shear),
+    // kz is -1 when rays of packet have different permutations
+    int kx;
+    int ky;
+    int kz;
+    PacketFloat sx;
+    PacketFloat sy;
+    PacketFloat sz;
+}
+RayPacket;
+
 typedef
 struct {
     // Absolute location
@@ -82,28 +177,111 @@ struct {
 }
 Material;
 
+typedef
+struct {
+    Float x_min;
+    Float y_min;
+    Float z_min;
+    
+    Float x_max;
+    Float y_max;
+    Float z_max;
+}
+Voxel;
+
+// Built-in objects are intersected by acceleration structures
+// without callbacks, other objects are CUSTOM_OBJECT.
+// Triangles of MESH_OBJECT are placed into kd-tree of scene one by one
+// (other structures intersect it by callbacks)
+enum ObjectType {CUSTOM_OBJECT, TRIANGLE_OBJECT, SPHERE_OBJECT, MESH_OBJECT};
+
+// Intersection of ray with object. It is filled by the intersection test
+// and is read by shading, so nothing is computed twice.
+// Every object sets t, point and norm, other fields are set
+// only by objects, which use them for shading
+typedef
+struct {
+    // Distance to the intersection point (in lengths of vector of ray)
+    Float t;
+    Point3d point;
+    
+    // Normal vector of surface (not normalized and not interpolated)
+    Vector3d norm;
+    
+    // Intersected triangle of mesh
+    int primitive;
+    
+    // Weights of vertexes of triangle (barycentric coordinates of point)
+    Float w1;
+    Float w2;
+    Float w3;
+    
+    // Intersected Object3d of instance (the innermost one, if instances are nested),
+    // point and normal vector in its coordinates
+    // and rotation of its vectors to world coordinates (by rows)
+    const void * part;
+    Point3d part_point;
+    Vector3d part_norm;
+    Float part_rotation[3][3];
+}
+HitRecord;
+
 typedef 
 struct {
 	void * data;
     
+    enum ObjectType type;
+    
 	Boolean (*intersect)(const void * data,
                          const Point3d vector_start,
                          const Vector3d vector,
-                         Point3d * const intersection_point);
+                         HitRecord * const hit);
     
 	Color (*get_color)(const void * data,
-                       const Point3d intersection_point);
+                       const HitRecord * const hit);
     
     Vector3d (*get_normal_vector)(const void * data,
-                                  const Point3d intersection_point);
+                                  const HitRecord * const hit);
     
     Material (*get_material)(const void * data,
-                             const Point3d intersection_point);
+                             const HitRecord * const hit);
     
     Point3d (*get_min_boundary_point)(const void * data);
     
     Point3d (*get_max_boundary_point)(const void * data);
     
+    // Bounding box of the part of object, which is inside of voxel.
+    // Returns False if object doesn't intersect with voxel.
+    // Optional (can be NULL) - then bounding box of the whole object is clipped
+    Boolean (*clip_by_voxel)(const void * data,
+                             const Voxel v,
+                             Voxel * const clipped_box);
+    
+    // Intersects rays of packet, which are set in mask (bit per ray).
+    // Returns mask of intersected rays, their hits are written to the array,
+    // which is indexed by rays.
+    // Optional (can be NULL) - then each ray is intersected separately
+    int (*intersect_packet)(const void * data,
+                            const RayPacket * const packet,
+                            const int mask,
+                            HitRecord * const hits);
+    
+    // Checks, if object is intersected not farther than max_dist
+    // (shadow rays don't need the nearest intersection).
+    // Optional (can be NULL) - then intersect is used
+    Boolean (*is_intersected)(const void * data,
+                              const Point3d vector_start,
+                              const Vector3d vector,
+                              const Float max_dist);
+    
+    // The same for rays of packet, which are set in mask.
+    // Returns mask of intersected rays, max_dists are indexed by rays.
+    // Optional (can be NULL) - then intersect_packet is used
+    int (*is_intersected_packet)(const void * data,
+                                 const RayPacket * const packet,
+                                 const int mask,
+                                 const Float * const max_dists);
+    
 	void (*release_data)(void * data);
 }
 Object3d;
@@ -119,37 +297,272 @@ union {
 }
 Coord;
 
+// Geometry of built-in object, which is copied into kd-tree,
+// so traversal doesn't go to the object and its data
 typedef
 struct {
-    Float x_min;
-    Float y_min;
-    Float z_min;
+    enum ObjectType type;
     
-    Float x_max;
-    Float y_max;
-    Float z_max;
+    // Data of object (the intersection point is shaded by it)
+    const void * data;
+    
+    union {
+        struct {
+            Point3d p1;
+            Point3d p2;
+            Point3d p3;
+        } triangle;
+        
+        struct {
+            Point3d center;
+            Float radius;
+        } sphere;
+        
+        // Vertexes are not copied: triangle is referenced by index in mesh
+        struct {
+            const struct TriangleMesh * mesh;
+            int index;
+            
+            // Index of the mesh object in the array of objects of tree
+            int object;
+        } mesh_triangle;
+    } geometry;
 }
-Voxel;
+KDPrimitive;
 
+// Node of kd-tree (8 bytes).
+// Children of inner node are placed side by side in the array of nodes
 typedef
-struct KDNode {
-    enum Plane plane;
-    Coord coord;
+struct {
+    union {
+        // Coordinate of splitting plane (inner node)
+        float split;
+        // Position of the first object of leaf in the array of indexes of objects
+        unsigned int objects_offset;
+    } data;
+    
+    // Two lower bits - plane (NONE for leaf).
+    // Other bits - index of the left child (the right child follows it)
+    // or number of objects in leaf
+    unsigned int flags;
+}
+KDNode;
+
+// Parameters of building of kd-tree.
+// SAH compares only the ratio of costs of traversal step and of intersection test
+typedef
+struct {
+    int max_depth;
+    
+    // Nodes with this number of objects (or less) are not split
+    int objects_in_leaf;
+    
+    Float traversal_cost;
+    Float intersection_cost;
+}
+KDTreeParams;
+
+typedef
+struct {
+    // Root is the first node
+    KDNode * nodes;
+    int nodes_count;
+    
+    // Objects of each leaf are the range of this array
+    int * objects_indexes;
+    int objects_indexes_count;
     
     Object3d ** objects;
     int objects_count;
+    Voxel bounding_box;
+    
+    // Primitive of each object (CUSTOM_OBJECT - intersected by callbacks).
+    // NULL for the tree of mesh
+    KDPrimitive * primitives;
+    
+    // Triangles of MESH_OBJECT objects. Leaves reference i-th of them
+    // by the negative index (-1 - i), so indexes of objects are not changed
+    KDPrimitive * mesh_primitives;
+    int mesh_primitives_count;
+    
+    // Triangles of leaves, which are intersected by SIMD groups (see kdtree.c).
+    // Groups of leaf are found by the position of its node
+    struct KDTriangleGroup * triangle_groups;
+    int triangle_groups_count;
+    int triangle_groups_capacity;
+    int triangle_groups_garbage;
+    struct KDLeafGroups * leaf_groups;
     
-    struct KDNode * l;
-    struct KDNode * r;
+    // Not NULL when objects of tree are triangles of indexed mesh
+    // (objects is NULL then): tree references them by index in the mesh
+    const struct TriangleMesh * mesh;
+    
+    // Parameters, which are used by building and by updates of tree
+    KDTreeParams params;
+    
+    // Not NULL when arrays of tree are mapped from the cache file
+    void * mapping;
+    size_t mapping_size;
+    
+    // Sizes of allocated arrays, which grow by inserting of objects
+    int nodes_capacity;
+    int objects_indexes_capacity;
+    int primitives_capacity;
+    
+    // Number of objects indexes, which don't belong to any leaf
+    int garbage_count;
+    
+    // SAH cost of tree after building and after updates
+    Float built_cost;
+    Float cost;
 }
-KDNode;
+KDTree;
 
+// Node of bounding volume hierarchy with 4 children.
+// Boxes of children are stored as structure of arrays: bounds[min/max][axis][child],
+// so all 4 boxes are tested by the single vectorized loop
 typedef
 struct {
-    KDNode * root;
+    float bounds[2][3][4];
+    
+    // Index of child node or offset of objects of leaf in objects_indexes
+    int children[4];
+    
+    // Number of objects in leaf, 0 - for inner node and for empty slot
+    int counts[4];
+}
+BVHNode;
+
+typedef
+struct {
+    // Root is the first node
+    BVHNode * nodes;
+    int nodes_count;
+    int nodes_capacity;
+    
+    // Each object is referenced by exactly one leaf.
+    // Ranges of leaves, which were moved by insertion of objects, are garbage
+    int * objects_indexes;
+    int objects_indexes_count;
+    int objects_indexes_capacity;
+    int garbage_count;
+    int objects_count;
+    
+    // Objects, which were inserted and removed since the build
+    int updates_count;
+    int built_objects_count;
+    
+    Object3d ** objects;
+}
+BVH;
+
+enum AccelerationStructure {KD_TREE_STRUCTURE, BVH_STRUCTURE};
+
+// Node of binary tree of light sources. Sphere around lights of subtree gives
+// the upper bound of their contribution, so subtrees are culled or sampled at once
+typedef
+struct {
+    Point3d center;
+    Float radius;
+    
+    // The largest channel of color of each light of subtree is taken:
+    // their maximum, minimum and sum
+    Float max_intensity;
+    Float min_intensity;
+    Float intensity;
+    
+    // Left child follows its parent, index of right child - for inner node
+    // (-1 for leaf, which has the single light)
+    int right;
+    
+    // Range of lights of subtree in the array of tree
+    int first;
+    int count;
+}
+LightTreeNode;
+
+typedef
+struct {
+    // Root is the first node
+    LightTreeNode * nodes;
+    int nodes_count;
+    
+    // Indexes of light sources of scene in the order of leaves
+    int * lights;
+    int lights_count;
+}
+LightTree;
+
+// Packet rendering traces each block of pixels to the end of its reflections.
+// Wavefront rendering traces tiles of pixels stage by stage (see trace_wavefront)
+enum RenderingMode {PACKET_RENDERING, WAVEFRONT_RENDERING};
+
+// How shading chooses light sources of the hit:
+// all of them, lights which can add at least threshold to a channel of color,
+// or fixed number of lights which are sampled by their importance
+enum LightSelection {ALL_LIGHTS, CULLED_LIGHTS, SAMPLED_LIGHTS};
+
+// Objects in local coordinates, which are shared by instances.
+// Mesh has its own BVH, so scene's structure holds only instances
+typedef
+struct {
+    Object3d ** objects;
+    int objects_count;
+    int last_object_index;
+    
+    BVH * bvh;
     Voxel bounding_box;
+    
+    // Mesh is released together with the last of its instances
+    int references;
 }
-KDTree;
+Mesh;
+
+// Triangle of TriangleMesh: indexes of its vertexes and of its material
+typedef
+struct {
+    int vertexes[3];
+    int material;
+}
+MeshTriangle;
+
+typedef
+struct {
+    Color color;
+    Material material;
+}
+MeshMaterial;
+
+// Triangles, which share vertexes: positions, normals and texture points
+// are stored once, triangle keeps only their indexes.
+// Mesh is the single object of scene: kd-tree of scene references
+// its triangles by indexes, BVH intersects it by its own kd-tree
+typedef
+struct TriangleMesh {
+    Point3d * vertexes;
+    
+    // NULL if mesh is created without normals (triangles are flat).
+    // Triangle with zero normal of any vertex is flat too
+    Vector3d * norms;
+    
+    // NULL if mesh is created without texture
+    Point2d * texture_points;
+    Canvas * texture;
+    
+    int vertexes_count;
+    int vertexes_capacity;
+    
+    MeshTriangle * triangles;
+    int triangles_count;
+    int triangles_capacity;
+    
+    MeshMaterial * materials;
+    int materials_count;
+    
+    KDTree * kd_tree;
+    Voxel bounding_box;
+}
+TriangleMesh;
 //
 
 typedef
@@ -159,13 +572,34 @@ struct {
     int objects_count;
     int last_object_index;
     
+    // Structure, which is built by prepare_scene
+    enum AccelerationStructure acceleration_structure;
+    
     KDTree * kd_tree;
+    BVH * bvh;
+    
+    KDTreeParams kd_tree_params;
+    
+    // Kd-tree is saved to this file and loaded from it on the next start
+    char * kd_tree_cache_file;
     
     // Array of pointers to light sources
     LightSource3d ** light_sources;
     int light_sources_count;
     int last_light_source_index;
     
+    // Tree of light sources exists, if selection is not ALL_LIGHTS
+    enum LightSelection light_selection;
+    LightTree * light_tree;
+    Float lights_threshold;
+    int lights_per_hit;
+    
+    // Limits of the chain of reflections (see set_reflections_limits)
+    int max_ray_recursion_level;
+    Float threshold_ray_intensity;
+    
+    enum RenderingMode rendering_mode;
+    
     Color background_color;
     
     // Required to return value from interval [0..1]
@@ -217,13 +651,88 @@ new_scene(const int objects_count,
 void
 release_scene(Scene * scene);
 
+/*
+ * Objects can be added and removed after prepare_scene:
+ * kd-tree is updated locally and rebuilt only when its quality becomes too low,
+ * BVH is updated locally and rebuilt after as many updates as it had objects
+ */
 void
 add_object(Scene * const scene,
            Object3d * const object);
 
+/*
+ * Object is not released - it is returned to the caller
+ */
+void
+remove_object(Scene * const scene,
+              Object3d * const object);
+
 void
 prepare_scene(Scene * const scene);
 
+/*
+ * Kd-tree is used by default
+ */
+void
+set_acceleration_structure(Scene * const scene,
+                           const enum AccelerationStructure structure);
+
+/*
+ * Packet rendering is used by default. Both modes render the same image
+ */
+void
+set_rendering_mode(Scene * const scene,
+                   const enum RenderingMode mode);
+
+/*
+ * Built kd-tree is saved to the file and reused by the next prepare_scene
+ * if objects and parameters of building are the same.
+ * Key includes vertexes of triangles and spheres, other objects
+ * are known only by their bounding boxes: file has to be removed,
+ * if shape of such object was changed without changing of its bounding box.
+ */
+void
+set_kd_tree_cache(Scene * const scene,
+                  const char * const file_name);
+
+KDTreeParams
+kd_tree_params(const int max_depth,
+               const int objects_in_leaf,
+               const Float traversal_cost,
+               const Float intersection_cost);
+
+/*
+ * Kd-tree is rebuilt with new parameters if scene is already prepared
+ */
+void
+set_kd_tree_params(Scene * const scene,
+                   const KDTreeParams params);
+
+/*
+ * Measures costs of traversal step and of intersection test on this CPU,
+ * then builds trees with different depth and size of leaf
+ * and chooses the fastest one for primary rays of camera.
+ * Chosen parameters are set to the scene and returned.
+ * Takes about 12 builds of kd-tree (4 depths x 3 sizes of leaf)
+ * and tracing of 64 x 64 rays by each tree
+ */
+KDTreeParams
+tune_kd_tree(Scene * const scene,
+             const Camera * const camera,
+             const int canvas_w,
+             const int canvas_h);
+
+/*
+ * Reflected ray is traced, if there were less than max_recursion_level
+ * reflections before it and intensity of ray, which it reflects, is greater
+ * than threshold_intensity. Primary ray has intensity 100, it is multiplied
+ * by Kr and by transparency of fog at each reflection
+ */
+void
+set_reflections_limits(Scene * const scene,
+                       const int max_recursion_level,
+                       const Float threshold_intensity);
+
 void
 set_exponential_fog(Scene * const scene,
                     const Float k);
@@ -236,10 +745,61 @@ trace(const Scene * const scene,
       const Camera * const camera,
       Vector3d vector);
 
+/*
+ * Traces PACKET_SIZE coherent rays from camera at once
+ * (through kd-tree or BVH of the scene)
+ */
+void
+trace_packet(const Scene * const scene,
+             const Camera * const camera,
+             const Vector3d * const vectors,
+             Color * const colors);
+
+/*
+ * Traces count rays from camera by stages: intersection of all rays,
+ * shadow rays of all hits, reflected rays of all hits and so on.
+ * Each PACKET_SIZE consecutive rays are traced as packet by the first stage
+ */
+void
+trace_wavefront(const Scene * const scene,
+                const Camera * const camera,
+                const Vector3d * const vectors,
+                const int count,
+                Color * const colors);
+
+/*
+ * Tree of lights for culling and sampling is built by prepare_scene
+ * (and by set_lights_culling, set_lights_sampling). Light source, which is added
+ * after it, drops the tree: hits are lit by all lights until the next prepare_scene
+ */
 void
 add_light_source(Scene * const scene,
                  LightSource3d * const light_source);
 
+/*
+ * Each hit is lit by all light sources (default)
+ */
+void
+set_all_lights(Scene * const scene);
+
+/*
+ * Light sources, which can't add threshold to any channel of color
+ * of the hit, are skipped without shadow rays. Color of light is truncated
+ * to integer, so threshold 1 doesn't change the image
+ */
+void
+set_lights_culling(Scene * const scene,
+                   const Float threshold);
+
+/*
+ * Each hit is lit by lights_per_hit light sources, which are sampled
+ * with probability proportional to the bound of their contribution.
+ * Contribution of sampled light is divided by its probability
+ */
+void
+set_lights_sampling(Scene * const scene,
+                    const int lights_per_hit);
+
 /***************************************************
  *                    3D objects                   *
  ***************************************************/
@@ -293,6 +853,83 @@ material(const Float Ka,
          const Float Kt,
          const Float p);
 
+/***************************************************
+ *                     Mesh                        *
+ ***************************************************/
+
+Mesh *
+new_mesh(const int objects_count);
+
+void
+add_mesh_object(Mesh * const mesh,
+                Object3d * const object);
+
+/*
+ * Mesh is actually released after release of all its instances
+ */
+void
+release_mesh(Mesh * mesh);
+
+/*
+ * Copy of mesh, which is transformed in the same way
+ * as objects of scene_face_handler: rotation, scaling and offset.
+ * Mesh must be complete - instance builds BVH of the mesh
+ */
+Object3d *
+new_instance(Mesh * const mesh,
+             const Float scale,
+             const Float dx,
+             const Float dy,
+             const Float dz,
+             const Float al_x,
+             const Float al_y,
+             const Float al_z);
+
+/***************************************************
+ *                 Triangle mesh                   *
+ ***************************************************/
+
+/*
+ * Normals of vertexes are interpolated (as by new_triangle_with_norms)
+ * if mesh is created with norms, texture points of vertexes are used
+ * (as by new_triangle_with_texture) if texture is not NULL
+ */
+TriangleMesh *
+new_triangle_mesh(const Boolean with_norms,
+                  Canvas * texture);
+
+/*
+ * Returns index of the vertex. Norm and texture point are ignored,
+ * if mesh is created without them. Zero norm makes triangles of vertex flat
+ */
+int
+add_triangle_mesh_vertex(TriangleMesh * const mesh,
+                         const Point3d p,
+                         const Vector3d n,
+                         const Point2d t);
+
+/*
+ * Returns index of the material
+ */
+int
+add_triangle_mesh_material(TriangleMesh * const mesh,
+                           const Color color,
+                           const Material material);
+
+void
+add_triangle_mesh_triangle(TriangleMesh * const mesh,
+                           const int v1,
+                           const int v2,
+                           const int v3,
+                           const int material);
+
+/*
+ * Mesh must be complete - object builds kd-tree of the mesh.
+ * Mesh is released together with the object
+ */
+Object3d *
+new_triangle_mesh_object(TriangleMesh * const mesh);
+
 /***************************************************
  *                     Camera                      *
  ***************************************************/
@@ -4,6 +4,13 @@
 #include <render.h>
 #include <math.h>
 
+// Offset of the start of secondary ray (see offset_ray_origin)
+#ifndef RAY_ORIGIN_ULPS
+    #define RAY_ORIGIN_ULPS 32
+#endif // RAY_ORIGIN_ULPS
+#define RAY_ORIGIN_NEAR (1.0 / 32)
+#define RAY_ORIGIN_OFFSET (128 * FLOAT_EPSILON)
+
 static inline Vector3d
 cross_product(const Vector3d a,
               const Vector3d b) {
@@ -58,6 +65,44 @@ reflect_ray(const Vector3d incident_ray,
     return vector3df(x, y, z);
 }
 
+/*
+ * Start of secondary ray, which doesn't intersect the surface of point again
+ * (Waechter, Binder). Point is moved from the surface to the side of vector by
+ * RAY_ORIGIN_ULPS units in the last place of each coordinate - error of point
+ * grows with coordinates. Coordinates near zero are moved by absolute distance
+ */
+static inline Point3d
+offset_ray_origin(const Point3d point,
+                  const Vector3d norm_v,
+                  const Vector3d vector) {
+    
+    const Float module = module_vector(norm_v);
+    if(module == 0)
+        return point;
+    
+    const Float k = ((dot_product(norm_v, vector) < 0) ? -1 : 1) / module;
+    const Float n[3] = {norm_v.x * k, norm_v.y * k, norm_v.z * k};
+    Float p[3] = {point.x, point.y, point.z};
+    int i;
+    
+    for(i = 0; i < 3; i++) {
+        if(fabs(p[i]) < RAY_ORIGIN_NEAR) {
+            p[i] += RAY_ORIGIN_OFFSET * n[i];
+        } else {
+            union {
+                Float f;
+                FloatBits bits;
+            } u;
+            
+            const FloatBits ulps = (FloatBits) (RAY_ORIGIN_ULPS * n[i]);
+            u.f = p[i];
+            u.bits += (p[i] < 0) ? -ulps : ulps;
+            p[i] = u.f;
+        }
+    }
+    return point3d(p[0], p[1], p[2]);
+}
+
 // TODO: use matrixes
 static inline Point3d
 rotate_point_x(const Point3d p,
@@ -125,4 +170,131 @@ rotate_vector_z(const Vector3d p,
     
 	return vector3df(x, y, p.z);
 }
+
+/*
+ * Ray from camera through the point (x, y) of canvas of canvas_w x canvas_h pixels,
+ * in coordinates of camera (center of canvas is on the axis of camera)
+ */
+static inline Vector3d
+camera_ray_vector(const Camera * const camera,
+                  const Float x,
+                  const Float y,
+                  const int canvas_w,
+                  const int canvas_h) {
+    
+    return vector3df(x - canvas_w / 2.0, y - canvas_h / 2.0, camera->proj_plane_dist);
+}
+
+static inline Vector3d
+camera_to_world_vector(const Camera * const camera,
+                       const Vector3d v) {
+    
+    Vector3d r = rotate_vector_x(v, camera->sin_al_x, camera->cos_al_x);
+    r = rotate_vector_z(r, camera->sin_al_z, camera->cos_al_z);
+    return rotate_vector_y(r, camera->sin_al_y, camera->cos_al_y);
+}
+
+// Ray packets
+static inline PacketFloat
+packet_float(const Float x) {
+    PacketFloat p;
+    int i;
+    for(i = 0; i < PACKET_SIZE; i++) {
+        p[i] = x;
+    }
+    return p;
+}
+
+// Bit per ray, which is set when comparison is true for it
+static inline int
+packet_mask_bits(const PacketMask m) {
+    int bits = 0;
+    int i;
+    for(i = 0; i < PACKET_SIZE; i++) {
+        bits |= (m[i] & 1) << i;
+    }
+    return bits;
+}
+
+// Bitwise selection: a for rays of mask, b for other rays
+static inline PacketFloat
+packet_select(const PacketMask mask,
+              const PacketFloat a,
+              const PacketFloat b) {
+    
+    return (PacketFloat) ((mask & (PacketMask) a) | (~mask & (PacketMask) b));
+}
+
+/*
+ * Permutation of axes, which makes the biggest component of vector z
+ * (x and y are swapped, when it is negative - to keep the winding of triangles),
+ * and shear, which makes vector parallel to z: x - sx * z, y - sy * z, sz * z.
+ * Used by watertight intersection of triangles
+ */
+static inline void
+ray_shear(const Vector3d vector,
+          int * const kx,
+          int * const ky,
+          int * const kz,
+          Float * const sx,
+          Float * const sy,
+          Float * const sz) {
+    
+    const Float dir[3] = {vector.x, vector.y, vector.z};
+    
+    const Float x = fabs(vector.x);
+    const Float y = fabs(vector.y);
+    const Float z = fabs(vector.z);
+    *kz = (x > y) ? ((x > z) ? 0 : 2) : ((y > z) ? 1 : 2);
+    *kx = (*kz + 1) % 3;
+    *ky = (*kx + 1) % 3;
+    
+    if(dir[*kz] < 0) {
+        const int k = *kx;
+        *kx = *ky;
+        *ky = k;
+    }
+    
+    *sz = 1 / dir[*kz];
+    *sx = dir[*kx] * *sz;
+    *sy = dir[*ky] * *sz;
+}
+
+static inline RayPacket
+ray_packet(const Point3d * const starts,
+           const Vector3d * const vectors) {
+    
+    RayPacket p;
+    int i;
+    for(i = 0; i < PACKET_SIZE; i++) {
+        p.start.x[i] = starts[i].x;
+        p.start.y[i] = starts[i].y;
+        p.start.z[i] = starts[i].z;
+        
+        p.vector.x[i] = vectors[i].x;
+        p.vector.y[i] = vectors[i].y;
+        p.vector.z[i] = vectors[i].z;
+        
+        int kx;
+        int ky;
+        int kz;
+        Float sx;
+        Float sy;
+        Float sz;
+        ray_shear(vectors[i], &kx, &ky, &kz, &sx, &sy, &sz);
+        
+        p.sx[i] = sx;
+        p.sy[i] = sy;
+        p.sz[i] = sz;
+        
+        if(!i) {
+            p.kx = kx;
+            p.ky = ky;
+            p.kz = kz;
+        } else if((kx != p.kx) || (ky != p.ky) || (kz != p.kz)) {
+            p.kz = -1;
+        }
+    }
+    return p;
+}
 #endif
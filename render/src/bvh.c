@@ -0,0 +1,1388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include <render.h>
+#include <bvh.h>
+#include <kdtree.h>
+#include <utils.h>
+
+#include <omp.h>
+
+// Number of buckets per axis, which are used by binned SAH
+#ifndef BVH_BINS
+    #define BVH_BINS 16
+#endif // BVH_BINS
+
+// Cost of visiting of node, relative to the cost of intersection with object
+#ifndef BVH_TRAVERSAL_COST
+    #define BVH_TRAVERSAL_COST 1.0
+#endif // BVH_TRAVERSAL_COST
+
+// Nodes with more objects are always split
+#define BVH_MAX_LEAF 16
+
+#define BVH_MAX_DEPTH 64
+
+// Subtrees with more objects are built as separate tasks
+#ifndef BVH_PARALLEL_THRESHOLD
+    #define BVH_PARALLEL_THRESHOLD 4096
+#endif // BVH_PARALLEL_THRESHOLD
+
+// Boxes are stored as floats, so they are extended by this relative value.
+// It covers rounding of boxes and of rays
+#define BVH_BOX_PADDING (1.0 / (1 << 20))
+
+// Each level of tree postpones at most 3 children
+#define BVH_STACK_SIZE (3 * BVH_MAX_DEPTH + 1)
+
+#ifdef RAY_INTERSECTIONS_STAT
+extern long
+intersections_per_ray;
+#endif // RAY_INTERSECTIONS_STAT
+
+// Declarations
+// --------------------------------------------------------------
+
+// Node of binary tree, which is being built.
+// When building is finished - tree is collapsed to the array of BVHNode
+typedef
+struct BVHBuildNode {
+    Voxel box;
+    
+    // Range of objects in the array of indexes
+    int from;
+    int count;
+    
+    struct BVHBuildNode * l;
+    struct BVHBuildNode * r;
+}
+BVHBuildNode;
+
+typedef
+struct {
+    int count;
+    Voxel box;
+}
+BVHBin;
+
+// Ray in floats - for the slab tests
+typedef
+struct {
+    float origin[3];
+    float inv_direction[3];
+    
+    // 1 if ray goes in negative direction of axis:
+    // near side of box is its maximum
+    int sign[3];
+}
+BVHRay;
+
+static BVHBuildNode *
+build_bvh_node(const BoundingBoxes * const boxes,
+               Float * const centroids[3],
+               int * const indexes,
+               const int from,
+               const int count,
+               const int depth);
+
+static inline int
+centroid_bin(const Float centroid,
+             const Float min,
+             const Float k);
+
+static inline Voxel
+empty_box(void);
+
+static inline void
+extend_box(Voxel * const box,
+           const Voxel b);
+
+static inline Float
+box_area(const Voxel box);
+
+static int
+count_inner_nodes(const BVHBuildNode * const node);
+
+static int
+flatten_bvh_node(BVH * const bvh,
+                 const BVHBuildNode * const node);
+
+static void
+release_bvh_build_node(BVHBuildNode * node);
+
+static inline int
+intersect_node_boxes(const BVHNode * const node,
+                     const BVHRay * const ray,
+                     const float t_max,
+                     float * const t_near);
+
+static inline BVHRay
+new_bvh_ray(const Point3d vector_start,
+            const Vector3d vector);
+
+static inline void
+new_bvh_packet_rays(const RayPacket * const packet,
+                    Point3d * const starts,
+                    Vector3d * const vectors,
+                    BVHRay * const rays);
+
+static inline int
+intersect_node_boxes_packet(const BVHNode * const node,
+                            const BVHRay * const rays,
+                            const int mask,
+                            const float * const t_max,
+                            int * const children_masks,
+                            float * const children_t);
+
+static inline int
+intersect_object_packet(const Object3d * const obj,
+                        const RayPacket * const packet,
+                        const Point3d * const starts,
+                        const Vector3d * const vectors,
+                        const int mask,
+                        HitRecord * const hits);
+
+static inline int
+is_object_intersected_packet(const Object3d * const obj,
+                             const RayPacket * const packet,
+                             const Point3d * const starts,
+                             const Vector3d * const vectors,
+                             const int mask,
+                             const Float * const max_dists);
+
+static inline void
+padded_box(const Voxel b,
+           float * const min,
+           float * const max);
+
+static inline void
+clear_slot(BVHNode * const node,
+           const int i);
+
+static inline void
+extend_slot_box(BVHNode * const node,
+                const int i,
+                const Voxel b);
+
+static inline Voxel
+slot_box(const BVHNode * const node,
+         const int i);
+
+static inline Boolean
+slot_contains_box(const BVHNode * const node,
+                  const int i,
+                  const float * const min,
+                  const float * const max);
+
+static inline Voxel
+object_box(const Object3d * const obj);
+
+static inline void
+reserve_bvh_objects_indexes(BVH * const bvh,
+                            const int count);
+
+static void
+append_leaf_object(BVH * const bvh,
+                   BVHNode * const node,
+                   const int slot,
+                   const int index);
+
+static void
+split_bvh_leaf(BVH * const bvh,
+               const int node_index,
+               const int slot,
+               const int index);
+
+static Boolean
+replace_bvh_object(BVH * const bvh,
+                   const int node_index,
+                   const float * const min,
+                   const float * const max,
+                   const int index,
+                   const int new_index);
+
+static void
+compact_bvh_objects_indexes(BVH * const bvh);
+
+// Code
+// --------------------------------------------------------------
+
+BVH *
+build_bvh(Object3d ** objects,
+          const int objects_count) {
+    
+    BVH * bvh = malloc(sizeof(BVH));
+    bvh->objects = objects;
+    bvh->objects_count = objects_count;
+    bvh->objects_indexes_capacity = objects_count + 1;
+    bvh->objects_indexes_count = objects_count;
+    bvh->objects_indexes = malloc(bvh->objects_indexes_capacity * sizeof(int));
+    bvh->garbage_count = 0;
+    bvh->updates_count = 0;
+    bvh->built_objects_count = objects_count;
+    
+    BoundingBoxes * boxes = new_bounding_boxes(objects, objects_count);
+    
+    Float * centroids[3];
+    centroids[0] = malloc(3 * (objects_count + 1) * sizeof(Float));
+    centroids[1] = centroids[0] + objects_count;
+    centroids[2] = centroids[1] + objects_count;
+    
+    int i;
+    for(i = 0; i < objects_count; i++) {
+        centroids[0][i] = (boxes->x_min[i] + boxes->x_max[i]) / 2;
+        centroids[1][i] = (boxes->y_min[i] + boxes->y_max[i]) / 2;
+        centroids[2][i] = (boxes->z_min[i] + boxes->z_max[i]) / 2;
+        bvh->objects_indexes[i] = i;
+    }
+    
+    BVHBuildNode * root;
+    
+    #pragma omp parallel
+    {
+        #pragma omp single
+        root = build_bvh_node(boxes, centroids, bvh->objects_indexes, 0, objects_count, 0);
+    }
+    
+    free(centroids[0]);
+    release_bounding_boxes(boxes);
+    
+    bvh->nodes_capacity = count_inner_nodes(root) + 1;
+    bvh->nodes = malloc(bvh->nodes_capacity * sizeof(BVHNode));
+    bvh->nodes_count = 0;
+    flatten_bvh_node(bvh, root);
+    
+    release_bvh_build_node(root);
+    return bvh;
+}
+
+void
+release_bvh(BVH * bvh) {
+    free(bvh->nodes);
+    free(bvh->objects_indexes);
+    free(bvh);
+}
+
+/*
+ * Object goes down to the child, which box grows the least,
+ * and is added to the leaf or to the empty slot on the way.
+ * Full leaf is split into the new node with 4 leaves
+ */
+Boolean
+insert_bvh_object(BVH * const bvh,
+                  const int index) {
+    
+    const Voxel box = object_box(bvh->objects[index]);
+    
+    if(bvh->objects_count <= index)
+        bvh->objects_count = index + 1;
+    
+    int node_index = 0;
+    int depth = 0;
+    int i;
+    
+    for(;;) {
+        BVHNode * const node = &bvh->nodes[node_index];
+        
+        int slot = -1;
+        Float best_growth = FLOAT_MAX;
+        Float best_area = FLOAT_MAX;
+        for(i = 0; i < 4; i++) {
+            if(!node->children[i] && !node->counts[i]) {
+                slot = i;
+                break;
+            }
+            
+            Voxel b = slot_box(node, i);
+            const Float area = box_area(b);
+            extend_box(&b, box);
+            const Float growth = box_area(b) - area;
+            
+            if((growth < best_growth) || ((growth == best_growth) && (area < best_area))) {
+                slot = i;
+                best_growth = growth;
+                best_area = area;
+            }
+        }
+        
+        extend_slot_box(node, slot, box);
+        
+        if(!node->counts[slot] && node->children[slot]) {
+            node_index = node->children[slot];
+            depth++;
+            continue;
+        }
+        
+        if(!node->counts[slot]) {
+            reserve_bvh_objects_indexes(bvh, 1);
+            node->children[slot] = bvh->objects_indexes_count;
+            node->counts[slot] = 1;
+            bvh->objects_indexes[bvh->objects_indexes_count++] = index;
+        } else if((node->counts[slot] < BVH_MAX_LEAF) || (depth + 1 >= BVH_MAX_DEPTH)) {
+            append_leaf_object(bvh, node, slot, index);
+        } else {
+            split_bvh_leaf(bvh, node_index, slot, index);
+        }
+        break;
+    }
+    
+    if(bvh->garbage_count > bvh->objects_indexes_count / 2)
+        compact_bvh_objects_indexes(bvh);
+    
+    return ++bvh->updates_count > bvh->built_objects_count;
+}
+
+/*
+ * Removes object from its leaf. If object is not the last one,
+ * the last object takes its index (as it happens in the array of scene objects).
+ * Bounding box of the object must be the same as at the moment of insertion.
+ * Boxes of nodes are not shrunk
+ */
+Boolean
+remove_bvh_object(BVH * const bvh,
+                  const int index) {
+    
+    const int last = bvh->objects_count - 1;
+    float min[3];
+    float max[3];
+    
+    padded_box(object_box(bvh->objects[index]), min, max);
+    replace_bvh_object(bvh, 0, min, max, index, -1);
+    
+    if(index != last) {
+        padded_box(object_box(bvh->objects[last]), min, max);
+        replace_bvh_object(bvh, 0, min, max, last, index);
+    }
+    bvh->objects_count--;
+    
+    if(bvh->garbage_count > bvh->objects_indexes_count / 2)
+        compact_bvh_objects_indexes(bvh);
+    
+    return ++bvh->updates_count > bvh->built_objects_count;
+}
+
+/*
+ * Binned SAH by centroids of objects.
+ * Objects of each node are the continuous range of indexes,
+ * which is partitioned in place between children
+ */
+static BVHBuildNode *
+build_bvh_node(const BoundingBoxes * const boxes,
+               Float * const centroids[3],
+               int * const indexes,
+               const int from,
+               const int count,
+               const int depth) {
+    
+    BVHBuildNode * node = malloc(sizeof(BVHBuildNode));
+    node->from = from;
+    node->count = count;
+    node->l = NULL;
+    node->r = NULL;
+    node->box = empty_box();
+    
+    Float c_min[3] = {FLOAT_MAX, FLOAT_MAX, FLOAT_MAX};
+    Float c_max[3] = {-FLOAT_MAX, -FLOAT_MAX, -FLOAT_MAX};
+    
+    int i;
+    int a;
+    for(i = from; i < from + count; i++) {
+        const int index = indexes[i];
+        const Voxel b = {boxes->x_min[index], boxes->y_min[index], boxes->z_min[index],
+                         boxes->x_max[index], boxes->y_max[index], boxes->z_max[index]};
+        extend_box(&node->box, b);
+        
+        for(a = 0; a < 3; a++) {
+            c_min[a] = (centroids[a][index] < c_min[a]) ? centroids[a][index] : c_min[a];
+            c_max[a] = (centroids[a][index] > c_max[a]) ? centroids[a][index] : c_max[a];
+        }
+    }
+    
+    if((count <= 1) || (depth >= BVH_MAX_DEPTH)) {
+        return node;
+    }
+    
+    const Float area = box_area(node->box);
+    
+    Float best_cost = FLOAT_MAX;
+    int best_axis = -1;
+    int best_bin = 0;
+    
+    BVHBin bins[BVH_BINS];
+    Float r_areas[BVH_BINS];
+    int b;
+    
+    for(a = 0; a < 3; a++) {
+        if(c_max[a] <= c_min[a])
+            continue;
+        
+        const Float k = BVH_BINS / (c_max[a] - c_min[a]);
+        
+        for(b = 0; b < BVH_BINS; b++) {
+            bins[b].count = 0;
+            bins[b].box = empty_box();
+        }
+        
+        for(i = from; i < from + count; i++) {
+            const int index = indexes[i];
+            const Voxel box = {boxes->x_min[index], boxes->y_min[index], boxes->z_min[index],
+                               boxes->x_max[index], boxes->y_max[index], boxes->z_max[index]};
+            
+            b = centroid_bin(centroids[a][index], c_min[a], k);
+            bins[b].count++;
+            extend_box(&bins[b].box, box);
+        }
+        
+        // Areas of boxes of all buckets at the right side of each border
+        Voxel r_box = empty_box();
+        for(b = BVH_BINS - 1; b > 0; b--) {
+            extend_box(&r_box, bins[b].box);
+            r_areas[b] = box_area(r_box);
+        }
+        
+        // Border b is between (b - 1)-th and b-th buckets
+        Voxel l_box = empty_box();
+        int l_count = 0;
+        for(b = 1; b < BVH_BINS; b++) {
+            extend_box(&l_box, bins[b - 1].box);
+            l_count += bins[b - 1].count;
+            
+            if(!l_count || (l_count == count))
+                continue;
+            
+            const Float cost = BVH_TRAVERSAL_COST
+                               + (box_area(l_box) * l_count + r_areas[b] * (count - l_count)) / area;
+            
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
+    }
+    
+    int middle;
+    if(best_axis < 0) {
+        // Centroids of all objects are the same
+        if(count <= BVH_MAX_LEAF)
+            return node;
+        middle = from + count / 2;
+    } else {
+        if((best_cost >= count) && (count <= BVH_MAX_LEAF))
+            return node;
+        
+        const Float * centroid = centroids[best_axis];
+        const Float k = BVH_BINS / (c_max[best_axis] - c_min[best_axis]);
+        
+        int l = from;
+        int r = from + count - 1;
+        while(l <= r) {
+            if(centroid_bin(centroid[indexes[l]], c_min[best_axis], k) < best_bin) {
+                l++;
+            } else {
+                const int tmp = indexes[l];
+                indexes[l] = indexes[r];
+                indexes[r--] = tmp;
+            }
+        }
+        middle = l;
+    }
+    
+    // Children don't share objects, so big subtrees are built by different threads
+    if(count > BVH_PARALLEL_THRESHOLD) {
+        #pragma omp task shared(node)
+        node->l = build_bvh_node(boxes, centroids, indexes, from, middle - from, depth + 1);
+        
+        node->r = build_bvh_node(boxes, centroids, indexes, middle, from + count - middle, depth + 1);
+        
+        #pragma omp taskwait
+    } else {
+        node->l = build_bvh_node(boxes, centroids, indexes, from, middle - from, depth + 1);
+        node->r = build_bvh_node(boxes, centroids, indexes, middle, from + count - middle, depth + 1);
+    }
+    
+    return node;
+}
+
+static inline int
+centroid_bin(const Float centroid,
+             const Float min,
+             const Float k) {
+    
+    const int b = (int) ((centroid - min) * k);
+    return (b < BVH_BINS) ? b : BVH_BINS - 1;
+}
+
+static inline Voxel
+empty_box(void) {
+    Voxel box = {FLOAT_MAX, FLOAT_MAX, FLOAT_MAX, -FLOAT_MAX, -FLOAT_MAX, -FLOAT_MAX};
+    return box;
+}
+
+static inline void
+extend_box(Voxel * const box,
+           const Voxel b) {
+    
+    box->x_min = (b.x_min < box->x_min) ? b.x_min : box->x_min;
+    box->y_min = (b.y_min < box->y_min) ? b.y_min : box->y_min;
+    box->z_min = (b.z_min < box->z_min) ? b.z_min : box->z_min;
+    
+    box->x_max = (b.x_max > box->x_max) ? b.x_max : box->x_max;
+    box->y_max = (b.y_max > box->y_max) ? b.y_max : box->y_max;
+    box->z_max = (b.z_max > box->z_max) ? b.z_max : box->z_max;
+}
+
+static inline Float
+box_area(const Voxel box) {
+    const Float hx = box.x_max - box.x_min;
+    const Float hy = box.y_max - box.y_min;
+    const Float hz = box.z_max - box.z_min;
+    return hx * hy + hx * hz + hy * hz;
+}
+
+static int
+count_inner_nodes(const BVHBuildNode * const node) {
+    if(!node->l)
+        return 0;
+    return 1 + count_inner_nodes(node->l) + count_inner_nodes(node->r);
+}
+
+/*
+ * Collapses binary tree to the tree with 4 children per node:
+ * inner child with the biggest area is replaced by its children,
+ * until the node is full.
+ * Returns index of node in the array
+ */
+static int
+flatten_bvh_node(BVH * const bvh,
+                 const BVHBuildNode * const node) {
+    
+    const BVHBuildNode * children[4];
+    int n;
+    int i;
+    
+    if(node->l) {
+        children[0] = node->l;
+        children[1] = node->r;
+        n = 2;
+    } else {
+        children[0] = node;
+        n = 1;
+    }
+    
+    while(n < 4) {
+        int opened = -1;
+        Float opened_area = -1;
+        for(i = 0; i < n; i++) {
+            if(children[i]->l && (box_area(children[i]->box) > opened_area)) {
+                opened = i;
+                opened_area = box_area(children[i]->box);
+            }
+        }
+        if(opened < 0)
+            break;
+        
+        children[n++] = children[opened]->r;
+        children[opened] = children[opened]->l;
+    }
+    
+    // Array is allocated for the whole tree, so the pointer stays valid
+    const int index = bvh->nodes_count++;
+    BVHNode * const flat = &bvh->nodes[index];
+    
+    for(i = 0; i < 4; i++) {
+        clear_slot(flat, i);
+        if((i >= n) || (!children[i]->l && !children[i]->count))
+            continue;
+        
+        extend_slot_box(flat, i, children[i]->box);
+        
+        if(children[i]->l) {
+            flat->counts[i] = 0;
+            flat->children[i] = flatten_bvh_node(bvh, children[i]);
+        } else {
+            flat->counts[i] = children[i]->count;
+            flat->children[i] = children[i]->from;
+        }
+    }
+    
+    return index;
+}
+
+static void
+release_bvh_build_node(BVHBuildNode * node) {
+    if(node->l)
+        release_bvh_build_node(node->l);
+    if(node->r)
+        release_bvh_build_node(node->r);
+    free(node);
+}
+
+/*
+ * Slab tests for all 4 children at once.
+ * Returns bit mask of intersected children
+ */
+static inline int
+intersect_node_boxes(const BVHNode * const node,
+                     const BVHRay * const ray,
+                     const float t_max,
+                     float * const t_near) {
+    
+    const float * near_x = node->bounds[ray->sign[0]][0];
+    const float * near_y = node->bounds[ray->sign[1]][1];
+    const float * near_z = node->bounds[ray->sign[2]][2];
+    
+    const float * far_x = node->bounds[1 - ray->sign[0]][0];
+    const float * far_y = node->bounds[1 - ray->sign[1]][1];
+    const float * far_z = node->bounds[1 - ray->sign[2]][2];
+    
+    int hit[4];
+    int i;
+    
+    #pragma omp simd
+    for(i = 0; i < 4; i++) {
+        const float nx = (near_x[i] - ray->origin[0]) * ray->inv_direction[0];
+        const float ny = (near_y[i] - ray->origin[1]) * ray->inv_direction[1];
+        const float nz = (near_z[i] - ray->origin[2]) * ray->inv_direction[2];
+        
+        const float fx = (far_x[i] - ray->origin[0]) * ray->inv_direction[0];
+        const float fy = (far_y[i] - ray->origin[1]) * ray->inv_direction[1];
+        const float fz = (far_z[i] - ray->origin[2]) * ray->inv_direction[2];
+        
+        float tn = (nx > ny) ? nx : ny;
+        tn = (tn > nz) ? tn : nz;
+        tn = (tn > 0) ? tn : 0;
+        
+        float tf = (fx < fy) ? fx : fy;
+        tf = (tf < fz) ? tf : fz;
+        tf = (tf < t_max) ? tf : t_max;
+        
+        t_near[i] = tn;
+        hit[i] = (tn <= tf);
+    }
+    
+    return hit[0] | (hit[1] << 1) | (hit[2] << 2) | (hit[3] << 3);
+}
+
+/*
+ * Leaves of intersected children are tested right away,
+ * inner children are pushed to the stack - the nearest is visited first.
+ * Nodes, which are farther than the nearest found object, are skipped
+ */
+Boolean
+find_intersection_bvh(const BVH * const bvh,
+                      const Point3d vector_start,
+                      const Vector3d vector,
+                      Object3d ** const nearest_obj_ptr,
+                      HitRecord * const nearest_hit) {
+    
+    const BVHRay ray = new_bvh_ray(vector_start, vector);
+    
+    // Distances along the ray are measured in lengths of vector
+    float t_max = FLT_MAX;
+    
+    Object3d * nearest_obj = NULL;
+    HitRecord nearest;
+    HitRecord hit;
+    
+    int stack[BVH_STACK_SIZE];
+    float stack_t[BVH_STACK_SIZE];
+    int top = 0;
+    
+    stack[top] = 0;
+    stack_t[top++] = 0;
+    
+    float t_near[4];
+    int order[4];
+    int i;
+    int j;
+    
+    while(top) {
+        --top;
+        if(stack_t[top] > t_max)
+            continue;
+        
+        const BVHNode * const node = &bvh->nodes[stack[top]];
+        const int hits = intersect_node_boxes(node, &ray, t_max, t_near);
+        
+        int n = 0;
+        for(i = 0; i < 4; i++) {
+            if(!(hits & (1 << i)))
+                continue;
+            
+            if(!node->counts[i]) {
+                // Inner children are sorted by distance - from the farthest
+                for(j = n; (j > 0) && (t_near[order[j - 1]] < t_near[i]); j--) {
+                    order[j] = order[j - 1];
+                }
+                order[j] = i;
+                n++;
+                continue;
+            }
+            
+            const int * objects_indexes = bvh->objects_indexes + node->children[i];
+            for(j = 0; j < node->counts[i]; j++) {
+                Object3d * const obj = bvh->objects[objects_indexes[j]];
+                
+                #ifdef RAY_INTERSECTIONS_STAT
+                ++intersections_per_ray;
+                #endif // RAY_INTERSECTIONS_STAT
+                
+                if(obj->intersect(obj->data, vector_start, vector, &hit)
+                   && ((!nearest_obj) || (hit.t < nearest.t))) {
+                    
+                    nearest_obj = obj;
+                    nearest = hit;
+                    
+                    t_max = (float) (nearest.t * (1 + BVH_BOX_PADDING));
+                }
+            }
+        }
+        
+        for(i = 0; i < n; i++) {
+            stack[top] = node->children[order[i]];
+            stack_t[top++] = t_near[order[i]];
+        }
+    }
+    
+    if(!nearest_obj)
+        return False;
+    
+    if(nearest.t < nearest_hit->t) {
+        *nearest_obj_ptr = nearest_obj;
+        *nearest_hit = nearest;
+    }
+    return True;
+}
+
+/*
+ * Order of traversal doesn't matter: the first intersection
+ * not farther than max_dist finishes the search
+ */
+Boolean
+is_intersect_anything_bvh(const BVH * const bvh,
+                          const Point3d vector_start,
+                          const Vector3d vector,
+                          const Float max_dist) {
+    
+    const BVHRay ray = new_bvh_ray(vector_start, vector);
+    const float t_max = (float) (max_dist / module_vector(vector) * (1 + BVH_BOX_PADDING));
+    const Float sqr_max_dist = max_dist * max_dist;
+    
+    HitRecord hit;
+    
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    
+    float t_near[4];
+    int i;
+    int j;
+    
+    while(top) {
+        const BVHNode * const node = &bvh->nodes[stack[--top]];
+        const int hits = intersect_node_boxes(node, &ray, t_max, t_near);
+        
+        for(i = 0; i < 4; i++) {
+            if(!(hits & (1 << i)))
+                continue;
+            
+            if(!node->counts[i]) {
+                stack[top++] = node->children[i];
+                continue;
+            }
+            
+            const int * objects_indexes = bvh->objects_indexes + node->children[i];
+            for(j = 0; j < node->counts[i]; j++) {
+                Object3d * const obj = bvh->objects[objects_indexes[j]];
+                
+                #ifdef RAY_INTERSECTIONS_STAT
+                ++intersections_per_ray;
+                #endif // RAY_INTERSECTIONS_STAT
+                
+                if(obj->is_intersected) {
+                    if(obj->is_intersected(obj->data, vector_start, vector, max_dist))
+                        return True;
+                } else if(obj->intersect(obj->data, vector_start, vector, &hit)
+                          && (sqr_module_vector(vector3dp(vector_start, hit.point)) <= sqr_max_dist)) {
+                    
+                    return True;
+                }
+            }
+        }
+    }
+    
+    return False;
+}
+
+/*
+ * Packet goes through the hierarchy with the mask of rays, which intersect
+ * the box of node (each ray is tested by the box as by find_intersection_bvh).
+ * Inner children are visited in order of the nearest ray,
+ * objects of leaves are intersected by packet tests
+ */
+int
+find_intersection_bvh_packet(const BVH * const bvh,
+                             const RayPacket * const packet,
+                             const int mask,
+                             Object3d ** const nearest_objs,
+                             HitRecord * const nearest_hits) {
+    
+    Point3d starts[PACKET_SIZE];
+    Vector3d vectors[PACKET_SIZE];
+    BVHRay rays[PACKET_SIZE];
+    new_bvh_packet_rays(packet, starts, vectors, rays);
+    
+    float t_max[PACKET_SIZE];
+    Object3d * nearest_obj[PACKET_SIZE];
+    HitRecord nearest[PACKET_SIZE];
+    HitRecord hits[PACKET_SIZE];
+    int intersected = 0;
+    int r;
+    
+    for(r = 0; r < PACKET_SIZE; r++) {
+        t_max[r] = FLT_MAX;
+    }
+    
+    int stack[BVH_STACK_SIZE];
+    int stack_mask[BVH_STACK_SIZE];
+    int top = 0;
+    
+    stack[top] = 0;
+    stack_mask[top++] = mask;
+    
+    int children_masks[4];
+    float children_t[4];
+    int order[4];
+    int i;
+    int j;
+    
+    while(top) {
+        --top;
+        const BVHNode * const node = &bvh->nodes[stack[top]];
+        const int hits_mask = intersect_node_boxes_packet(node, rays, stack_mask[top], t_max,
+                                                          children_masks, children_t);
+        
+        int n = 0;
+        for(i = 0; i < 4; i++) {
+            if(!(hits_mask & (1 << i)))
+                continue;
+            
+            if(!node->counts[i]) {
+                // Inner children are sorted by distance - from the farthest
+                for(j = n; (j > 0) && (children_t[order[j - 1]] < children_t[i]); j--) {
+                    order[j] = order[j - 1];
+                }
+                order[j] = i;
+                n++;
+                continue;
+            }
+            
+            const int * objects_indexes = bvh->objects_indexes + node->children[i];
+            for(j = 0; j < node->counts[i]; j++) {
+                Object3d * const obj = bvh->objects[objects_indexes[j]];
+                
+                #ifdef RAY_INTERSECTIONS_STAT
+                intersections_per_ray += __builtin_popcount(children_masks[i]);
+                #endif // RAY_INTERSECTIONS_STAT
+                
+                const int hit_rays = intersect_object_packet(obj, packet, starts, vectors, children_masks[i], hits);
+                
+                for(r = 0; hit_rays >> r; r++) {
+                    if((hit_rays & (1 << r))
+                       && (!(intersected & (1 << r)) || (hits[r].t < nearest[r].t))) {
+                        
+                        intersected |= 1 << r;
+                        nearest_obj[r] = obj;
+                        nearest[r] = hits[r];
+                        
+                        t_max[r] = (float) (nearest[r].t * (1 + BVH_BOX_PADDING));
+                    }
+                }
+            }
+        }
+        
+        for(i = 0; i < n; i++) {
+            stack[top] = node->children[order[i]];
+            stack_mask[top++] = children_masks[order[i]];
+        }
+    }
+    
+    for(r = 0; intersected >> r; r++) {
+        if((intersected & (1 << r)) && (nearest[r].t < nearest_hits[r].t)) {
+            nearest_objs[r] = nearest_obj[r];
+            nearest_hits[r] = nearest[r];
+        }
+    }
+    return intersected;
+}
+
+/*
+ * Each ray is dropped after its first intersection
+ */
+int
+is_intersect_anything_bvh_packet(const BVH * const bvh,
+                                 const RayPacket * const packet,
+                                 const int mask,
+                                 const Float * const max_dists) {
+    
+    Point3d starts[PACKET_SIZE];
+    Vector3d vectors[PACKET_SIZE];
+    BVHRay rays[PACKET_SIZE];
+    new_bvh_packet_rays(packet, starts, vectors, rays);
+    
+    float t_max[PACKET_SIZE];
+    int r;
+    for(r = 0; r < PACKET_SIZE; r++) {
+        t_max[r] = (mask & (1 << r))
+                   ? (float) (max_dists[r] / module_vector(vectors[r]) * (1 + BVH_BOX_PADDING))
+                   : 0;
+    }
+    
+    int stack[BVH_STACK_SIZE];
+    int stack_mask[BVH_STACK_SIZE];
+    int top = 0;
+    
+    stack[top] = 0;
+    stack_mask[top++] = mask;
+    
+    int children_masks[4];
+    float children_t[4];
+    int shaded = 0;
+    int i;
+    int j;
+    
+    while(top) {
+        --top;
+        const BVHNode * const node = &bvh->nodes[stack[top]];
+        const int hits_mask = intersect_node_boxes_packet(node, rays, stack_mask[top] & ~shaded, t_max,
+                                                          children_masks, children_t);
+        
+        for(i = 0; i < 4; i++) {
+            if(!(hits_mask & (1 << i)))
+                continue;
+            
+            if(!node->counts[i]) {
+                stack[top] = node->children[i];
+                stack_mask[top++] = children_masks[i];
+                continue;
+            }
+            
+            const int * objects_indexes = bvh->objects_indexes + node->children[i];
+            for(j = 0; j < node->counts[i]; j++) {
+                const int active = children_masks[i] & ~shaded;
+                if(!active)
+                    break;
+                
+                #ifdef RAY_INTERSECTIONS_STAT
+                intersections_per_ray += __builtin_popcount(active);
+                #endif // RAY_INTERSECTIONS_STAT
+                
+                shaded |= is_object_intersected_packet(bvh->objects[objects_indexes[j]], packet,
+                                                       starts, vectors, active, max_dists);
+            }
+            
+            if(shaded == mask)
+                return shaded;
+        }
+    }
+    
+    return shaded;
+}
+
+static inline BVHRay
+new_bvh_ray(const Point3d vector_start,
+            const Vector3d vector) {
+    
+    const Float d[3] = {vector.x, vector.y, vector.z};
+    const Float o[3] = {vector_start.x, vector_start.y, vector_start.z};
+    
+    BVHRay ray;
+    int a;
+    for(a = 0; a < 3; a++) {
+        // Avoiding of infinities: 0 * inf is not a number
+        const Float da = (fabs(d[a]) > 1e-30) ? d[a] : ((d[a] < 0) ? -1e-30 : 1e-30);
+        
+        ray.origin[a] = (float) o[a];
+        ray.inv_direction[a] = (float) (1 / da);
+        ray.sign[a] = (da < 0);
+    }
+    return ray;
+}
+
+static inline void
+new_bvh_packet_rays(const RayPacket * const packet,
+                    Point3d * const starts,
+                    Vector3d * const vectors,
+                    BVHRay * const rays) {
+    
+    int r;
+    for(r = 0; r < PACKET_SIZE; r++) {
+        starts[r] = point3d(packet->start.x[r], packet->start.y[r], packet->start.z[r]);
+        vectors[r] = vector3df(packet->vector.x[r], packet->vector.y[r], packet->vector.z[r]);
+        rays[r] = new_bvh_ray(starts[r], vectors[r]);
+    }
+}
+
+/*
+ * Slab tests of children for each ray of mask. Masks of rays, which intersect
+ * each child, and the nearest distances to children are written to the arrays.
+ * Returns bit mask of intersected children
+ */
+static inline int
+intersect_node_boxes_packet(const BVHNode * const node,
+                            const BVHRay * const rays,
+                            const int mask,
+                            const float * const t_max,
+                            int * const children_masks,
+                            float * const children_t) {
+    
+    float t_near[4];
+    int hits_mask = 0;
+    int i;
+    int r;
+    
+    for(i = 0; i < 4; i++) {
+        children_masks[i] = 0;
+        children_t[i] = FLT_MAX;
+    }
+    
+    for(r = 0; mask >> r; r++) {
+        if(!(mask & (1 << r)))
+            continue;
+        
+        const int hits = intersect_node_boxes(node, &rays[r], t_max[r], t_near);
+        hits_mask |= hits;
+        
+        for(i = 0; i < 4; i++) {
+            if(hits & (1 << i)) {
+                children_masks[i] |= 1 << r;
+                children_t[i] = (t_near[i] < children_t[i]) ? t_near[i] : children_t[i];
+            }
+        }
+    }
+    return hits_mask;
+}
+
+/*
+ * Objects without packet test intersect rays one by one
+ */
+static inline int
+intersect_object_packet(const Object3d * const obj,
+                        const RayPacket * const packet,
+                        const Point3d * const starts,
+                        const Vector3d * const vectors,
+                        const int mask,
+                        HitRecord * const hits) {
+    
+    if(obj->intersect_packet)
+        return obj->intersect_packet(obj->data, packet, mask, hits);
+    
+    int intersected = 0;
+    int r;
+    for(r = 0; mask >> r; r++) {
+        if((mask & (1 << r)) && obj->intersect(obj->data, starts[r], vectors[r], &hits[r]))
+            intersected |= 1 << r;
+    }
+    return intersected;
+}
+
+/*
+ * Returns mask of rays, which intersect object not farther than max_dists[ray]
+ */
+static inline int
+is_object_intersected_packet(const Object3d * const obj,
+                             const RayPacket * const packet,
+                             const Point3d * const starts,
+                             const Vector3d * const vectors,
+                             const int mask,
+                             const Float * const max_dists) {
+    
+    if(obj->is_intersected_packet)
+        return obj->is_intersected_packet(obj->data, packet, mask, max_dists);
+    
+    int intersected = 0;
+    int r;
+    
+    if(obj->is_intersected) {
+        for(r = 0; mask >> r; r++) {
+            if((mask & (1 << r)) && obj->is_intersected(obj->data, starts[r], vectors[r], max_dists[r]))
+                intersected |= 1 << r;
+        }
+        return intersected;
+    }
+    
+    HitRecord hits[PACKET_SIZE];
+    const int hit_rays = intersect_object_packet(obj, packet, starts, vectors, mask, hits);
+    
+    for(r = 0; hit_rays >> r; r++) {
+        if((hit_rays & (1 << r))
+           && (sqr_module_vector(vector3dp(starts[r], hits[r].point)) <= max_dists[r] * max_dists[r])) {
+            
+            intersected |= 1 << r;
+        }
+    }
+    return intersected;
+}
+
+/*
+ * Box in floats, which contains the box in Float
+ */
+static inline void
+padded_box(const Voxel b,
+           float * const min,
+           float * const max) {
+    
+    min[0] = (float) (b.x_min - (fabs(b.x_min) + 1) * BVH_BOX_PADDING);
+    min[1] = (float) (b.y_min - (fabs(b.y_min) + 1) * BVH_BOX_PADDING);
+    min[2] = (float) (b.z_min - (fabs(b.z_min) + 1) * BVH_BOX_PADDING);
+    
+    max[0] = (float) (b.x_max + (fabs(b.x_max) + 1) * BVH_BOX_PADDING);
+    max[1] = (float) (b.y_max + (fabs(b.y_max) + 1) * BVH_BOX_PADDING);
+    max[2] = (float) (b.z_max + (fabs(b.z_max) + 1) * BVH_BOX_PADDING);
+}
+
+/*
+ * Empty box is never intersected
+ */
+static inline void
+clear_slot(BVHNode * const node,
+           const int i) {
+    
+    node->bounds[0][0][i] = node->bounds[0][1][i] = node->bounds[0][2][i] = FLT_MAX;
+    node->bounds[1][0][i] = node->bounds[1][1][i] = node->bounds[1][2][i] = -FLT_MAX;
+    node->children[i] = 0;
+    node->counts[i] = 0;
+}
+
+static inline void
+extend_slot_box(BVHNode * const node,
+                const int i,
+                const Voxel b) {
+    
+    float min[3];
+    float max[3];
+    padded_box(b, min, max);
+    
+    int a;
+    for(a = 0; a < 3; a++) {
+        node->bounds[0][a][i] = (min[a] < node->bounds[0][a][i]) ? min[a] : node->bounds[0][a][i];
+        node->bounds[1][a][i] = (max[a] > node->bounds[1][a][i]) ? max[a] : node->bounds[1][a][i];
+    }
+}
+
+static inline Voxel
+slot_box(const BVHNode * const node,
+         const int i) {
+    
+    Voxel box = {node->bounds[0][0][i], node->bounds[0][1][i], node->bounds[0][2][i],
+                 node->bounds[1][0][i], node->bounds[1][1][i], node->bounds[1][2][i]};
+    return box;
+}
+
+static inline Boolean
+slot_contains_box(const BVHNode * const node,
+                  const int i,
+                  const float * const min,
+                  const float * const max) {
+    
+    return (node->bounds[0][0][i] <= min[0]) && (max[0] <= node->bounds[1][0][i])
+           && (node->bounds[0][1][i] <= min[1]) && (max[1] <= node->bounds[1][1][i])
+           && (node->bounds[0][2][i] <= min[2]) && (max[2] <= node->bounds[1][2][i]);
+}
+
+static inline Voxel
+object_box(const Object3d * const obj) {
+    const Point3d min_p = obj->get_min_boundary_point(obj->data);
+    const Point3d max_p = obj->get_max_boundary_point(obj->data);
+    
+    Voxel box = {min_p.x, min_p.y, min_p.z, max_p.x, max_p.y, max_p.z};
+    return box;
+}
+
+static inline void
+reserve_bvh_objects_indexes(BVH * const bvh,
+                            const int count) {
+    
+    if(bvh->objects_indexes_count + count > bvh->objects_indexes_capacity) {
+        bvh->objects_indexes_capacity = (bvh->objects_indexes_count + count) * 2;
+        bvh->objects_indexes = realloc(bvh->objects_indexes, bvh->objects_indexes_capacity * sizeof(int));
+    }
+}
+
+/*
+ * Range of leaf is moved to the end of array (if it is not there yet),
+ * so the old range becomes garbage
+ */
+static void
+append_leaf_object(BVH * const bvh,
+                   BVHNode * const node,
+                   const int slot,
+                   const int index) {
+    
+    const int count = node->counts[slot];
+    reserve_bvh_objects_indexes(bvh, count + 1);
+    
+    if(node->children[slot] + count != bvh->objects_indexes_count) {
+        memcpy(bvh->objects_indexes + bvh->objects_indexes_count,
+               bvh->objects_indexes + node->children[slot],
+               count * sizeof(int));
+        node->children[slot] = bvh->objects_indexes_count;
+        bvh->objects_indexes_count += count;
+        bvh->garbage_count += count;
+    }
+    
+    bvh->objects_indexes[bvh->objects_indexes_count++] = index;
+    node->counts[slot]++;
+}
+
+/*
+ * Objects of leaf and the new object are sorted by centroids along the longest axis
+ * and are distributed equally between 4 leaves of the new node
+ */
+static void
+split_bvh_leaf(BVH * const bvh,
+               const int node_index,
+               const int slot,
+               const int index) {
+    
+    const int offset = bvh->nodes[node_index].children[slot];
+    const int count = bvh->nodes[node_index].counts[slot] + 1;
+    
+    int * indexes = malloc(count * sizeof(int));
+    Float * centroids = malloc(count * sizeof(Float));
+    
+    memcpy(indexes, bvh->objects_indexes + offset, (count - 1) * sizeof(int));
+    indexes[count - 1] = index;
+    
+    const Voxel b = slot_box(&bvh->nodes[node_index], slot);
+    const Float d[3] = {b.x_max - b.x_min, b.y_max - b.y_min, b.z_max - b.z_min};
+    const int axis = (d[0] >= d[1]) ? ((d[0] >= d[2]) ? 0 : 2) : ((d[1] >= d[2]) ? 1 : 2);
+    
+    int i;
+    int j;
+    for(i = 0; i < count; i++) {
+        const Voxel box = object_box(bvh->objects[indexes[i]]);
+        const Float centroid = (axis == 0) ? box.x_min + box.x_max
+                               : ((axis == 1) ? box.y_min + box.y_max : box.z_min + box.z_max);
+        const int curr = indexes[i];
+        
+        for(j = i; (j > 0) && (centroids[j - 1] > centroid); j--) {
+            centroids[j] = centroids[j - 1];
+            indexes[j] = indexes[j - 1];
+        }
+        centroids[j] = centroid;
+        indexes[j] = curr;
+    }
+    
+    if(bvh->nodes_count == bvh->nodes_capacity) {
+        bvh->nodes_capacity *= 2;
+        bvh->nodes = realloc(bvh->nodes, bvh->nodes_capacity * sizeof(BVHNode));
+    }
+    const int child_index = bvh->nodes_count++;
+    BVHNode * const child = &bvh->nodes[child_index];
+    
+    reserve_bvh_objects_indexes(bvh, count);
+    
+    for(i = 0; i < 4; i++) {
+        const int from = i * count / 4;
+        const int to = (i + 1) * count / 4;
+        
+        clear_slot(child, i);
+        if(from == to)
+            continue;
+        
+        child->children[i] = bvh->objects_indexes_count;
+        child->counts[i] = to - from;
+        
+        for(j = from; j < to; j++) {
+            extend_slot_box(child, i, object_box(bvh->objects[indexes[j]]));
+            bvh->objects_indexes[bvh->objects_indexes_count++] = indexes[j];
+        }
+    }
+    bvh->garbage_count += count - 1;
+    
+    BVHNode * const node = &bvh->nodes[node_index];
+    node->children[slot] = child_index;
+    node->counts[slot] = 0;
+    
+    free(centroids);
+    free(indexes);
+}
+
+/*
+ * Finds object among the leaves, which boxes contain its box.
+ * Reference is replaced by new_index or is removed, if new_index is negative.
+ * Returns True if object was found
+ */
+static Boolean
+replace_bvh_object(BVH * const bvh,
+                   const int node_index,
+                   const float * const min,
+                   const float * const max,
+                   const int index,
+                   const int new_index) {
+    
+    BVHNode * const node = &bvh->nodes[node_index];
+    int i;
+    int j;
+    
+    for(i = 0; i < 4; i++) {
+        if(!slot_contains_box(node, i, min, max))
+            continue;
+        
+        if(!node->counts[i]) {
+            if(node->children[i] && replace_bvh_object(bvh, node->children[i], min, max, index, new_index))
+                return True;
+            continue;
+        }
+        
+        int * const objects_indexes = bvh->objects_indexes + node->children[i];
+        for(j = 0; j < node->counts[i]; j++) {
+            if(objects_indexes[j] != index)
+                continue;
+            
+            if(new_index >= 0) {
+                objects_indexes[j] = new_index;
+            } else {
+                objects_indexes[j] = objects_indexes[--node->counts[i]];
+                bvh->garbage_count++;
+                
+                if(!node->counts[i])
+                    clear_slot(node, i);
+            }
+            return True;
+        }
+    }
+    
+    return False;
+}
+
+static void
+compact_bvh_objects_indexes(BVH * const bvh) {
+    int * objects_indexes = malloc(bvh->objects_indexes_capacity * sizeof(int));
+    int count = 0;
+    
+    int n;
+    int i;
+    for(n = 0; n < bvh->nodes_count; n++) {
+        BVHNode * const node = &bvh->nodes[n];
+        for(i = 0; i < 4; i++) {
+            if(node->counts[i]) {
+                memcpy(objects_indexes + count,
+                       bvh->objects_indexes + node->children[i],
+                       node->counts[i] * sizeof(int));
+                node->children[i] = count;
+                count += node->counts[i];
+            }
+        }
+    }
+    
+    free(bvh->objects_indexes);
+    bvh->objects_indexes = objects_indexes;
+    bvh->objects_indexes_count = count;
+    bvh->garbage_count = 0;
+}
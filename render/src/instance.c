@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <render.h>
+#include <utils.h>
+#include <bvh.h>
+
+// Declarations
+// --------------------------------------------------------------
+
+// World coordinates of point of mesh:
+// rotation around x, y and z axises, scaling and offset
+typedef
+struct {
+    Mesh * mesh;
+    
+    Float scale;
+    
+    Float dx;
+    Float dy;
+    Float dz;
+    
+    Float sin_al_x;
+    Float cos_al_x;
+    
+    Float sin_al_y;
+    Float cos_al_y;
+    
+    Float sin_al_z;
+    Float cos_al_z;
+    
+    // The same rotation as matrix (by rows)
+    Float rotation[3][3];
+    
+    // Bounding box in world coordinates
+    Point3d min;
+    Point3d max;
+}
+Instance;
+
+static void
+prepare_mesh(Mesh * const mesh);
+
+static inline Point3d
+to_world_point(const Instance * const instance,
+               const Point3d p);
+
+static inline Point3d
+to_local_point(const Instance * const instance,
+               const Point3d p);
+
+static inline Vector3d
+to_world_vector(const Instance * const instance,
+                const Vector3d v);
+
+static inline Vector3d
+to_local_vector(const Instance * const instance,
+                const Vector3d v);
+
+static inline const Object3d *
+find_mesh_object(const HitRecord * const hit,
+                 HitRecord * const local_hit);
+
+static Boolean
+intersect_instance(const void * data,
+                   const Point3d vector_start,
+                   const Vector3d vector,
+                   HitRecord * const hit);
+
+static Color
+get_instance_color(const void * data,
+                   const HitRecord * const hit);
+
+static Vector3d
+get_instance_normal_vector(const void * data,
+                           const HitRecord * const hit);
+
+static Material
+get_instance_material(const void * data,
+                      const HitRecord * const hit);
+
+static Point3d
+get_min_instance_boundary_point(const void * data);
+
+static Point3d
+get_max_instance_boundary_point(const void * data);
+
+static void
+release_instance_data(void * data);
+
+// Code
+// --------------------------------------------------------------
+
+Mesh *
+new_mesh(const int objects_count) {
+    Mesh * mesh = malloc(sizeof(Mesh));
+    mesh->objects_count = objects_count;
+    mesh->objects = calloc(objects_count, sizeof(Object3d *));
+    mesh->last_object_index = -1;
+    mesh->bvh = NULL;
+    mesh->references = 1;
+    return mesh;
+}
+
+void
+add_mesh_object(Mesh * const mesh,
+                Object3d * const object) {
+    
+    mesh->objects[++mesh->last_object_index] = object;
+}
+
+void
+release_mesh(Mesh * mesh) {
+    if(--mesh->references)
+        return;
+    
+    int i;
+    for(i = 0; i <= mesh->last_object_index; i++) {
+        release_object3d(mesh->objects[i]);
+    }
+    
+    if(mesh->bvh)
+        release_bvh(mesh->bvh);
+    free(mesh->objects);
+    free(mesh);
+}
+
+static void
+prepare_mesh(Mesh * const mesh) {
+    mesh->bvh = build_bvh(mesh->objects, mesh->last_object_index + 1);
+    
+    Voxel * const b = &mesh->bounding_box;
+    b->x_min = b->y_min = b->z_min = FLOAT_MAX;
+    b->x_max = b->y_max = b->z_max = -FLOAT_MAX;
+    
+    int i;
+    for(i = 0; i <= mesh->last_object_index; i++) {
+        const Object3d * obj = mesh->objects[i];
+        const Point3d min_p = obj->get_min_boundary_point(obj->data);
+        const Point3d max_p = obj->get_max_boundary_point(obj->data);
+        
+        b->x_min = (min_p.x < b->x_min) ? min_p.x : b->x_min;
+        b->y_min = (min_p.y < b->y_min) ? min_p.y : b->y_min;
+        b->z_min = (min_p.z < b->z_min) ? min_p.z : b->z_min;
+        
+        b->x_max = (max_p.x > b->x_max) ? max_p.x : b->x_max;
+        b->y_max = (max_p.y > b->y_max) ? max_p.y : b->y_max;
+        b->z_max = (max_p.z > b->z_max) ? max_p.z : b->z_max;
+    }
+    
+    if(mesh->last_object_index < 0) {
+        Voxel empty = {0, 0, 0, 0, 0, 0};
+        *b = empty;
+    }
+}
+
+Object3d *
+new_instance(Mesh * const mesh,
+             const Float scale,
+             const Float dx,
+             const Float dy,
+             const Float dz,
+             const Float al_x,
+             const Float al_y,
+             const Float al_z) {
+    
+    if(!mesh->bvh)
+        prepare_mesh(mesh);
+    mesh->references++;
+    
+    Instance * instance = malloc(sizeof(Instance));
+    instance->mesh = mesh;
+    instance->scale = scale;
+    instance->dx = dx;
+    instance->dy = dy;
+    instance->dz = dz;
+    instance->sin_al_x = sin(al_x);
+    instance->cos_al_x = cos(al_x);
+    instance->sin_al_y = sin(al_y);
+    instance->cos_al_y = cos(al_y);
+    instance->sin_al_z = sin(al_z);
+    instance->cos_al_z = cos(al_z);
+    
+    int i;
+    for(i = 0; i < 3; i++) {
+        const Vector3d axis = to_world_vector(instance, vector3df(i == 0, i == 1, i == 2));
+        instance->rotation[0][i] = axis.x;
+        instance->rotation[1][i] = axis.y;
+        instance->rotation[2][i] = axis.z;
+    }
+    
+    const Voxel b = mesh->bounding_box;
+    
+    // Bounding box of rotated box of mesh
+    instance->min = point3d(FLOAT_MAX, FLOAT_MAX, FLOAT_MAX);
+    instance->max = point3d(-FLOAT_MAX, -FLOAT_MAX, -FLOAT_MAX);
+    
+    for(i = 0; i < 8; i++) {
+        const Point3d p = to_world_point(instance, point3d((i & 1) ? b.x_max : b.x_min,
+                                                           (i & 2) ? b.y_max : b.y_min,
+                                                           (i & 4) ? b.z_max : b.z_min));
+        
+        instance->min.x = (p.x < instance->min.x) ? p.x : instance->min.x;
+        instance->min.y = (p.y < instance->min.y) ? p.y : instance->min.y;
+        instance->min.z = (p.z < instance->min.z) ? p.z : instance->min.z;
+        
+        instance->max.x = (p.x > instance->max.x) ? p.x : instance->max.x;
+        instance->max.y = (p.y > instance->max.y) ? p.y : instance->max.y;
+        instance->max.z = (p.z > instance->max.z) ? p.z : instance->max.z;
+    }
+    
+    Object3d * obj = malloc(sizeof(Object3d));
+    obj->data = instance;
+    obj->release_data = release_instance_data;
+    obj->get_color = get_instance_color;
+    obj->intersect = intersect_instance;
+    obj->get_normal_vector = get_instance_normal_vector;
+    obj->get_material = get_instance_material;
+    obj->get_min_boundary_point = get_min_instance_boundary_point;
+    obj->get_max_boundary_point = get_max_instance_boundary_point;
+    obj->clip_by_voxel = NULL;
+    obj->type = CUSTOM_OBJECT;
+    obj->intersect_packet = NULL;
+    obj->is_intersected = NULL;
+    obj->is_intersected_packet = NULL;
+    
+    return obj;
+}
+
+static inline Point3d
+to_world_point(const Instance * const instance,
+               const Point3d p) {
+    
+    Point3d r = rotate_point_x(p, instance->sin_al_x, instance->cos_al_x);
+    r = rotate_point_y(r, instance->sin_al_y, instance->cos_al_y);
+    r = rotate_point_z(r, instance->sin_al_z, instance->cos_al_z);
+    
+    return point3d(r.x * instance->scale + instance->dx,
+                   r.y * instance->scale + instance->dy,
+                   r.z * instance->scale + instance->dz);
+}
+
+static inline Point3d
+to_local_point(const Instance * const instance,
+               const Point3d p) {
+    
+    Point3d r = point3d((p.x - instance->dx) / instance->scale,
+                        (p.y - instance->dy) / instance->scale,
+                        (p.z - instance->dz) / instance->scale);
+    
+    r = rotate_point_z(r, -instance->sin_al_z, instance->cos_al_z);
+    r = rotate_point_y(r, -instance->sin_al_y, instance->cos_al_y);
+    return rotate_point_x(r, -instance->sin_al_x, instance->cos_al_x);
+}
+
+static inline Vector3d
+to_world_vector(const Instance * const instance,
+                const Vector3d v) {
+    
+    Vector3d r = rotate_vector_x(v, instance->sin_al_x, instance->cos_al_x);
+    r = rotate_vector_y(r, instance->sin_al_y, instance->cos_al_y);
+    return rotate_vector_z(r, instance->sin_al_z, instance->cos_al_z);
+}
+
+/*
+ * Length of vector is divided by scale,
+ * so the point at the same distance along the ray is the same in both spaces
+ */
+static inline Vector3d
+to_local_vector(const Instance * const instance,
+                const Vector3d v) {
+    
+    Vector3d r = vector3df(v.x / instance->scale,
+                           v.y / instance->scale,
+                           v.z / instance->scale);
+    
+    r = rotate_vector_z(r, -instance->sin_al_z, instance->cos_al_z);
+    r = rotate_vector_y(r, -instance->sin_al_y, instance->cos_al_y);
+    return rotate_vector_x(r, -instance->sin_al_x, instance->cos_al_x);
+}
+
+/*
+ * Object of mesh, which was intersected, and its hit in local coordinates
+ * (both are kept by the hit, even if instances are nested)
+ */
+static inline const Object3d *
+find_mesh_object(const HitRecord * const hit,
+                 HitRecord * const local_hit) {
+    
+    *local_hit = *hit;
+    local_hit->point = hit->part_point;
+    local_hit->norm = hit->part_norm;
+    local_hit->part = NULL;
+    
+    return hit->part;
+}
+
+static Boolean
+intersect_instance(const void * data,
+                   const Point3d vector_start,
+                   const Vector3d vector,
+                   HitRecord * const hit) {
+    
+    const Instance * instance = data;
+    
+    Object3d * obj = NULL;
+    HitRecord local_hit;
+    local_hit.t = FLOAT_MAX;
+    
+    if(!find_intersection_bvh(instance->mesh->bvh,
+                              to_local_point(instance, vector_start),
+                              to_local_vector(instance, vector),
+                              &obj,
+                              &local_hit)) {
+        return False;
+    }
+    
+    // Distance is the same in both spaces (see to_local_vector)
+    *hit = local_hit;
+    hit->point = to_world_point(instance, local_hit.point);
+    hit->norm = to_world_vector(instance, local_hit.norm);
+    
+    if(obj->intersect != intersect_instance) {
+        hit->part = obj;
+        hit->part_point = local_hit.point;
+        hit->part_norm = local_hit.norm;
+        memcpy(hit->part_rotation, instance->rotation, sizeof(instance->rotation));
+        return True;
+    }
+    
+    // Part of nested instance is in coordinates of its mesh
+    int i;
+    int j;
+    for(i = 0; i < 3; i++) {
+        for(j = 0; j < 3; j++) {
+            hit->part_rotation[i][j] = instance->rotation[i][0] * local_hit.part_rotation[0][j]
+                                       + instance->rotation[i][1] * local_hit.part_rotation[1][j]
+                                       + instance->rotation[i][2] * local_hit.part_rotation[2][j];
+        }
+    }
+    return True;
+}
+
+static Color
+get_instance_color(const void * data,
+                   const HitRecord * const hit) {
+    
+    HitRecord local_hit;
+    const Object3d * obj = find_mesh_object(hit, &local_hit);
+    return obj->get_color(obj->data, &local_hit);
+}
+
+static Vector3d
+get_instance_normal_vector(const void * data,
+                           const HitRecord * const hit) {
+    
+    HitRecord local_hit;
+    const Object3d * obj = find_mesh_object(hit, &local_hit);
+    const Vector3d n = obj->get_normal_vector(obj->data, &local_hit);
+    const Float (* r)[3] = hit->part_rotation;
+    
+    return vector3df(r[0][0] * n.x + r[0][1] * n.y + r[0][2] * n.z,
+                     r[1][0] * n.x + r[1][1] * n.y + r[1][2] * n.z,
+                     r[2][0] * n.x + r[2][1] * n.y + r[2][2] * n.z);
+}
+
+static Material
+get_instance_material(const void * data,
+                      const HitRecord * const hit) {
+    
+    HitRecord local_hit;
+    const Object3d * obj = find_mesh_object(hit, &local_hit);
+    return obj->get_material(obj->data, &local_hit);
+}
+
+static Point3d
+get_min_instance_boundary_point(const void * data) {
+    const Instance * instance = data;
+    return instance->min;
+}
+
+static Point3d
+get_max_instance_boundary_point(const void * data) {
+    const Instance * instance = data;
+    return instance->max;
+}
+
+static void
+release_instance_data(void * data) {
+    Instance * instance = data;
+    release_mesh(instance->mesh);
+    free(instance);
+}
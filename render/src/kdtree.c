@@ -3,21 +3,96 @@
 #include <float.h>
 #include <math.h>
 #include <string.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <render.h>
 #include <kdtree.h>
 #include <utils.h>
 
+#include <omp.h>
+
+// Default parameters of building (see KDTreeParams)
 #ifndef MAX_TREE_DEPTH
     #define MAX_TREE_DEPTH 20
 #endif // MAX_TREE_DEPTH
 
-#define OBJECTS_IN_LEAF 1
+#ifndef OBJECTS_IN_LEAF
+    #define OBJECTS_IN_LEAF 1
+#endif // OBJECTS_IN_LEAF
+
+#ifndef SPLIT_COST
+    #define SPLIT_COST 5
+#endif // SPLIT_COST
+
+// Number of buckets per axis, which are used by binned SAH
+#ifndef KD_TREE_BINS
+    #define KD_TREE_BINS 32
+#endif // KD_TREE_BINS
+
+// Nodes with more objects are built using all threads (binning and filtering
+// of objects are parallel), smaller subtrees are built as independent tasks
+#ifndef PARALLEL_BUILD_THRESHOLD
+    #define PARALLEL_BUILD_THRESHOLD 4096
+#endif // PARALLEL_BUILD_THRESHOLD
+
+// Size of portion of objects, which is filtered by one thread
+#define FILTER_CHUNK 1024
+
+// Number of objects, which are processed by one vectorized loop
+#define SIMD_BLOCK 64
+
+// Maximal depth of tree - size of stack of traversal
+#define KD_TREE_STACK_SIZE 64
+
+// Number of triangles, which are intersected by one ray at once
+// (lanes of GroupFloat): as many, as fit into the vector register.
+// Leaves with fewer triangles than MIN_GROUPED_TRIANGLES test them one by one
+#ifndef TRIANGLE_GROUP_SIZE
+    #define TRIANGLE_GROUP_SIZE PACKET_SIZE
+#endif // TRIANGLE_GROUP_SIZE
+
+#ifndef MIN_GROUPED_TRIANGLES
+    #define MIN_GROUPED_TRIANGLES 2
+#endif // MIN_GROUPED_TRIANGLES
+
+// Number of entries of mailbox of thread (power of 2)
+#ifndef MAILBOX_SIZE
+    #define MAILBOX_SIZE 64
+#endif // MAILBOX_SIZE
+
+// Index of the nearest object, when ray doesn't intersect anything
+// (triangles of meshes are referenced by negative indexes)
+#define NO_TREE_OBJECT INT_MIN
+
+// Lower bits of BuildNode flags, which are used for plane
+#define NODE_PLANE_BITS 2
+#define NODE_PLANE_MASK 3
+
+// Tree is rebuilt, when updates make its SAH cost bigger
+// than the cost of freshly built tree multiplied by this value
+#ifndef KD_TREE_REBUILD_THRESHOLD
+    #define KD_TREE_REBUILD_THRESHOLD 1.5
+#endif // KD_TREE_REBUILD_THRESHOLD
+
+// Traversal step is measured on the tree of this number of inner nodes,
+// each of them has an empty leaf and the next inner node as children
+#define TUNER_COMB_DEPTH 256
+
+// Intersection test is measured on this number of objects per ray,
+// which are found among the first TUNER_OBJECTS_SCAN checked objects
+#define TUNER_OBJECTS_PER_RAY 8
+#define TUNER_OBJECTS_SCAN 512
 
-//#define MAX_SPLITS_OF_VOXEL 100
-#define MAX_SPLITS_OF_VOXEL 5
+// Measurements are repeated and the fastest one is used
+#define TUNER_REPEATS 5
 
-#define SPLIT_COST 5
+// Has to be changed with every change of layout of cache file or of the builder
+#define KD_TREE_CACHE_VERSION 4
 
 #if defined(__GNUC__) && (__GNUC__ * 100 +  __GNUC_MINOR__) >= 403
 # define __hot   __attribute__((hot))
@@ -33,32 +108,366 @@ intersections_per_ray;
 // Declarations
 // --------------------------------------------------------------
 
+typedef
+struct {
+    // Number of objects, which begin (starts) or end (ends) in each bucket
+    int x_starts[KD_TREE_BINS];
+    int x_ends[KD_TREE_BINS];
+    int y_starts[KD_TREE_BINS];
+    int y_ends[KD_TREE_BINS];
+    int z_starts[KD_TREE_BINS];
+    int z_ends[KD_TREE_BINS];
+}
+Bins;
+
+// Bounding boxes of small portion of objects, gathered from the table
+typedef
+struct {
+    Float x_min[SIMD_BLOCK];
+    Float y_min[SIMD_BLOCK];
+    Float z_min[SIMD_BLOCK];
+    
+    Float x_max[SIMD_BLOCK];
+    Float y_max[SIMD_BLOCK];
+    Float z_max[SIMD_BLOCK];
+}
+BoxesBlock;
+
+// Node of the tree, which is being built.
+// When building is finished - tree is converted to the array of KDNode
+typedef
+struct BuildNode {
+    enum Plane plane;
+    Coord coord;
+    
+    int * indexes;
+    int indexes_count;
+    
+    struct BuildNode * l;
+    struct BuildNode * r;
+}
+BuildNode;
+
+// Subtree, which is waiting to be built by one of the threads.
+// Only indexes of objects are kept - to save memory
+typedef
+struct {
+    BuildNode ** node;
+    int * indices;
+    int indices_count;
+    Voxel v;
+    int iter;
+}
+BuildTask;
+
+// Far child, which is waiting to be traversed, and interval of the ray inside it
+typedef
+struct {
+    int node;
+    Float t_min;
+    Float t_max;
+}
+TraversalEntry;
+
+// Ray as arrays - to select coordinate by the plane of node
+typedef
+struct {
+    Float start[3];
+    Float dir[3];
+    Float inv_dir[3];
+    
+    // Permutation of axes and shear for triangles (see ray_shear)
+    int kx;
+    int ky;
+    int kz;
+    Float sx;
+    Float sy;
+    Float sz;
+}
+KDRay;
+
+// One coordinate of all triangles of group (GCC vector extension).
+// Groups are allocated by realloc, so vectors are not required to be aligned
+typedef
+Float
+GroupFloat __attribute__((vector_size(TRIANGLE_GROUP_SIZE * sizeof(Float)), aligned(sizeof(Float))));
+
+typedef
+FloatBits
+GroupMask __attribute__((vector_size(TRIANGLE_GROUP_SIZE * sizeof(FloatBits))));
+
+// Vertexes of triangles as structure of arrays (lane per triangle).
+// Empty lanes are zeroed and masked out by traversal
+typedef
+struct KDTriangleGroup {
+    GroupFloat p1[3];
+    GroupFloat p2[3];
+    GroupFloat p3[3];
+}
+KDTriangleGroup;
+
+// The first objects of leaf are triangles, which are intersected by groups:
+// lanes of groups follow the order of objects
+typedef
+struct KDLeafGroups {
+    int first_group;
+    int triangles_count;
+}
+KDLeafGroups;
+
+// Packet of rays with coordinates by axis, as in KDRay.
+// Each ray is also kept separately - for objects without packet intersection
+// and for subtrees, where rays of packet go different ways
+typedef
+struct {
+    PacketFloat start[3];
+    PacketFloat dir[3];
+    PacketFloat inv_dir[3];
+    
+    Point3d starts[PACKET_SIZE];
+    Vector3d vectors[PACKET_SIZE];
+    KDRay rays[PACKET_SIZE];
+}
+KDPacket;
+
+// Far child, which is waiting to be traversed by the rays of mask
+typedef
+struct {
+    int node;
+    int mask;
+    PacketFloat t_min;
+    PacketFloat t_max;
+}
+PacketTraversalEntry;
+
+// Object, which was tested by rays of mask during the current traversal
+typedef
+struct {
+    int index;
+    int mask;
+    unsigned int stamp;
+}
+MailboxEntry;
+
+// Object is referenced by all leaves, which it overlaps. Repeated test
+// can't change result of traversal: the nearest intersection is already
+// not farther than this object, and any-hit traversal would be finished.
+// So objects, which were tested by the ray (or packet), are skipped
+typedef
+struct {
+    MailboxEntry entries[MAILBOX_SIZE];
+    
+    // Identifies traversal, which filled the entry
+    unsigned int stamp;
+}
+Mailbox;
+
+static __thread Mailbox objects_mailbox;
+
+// Tree of mesh is traversed inside of the traversal of scene
+// (by intersection of mesh object), so it has its own mailbox
+static __thread Mailbox mesh_mailbox;
+
+typedef
+struct {
+    BuildTask * tasks;
+    int count;
+    int capacity;
+}
+BuildTasks;
+
+// Cache file consists of this header, array of nodes and array of objects indexes
+typedef
+struct {
+    char magic[8];
+    unsigned long long key;
+    int nodes_count;
+    int objects_indexes_count;
+    int objects_count;
+    int mesh_primitives_count;
+    Voxel bounding_box;
+}
+KDTreeFileHeader;
+
+static inline unsigned long long
+hash_bytes(unsigned long long hash,
+           const void * data,
+           const size_t size);
+
+static unsigned long long
+hash_mesh_triangles(unsigned long long hash,
+                    const TriangleMesh * const mesh);
+
+static inline Float
+voxel_area(const Voxel v);
+
+static inline Float
+split_cost(const KDTreeParams * const params);
+
+static Float
+node_cost(const KDTree * const tree,
+          const int position,
+          const Voxel v);
+
+static void
+reserve_kd_tree(KDTree * const tree,
+                const int nodes_count,
+                const int objects_indexes_count);
+
+static inline Voxel
+object_box(const Object3d * const obj);
+
+static inline Boolean
+clip_tree_object(const KDTree * const tree,
+                 const int index,
+                 const Voxel v,
+                 Voxel * const clipped);
+
+static inline Boolean
+clip_object_box(const Object3d * const obj,
+                const Voxel v,
+                Voxel * const box);
+
+static void
+insert_node_object(KDTree * const tree,
+                   const int position,
+                   const Voxel v,
+                   Voxel box,
+                   const int index,
+                   const int depth);
+
+static void
+replace_node_object(KDTree * const tree,
+                    const int position,
+                    const Voxel v,
+                    const Voxel box,
+                    const int index,
+                    const int new_index);
+
+static void
+rebuild_leaf(KDTree * const tree,
+             const int position,
+             const Voxel v,
+             const int depth);
+
+static void
+compact_objects_indexes(KDTree * const tree);
+
+static BoundingBoxes *
+alloc_bounding_boxes(const int count);
+
+static BoundingBoxes *
+new_mesh_bounding_boxes(const TriangleMesh * const mesh);
+
+static KDTree *
+build_tree(Object3d ** objects,
+           const TriangleMesh * const mesh,
+           const BoundingBoxes * boxes,
+           const KDTreeParams * const params);
+
+static inline void
+copy_bounding_box(const BoundingBoxes * const src,
+                  const int src_i,
+                  BoundingBoxes * const dst,
+                  const int dst_i);
+
+static BoundingBoxes *
+gather_bounding_boxes(const BoundingBoxes * const boxes,
+                      const int * indices,
+                      const int indices_count);
+
 Voxel
-make_initial_voxel(Object3d ** objects,
-                   int objects_count);
+make_initial_voxel(const BoundingBoxes * const boxes);
 
-inline KDNode *
-rec_build(Object3d ** objects,
-          int objects_count,
+inline BuildNode *
+rec_build(const KDTree * const tree,
+          const BoundingBoxes * const boxes,
           Voxel v,
-          int iter);
+          int iter,
+          const KDTreeParams * const params);
 
-inline KDNode *
-make_leaf(Object3d ** objects,
-          int objects_count);
+static void
+rec_build_parallel(const KDTree * const tree,
+                   const BoundingBoxes * const boxes,
+                   int * indices,
+                   int indices_count,
+                   Voxel v,
+                   int iter,
+                   const KDTreeParams * const params,
+                   BuildNode ** const node_ptr,
+                   BuildTasks * const tasks);
+
+static void
+add_build_task(BuildTasks * const tasks,
+               BuildNode ** const node_ptr,
+               int * indices,
+               int indices_count,
+               Voxel v,
+               int iter);
+
+static inline void
+gather_block(const BoundingBoxes * const boxes,
+             const int * indices,
+             const int n,
+             BoxesBlock * const block,
+             BoundingBoxes * const view);
+
+static int
+compare_build_tasks(const void * a,
+                    const void * b);
+
+inline BuildNode *
+make_leaf(const KDTree * const tree,
+          const BoundingBoxes * const boxes);
 
 inline void
-find_plane(Object3d ** objects,
+find_plane(const Bins * const bins,
            const int objects_count,
            const Voxel v,
            const int tree_depth,
+           const KDTreeParams * const params,
            enum Plane * const p,
            Coord * const c);
 
-inline int
-objects_in_voxel(Object3d ** objects,
-                 const int objects_count,
-                 const Voxel v);
+inline void
+fill_bins(const BoundingBoxes * const boxes,
+          const int from,
+          const int to,
+          const Voxel v,
+          Bins * const bins);
+
+inline void
+update_bins(const BoundingBoxes * const boxes,
+            const int from,
+            const int to,
+            const Voxel v,
+            Bins * const bins);
+
+static void
+fill_bins_parallel(const BoundingBoxes * const boxes,
+                   const int * indices,
+                   const int indices_count,
+                   const Voxel v,
+                   Bins * const bins);
+
+static inline int
+bin_index(const Float x,
+          const Float min,
+          const Float k);
+
+static inline void
+sweep_bins(const int * starts,
+           const int * ends,
+           const int objects_count,
+           const Float S_split,
+           const Float S_non_split,
+           const enum Plane plane,
+           const Float min,
+           const Float h,
+           const Float split_cost,
+           Float * const bestSAH,
+           enum Plane * const p,
+           Coord * const c);
 
 inline void
 split_voxel(const Voxel v,
@@ -68,9 +477,55 @@ split_voxel(const Voxel v,
             Voxel * const vr);
 
 inline int
-filter_overlapped_objects(Object3d ** objects,
-                          const int objects_count,
-                          const Voxel v);
+filter_split_objects(const KDTree * const tree,
+                     const BoundingBoxes * const boxes,
+                     const enum Plane p,
+                     const Coord c,
+                     const Boolean left,
+                     const Voxel sub_v,
+                     BoundingBoxes * const result);
+
+static inline Boolean
+clip_bounding_box(const KDTree * const tree,
+                  BoundingBoxes * const boxes,
+                  const int i,
+                  const Voxel v);
+
+static void
+clip_bounding_boxes(const KDTree * const tree,
+                    BoundingBoxes * const boxes,
+                    const Voxel v);
+
+static int *
+filter_split_objects_parallel(const BoundingBoxes * const boxes,
+                              const int * indices,
+                              const int indices_count,
+                              const enum Plane p,
+                              const Coord c,
+                              const Boolean left,
+                              int * const result_count);
+
+static inline int
+filter_split_indices(const Float * bounds,
+                     const int * indices,
+                     const int indices_count,
+                     const Float coord,
+                     const Boolean left,
+                     int * const result);
+
+static inline const Float *
+split_bounds(const BoundingBoxes * const boxes,
+             const enum Plane p,
+             const Coord c,
+             const Boolean left,
+             Float * const coord);
+
+static inline void
+split_flags(const Float * bounds,
+            const int n,
+            const Float coord,
+            const Boolean left,
+            unsigned char * const flags);
 
 inline Boolean
 vector_plane_intersection(const Vector3d vector,
@@ -84,31 +539,256 @@ voxel_intersection(const Vector3d vector,
                    const Point3d vector_start,
                    const Voxel v);
 
-inline Boolean
-object_in_voxel(Object3d * const obj,
-                const Voxel v);
-
 inline Boolean
 point_in_voxel(const Point3d p,
                const Voxel v);
 
-inline Boolean
-find_intersection_node(KDNode * const node,
-                       const Voxel v,
-                       const Point3d vector_start,
-                       const Vector3d vector,
-                       Object3d ** const nearest_obj_ptr,
-                       Point3d * const nearest_intersection_point_ptr,
-                       Float * const nearest_intersection_point_dist_ptr);
+static inline KDRay
+new_kd_ray(const Point3d vector_start,
+           const Vector3d vector);
 
-inline Boolean
-is_intersect_anything_node(KDNode * const node,
-                           const Voxel v,
+static inline const KDNode *
+find_leaf(const KDNode * const nodes,
+          const KDNode * node,
+          const KDRay * const ray,
+          const Float t_min,
+          Float * const t_max,
+          TraversalEntry * const stack,
+          int * const stack_size);
+
+static inline Mailbox *
+tree_mailbox(const KDTree * const tree);
+
+static inline void
+new_mailbox_stamp(Mailbox * const mailbox);
+
+static inline int
+mailbox_untested(Mailbox * const mailbox,
+                 const int index,
+                 const int mask);
+
+static inline int
+find_nearest_tree_object(KDTree * const tree,
+                         const Point3d vector_start,
+                         const Vector3d vector,
+                         HitRecord * const nearest_hit);
+
+static inline int
+find_nearest_tree_objects_packet(KDTree * const tree,
+                                 const RayPacket * const packet,
+                                 const int mask,
+                                 int * const nearest_index,
+                                 HitRecord * const nearest_hits);
+
+static inline Boolean
+intersect_tree_object(const KDTree * const tree,
+                      const int index,
+                      const Point3d vector_start,
+                      const Vector3d vector,
+                      HitRecord * const hit);
+
+static inline int
+intersect_tree_object_packet(const KDTree * const tree,
+                             const int index,
+                             const KDPacket * const p,
+                             const RayPacket * const packet,
+                             const int mask,
+                             HitRecord * const hits);
+
+static inline Boolean
+is_tree_object_intersected(const KDTree * const tree,
+                           const int index,
                            const Point3d vector_start,
-                           const Vector3d vector);
+                           const Vector3d vector,
+                           const Float max_dist);
 
-void
-release_kd_node(KDNode * node);
+static inline const Object3d *
+custom_tree_object(const KDTree * const tree,
+                   const int index);
+
+static inline const KDPrimitive *
+tree_primitive(const KDTree * const tree,
+               const int index);
+
+static inline Object3d *
+tree_object(const KDTree * const tree,
+            const int index);
+
+static inline Voxel
+tree_primitive_box(const KDTree * const tree,
+                   const int index);
+
+static inline KDPrimitive
+new_kd_primitive(const Object3d * const obj);
+
+static KDPrimitive *
+new_kd_primitives(Object3d ** objects,
+                  const int objects_count);
+
+static KDPrimitive *
+new_mesh_primitives(Object3d ** objects,
+                    const int objects_count,
+                    int * const mesh_primitives_count);
+
+static BoundingBoxes *
+new_primitives_bounding_boxes(const KDTree * const tree,
+                              const BoundingBoxes * const boxes);
+
+static void
+group_tree_leaves(KDTree * const tree);
+
+static void
+group_node_leaves(KDTree * const tree,
+                  const int position);
+
+static void
+group_leaf(KDTree * const tree,
+           const int position);
+
+static inline Boolean
+get_tree_triangle(const KDTree * const tree,
+                  const int index,
+                  Point3d * const p);
+
+static inline int
+intersect_triangle_group(const KDTriangleGroup * const group,
+                         const int lanes,
+                         const KDRay * const ray,
+                         GroupFloat * const t,
+                         GroupFloat * const w1,
+                         GroupFloat * const w2,
+                         GroupFloat * const w3);
+
+static inline void
+set_tree_triangle_hit_norm(const KDTree * const tree,
+                           const int index,
+                           HitRecord * const hit);
+
+static inline int
+untested_group_lanes(Mailbox * const mailbox,
+                     const int * const objects_indexes,
+                     const int lanes_count,
+                     const int ray_bit);
+
+static inline void
+intersect_leaf_groups(const KDTree * const tree,
+                      const KDLeafGroups * const leaf_groups,
+                      const int * const objects_indexes,
+                      const KDRay * const ray,
+                      const Point3d vector_start,
+                      const Vector3d vector,
+                      const int ray_bit,
+                      int * const nearest_index,
+                      HitRecord * const nearest_hit);
+
+static inline Boolean
+is_leaf_groups_intersected(const KDTree * const tree,
+                           const KDLeafGroups * const leaf_groups,
+                           const int * const objects_indexes,
+                           const KDRay * const ray,
+                           const Point3d vector_start,
+                           const Vector3d vector,
+                           const int ray_bit,
+                           const Float max_dist);
+
+static inline int
+is_tree_object_intersected_packet(const KDTree * const tree,
+                                  const int index,
+                                  const KDPacket * const p,
+                                  const RayPacket * const packet,
+                                  const int mask,
+                                  const Float * const max_dists);
+
+static inline Boolean
+find_intersection_subtree(const KDTree * const tree,
+                          const KDNode * node,
+                          const KDRay * const ray,
+                          const Point3d vector_start,
+                          const Vector3d vector,
+                          Float t_min,
+                          Float t_max,
+                          const int ray_bit,
+                          int * const nearest_index,
+                          HitRecord * const nearest_hit);
+
+static inline Boolean
+is_intersect_anything_subtree(const KDTree * const tree,
+                              const KDNode * node,
+                              const KDRay * const ray,
+                              const Point3d vector_start,
+                              const Vector3d vector,
+                              Float t_min,
+                              Float t_max,
+                              const int ray_bit,
+                              const Float max_dist);
+
+static inline void
+new_kd_packet(const RayPacket * const packet,
+              KDPacket * const p);
+
+static inline int
+clip_packet_by_voxel(const KDPacket * const p,
+                     const int mask,
+                     const Voxel v,
+                     PacketFloat * const t_min,
+                     PacketFloat * const t_max);
+
+static inline const KDNode *
+find_packet_leaf(const KDNode * const nodes,
+                 const KDNode * node,
+                 const KDPacket * const p,
+                 int * const mask,
+                 PacketFloat * const t_min,
+                 PacketFloat * const t_max,
+                 PacketTraversalEntry * const stack,
+                 int * const stack_size);
+
+static inline Boolean
+clip_ray_by_voxel(const KDRay * const ray,
+                  const Voxel v,
+                  Float * const t_min,
+                  Float * const t_max);
+
+static void
+release_build_node(BuildNode * node);
+
+static void
+collect_kd_tree_stats(const KDTree * const tree,
+                      const int position,
+                      const Voxel v,
+                      const int depth,
+                      KDTreeStats * const stats);
+
+static KDTree *
+new_comb_kd_tree(const int depth);
+
+static Float
+measure_traversal_step(void);
+
+static Float
+measure_intersection(Object3d ** objects,
+                     const BoundingBoxes * const boxes,
+                     const Point3d * const starts,
+                     const Vector3d * const vectors,
+                     const int rays_count);
+
+static Float
+measure_tracing(KDTree * const tree,
+                const Point3d * const starts,
+                const Vector3d * const vectors,
+                const int rays_count);
+
+static void
+count_build_nodes(const BuildNode * const node,
+                  int * const nodes_count,
+                  int * const indexes_count);
+
+static void
+flatten_build_node(KDTree * const tree,
+                   const BuildNode * const node,
+                   const int position,
+                   int * const next_node,
+                   int * const next_index);
 
 
 // Code
@@ -126,644 +806,3606 @@ point_in_voxel(const Point3d p,
 
 void
 release_kd_tree(KDTree * tree) {
-    release_kd_node(tree->root);
+    if(tree->mapping) {
+        munmap(tree->mapping, tree->mapping_size);
+    } else {
+        free(tree->nodes);
+        free(tree->objects_indexes);
+    }
+    free(tree->primitives);
+    free(tree->mesh_primitives);
+    free(tree->triangle_groups);
+    free(tree->leaf_groups);
     free(tree);
 }
 
-void
-release_kd_node(KDNode * node) {
-    if(node->l)
-        release_kd_node(node->l);
-    if(node->r)
-        release_kd_node(node->r);
-    if(node->objects)
-        free(node->objects);
-    free(node);
+KDTreeParams
+kd_tree_params(const int max_depth,
+               const int objects_in_leaf,
+               const Float traversal_cost,
+               const Float intersection_cost) {
+    
+    KDTreeParams params = {.max_depth = max_depth,
+                           .objects_in_leaf = objects_in_leaf,
+                           .traversal_cost = traversal_cost,
+                           .intersection_cost = intersection_cost};
+    return params;
 }
 
-KDTree *
-build_kd_tree(Object3d ** objects,
-              int objects_count) {
-    
-    KDTree * tree = malloc(sizeof(KDTree));
-    tree->bounding_box = make_initial_voxel(objects, objects_count);
-    tree->root = rec_build(objects, objects_count, tree->bounding_box, 0);
-    return tree;
+KDTreeParams
+default_kd_tree_params(void) {
+    return kd_tree_params(MAX_TREE_DEPTH, OBJECTS_IN_LEAF, SPLIT_COST, 1);
 }
 
-inline KDNode *
-rec_build(Object3d ** objects,
-          int objects_count,
-          Voxel v,
-          int iter) {
-    
-    enum Plane p;
-    Coord c;
-    find_plane(objects, objects_count, v, iter, &p, &c);
-    
-    if(p == NONE) {
-        return make_leaf(objects, objects_count);
-    }
+KDTreeStats
+get_kd_tree_stats(const KDTree * const tree) {
+    KDTreeStats stats;
+    memset(&stats, 0, sizeof(KDTreeStats));
     
-    Voxel vl;
-    Voxel vr;
-    split_voxel(v, p, c, &vl, &vr);
+    // Triangles of meshes are counted as objects
+    stats.objects_count = tree->objects_count + tree->mesh_primitives_count;
+    stats.nodes_bytes = sizeof(KDTree)
+                        + tree->nodes_capacity * sizeof(KDNode)
+                        + tree->objects_indexes_capacity * sizeof(int)
+                        + tree->nodes_capacity * sizeof(KDLeafGroups);
+    stats.primitives_bytes = (tree->primitives_capacity + tree->mesh_primitives_count) * sizeof(KDPrimitive)
+                             + tree->triangle_groups_capacity * sizeof(KDTriangleGroup);
     
-    int l_objects_count = filter_overlapped_objects(objects, objects_count, vl);
-    KDNode * l = rec_build(objects, l_objects_count, vl, iter + 1);
+    collect_kd_tree_stats(tree, 0, tree->bounding_box, 0, &stats);
     
-    int r_objects_count = filter_overlapped_objects(objects, objects_count, vr);
-    KDNode * r = rec_build(objects, r_objects_count, vr, iter + 1);
-
+    const Voxel v = tree->bounding_box;
+    const Float volume = (v.x_max - v.x_min) * (v.y_max - v.y_min) * (v.z_max - v.z_min);
+    const Float area = voxel_area(v);
     
-    KDNode * node = malloc(sizeof(KDNode));
-    node->objects = NULL;
-    node->objects_count = 0;
-    node->plane = p;
-    node->coord = c;
-    node->l = l;
-    node->r = r;
+    stats.empty_volume = (volume > 0) ? stats.empty_volume / volume : 0;
+    stats.sah_cost = (area > 0) ? node_cost(tree, 0, v) / area : 0;
+    stats.duplication = (stats.objects_count) ? (Float) stats.references_count / stats.objects_count : 0;
     
-    return node;
+    return stats;
 }
 
-inline int
-filter_overlapped_objects(Object3d ** objects,
-                          const int objects_count,
-                          const Voxel v) {
+static void
+collect_kd_tree_stats(const KDTree * const tree,
+                      const int position,
+                      const Voxel v,
+                      const int depth,
+                      KDTreeStats * const stats) {
     
-    int i = 0;
-    int j = objects_count - 1;
+    const KDNode * node = &tree->nodes[position];
+    const enum Plane plane = node->flags & NODE_PLANE_MASK;
     
-    Object3d * tmp;
+    stats->nodes_count++;
+    stats->max_depth = (depth > stats->max_depth) ? depth : stats->max_depth;
     
-    // Put all objects, which overlap with voxel to the left part of array
-    while(i <= j) {
-        while((i < j) && (object_in_voxel(objects[i], v)))
-            i++;
+    if(plane == NONE) {
+        const int count = node->flags >> NODE_PLANE_BITS;
+        
+        int size_index = 0;
+        while((count >> size_index) && (size_index < KD_TREE_STATS_LEAF_SIZES - 1))
+            size_index++;
         
-        while((j > i) && (!object_in_voxel(objects[j], v)))
-            j--;
+        stats->leaves_count++;
+        stats->leaves_by_depth[(depth < KD_TREE_STATS_DEPTHS) ? depth : KD_TREE_STATS_DEPTHS - 1]++;
+        stats->leaves_by_size[size_index]++;
+        stats->references_count += count;
+        stats->max_leaf_size = (count > stats->max_leaf_size) ? count : stats->max_leaf_size;
         
-        tmp = objects[i];
-        objects[i] = objects[j];
-        objects[j] = tmp;
-        i++;
-        j--;
+        if(!count) {
+            stats->empty_leaves_count++;
+            stats->empty_volume += (v.x_max - v.x_min) * (v.y_max - v.y_min) * (v.z_max - v.z_min);
+        }
+        return;
     }
     
-    // Actually, after the loop, variable 'i' is a count of overlapped objects
-    return i;
+    Coord c;
+    c.x = node->data.split;
+    
+    Voxel vl;
+    Voxel vr;
+    split_voxel(v, plane, c, &vl, &vr);
+    
+    const int children = node->flags >> NODE_PLANE_BITS;
+    collect_kd_tree_stats(tree, children, vl, depth + 1, stats);
+    collect_kd_tree_stats(tree, children + 1, vr, depth + 1, stats);
 }
 
-inline void
-split_voxel(const Voxel v,
-            const enum Plane p,
-            const Coord c,
-            Voxel * const vl,
-            Voxel * const vr) {
+void
+print_kd_tree_stats(const KDTreeStats * const stats) {
+    printf("Kd-tree: %i nodes, %i leaves (%i empty), max depth %i\n",
+           stats->nodes_count, stats->leaves_count, stats->empty_leaves_count, stats->max_depth);
+    printf("  memory: nodes %.1f KB, primitives %.1f KB\n",
+           stats->nodes_bytes / 1024.0, stats->primitives_bytes / 1024.0);
+    printf("  objects: %i, references: %i, duplication: %.2f, max leaf size: %i\n",
+           stats->objects_count, stats->references_count, stats->duplication, stats->max_leaf_size);
+    printf("  SAH cost: %.2f, empty volume: %.1f%%\n",
+           stats->sah_cost, stats->empty_volume * 100);
     
-    *vl = v;
-    *vr = v;
+    int i;
+    printf("  leaves by depth:");
+    for(i = 0; i <= stats->max_depth && i < KD_TREE_STATS_DEPTHS; i++) {
+        if(stats->leaves_by_depth[i])
+            printf(" %i:%i", i, stats->leaves_by_depth[i]);
+    }
     
-    switch(p) {
-        case XY:
-            vl->z_max = c.z;
-            vr->z_min = c.z;
-            break;
-            
-        case XZ:
-            vl->y_max = c.y;
-            vr->y_min = c.y;
-            break;
-            
-        case YZ:
-            vl->x_max = c.x;
-            vr->x_min = c.x;
-            break;
-        case NONE:
-            // Unreachable case
-            printf("[split_voxel] Plane is NONE. Error");
-            exit(1);
-            break;
+    printf("\n  leaves by size:");
+    for(i = 0; i < KD_TREE_STATS_LEAF_SIZES; i++) {
+        if(!stats->leaves_by_size[i])
+            continue;
+        if(i < 2)
+            printf(" %i:%i", i, stats->leaves_by_size[i]);
+        else if(i < KD_TREE_STATS_LEAF_SIZES - 1)
+            printf(" %i-%i:%i", 1 << (i - 1), (1 << i) - 1, stats->leaves_by_size[i]);
+        else
+            printf(" %i+:%i", 1 << (i - 1), stats->leaves_by_size[i]);
     }
+    printf("\n");
 }
 
 /*
- * Using Surface Area Heuristic (SAH) for finding best split pane
- *
- * SAH = 0.5 * voxel_surface_area * number_of_objects_in_voxel
- *
- * splitted_SAH = split_cost
- *                + 0.5 * left_voxel_surface_area * number_of_objects_in_left_voxel
- *                + 0.5 * right_voxel_surface_area * number_of_objects_in_right_voxel
- *
- * Finding coordinate of split plane (XY, XZ or YZ) which minimizing SAH
- *
- * If can't find optimal split plane - returns NONE
- *
- * see: http://stackoverflow.com/a/4633332/653511
+ * Costs of SAH are set to the measured times (in nanoseconds),
+ * then depth and size of leaf are chosen by tracing of sample rays
+ * through the trees, which are built with different values.
+ * Depth is varied around 8 + 1.3 * log2(N) - common estimation of optimal depth
+ * (which is usually too deep for this traversal)
  */
-inline void
-find_plane(Object3d ** objects,
-           const int objects_count,
-           const Voxel v,
-           const int tree_depth,
-           enum Plane * const p,
-           Coord * const c) {
+KDTreeParams
+tune_kd_tree_params(Object3d ** objects,
+                    const BoundingBoxes * const boxes,
+                    const Point3d * const starts,
+                    const Vector3d * const vectors,
+                    const int rays_count) {
     
-    if((tree_depth >= MAX_TREE_DEPTH) || (objects_count <= OBJECTS_IN_LEAF)) {
-        *p = NONE;
-        return;
-    }
+    KDTreeParams best = default_kd_tree_params();
+    if(!boxes->count || !rays_count)
+        return best;
     
-    const Float hx = v.x_max - v.x_min;
-    const Float hy = v.y_max - v.y_min;
-    const Float hz = v.z_max - v.z_min;
+    best.traversal_cost = measure_traversal_step() * 1e9;
+    best.intersection_cost = measure_intersection(objects, boxes, starts, vectors, rays_count) * 1e9;
     
-    // Calculating square of each side of initial voxel
-    Float Sxy = hx * hy;
-    Float Sxz = hx * hz;
-    Float Syz = hy * hz;
+    const int leaf_sizes[] = {1, 2, 4};
+    const int depth = 8 + 1.3 * log2(boxes->count) + 0.5;
+    const int depths[] = {depth - 8, depth - 4, depth, depth + 4};
     
-    const Float Ssum = Sxy + Sxz + Syz;
+    Float best_time = FLOAT_MAX;
+    int i;
+    int j;
+    for(i = 0; i < sizeof(depths) / sizeof(int); i++) {
+        for(j = 0; j < sizeof(leaf_sizes) / sizeof(int); j++) {
+            KDTreeParams params = best;
+            params.max_depth = (depths[i] > 1) ? depths[i] : 1;
+            params.objects_in_leaf = leaf_sizes[j];
+            
+            KDTree * tree = build_kd_tree(objects, boxes, &params);
+            const Float time = measure_tracing(tree, starts, vectors, rays_count);
+            release_kd_tree(tree);
+            
+            if(time < best_time) {
+                best_time = time;
+                best.max_depth = params.max_depth;
+                best.objects_in_leaf = params.objects_in_leaf;
+            }
+        }
+    }
+    return best;
+}
 
-    // Let's normalize square of each side of initial voxel
-    // to satisfy the following relationship:
-    // Sxy + Sxz + Syz = 1
-    Sxy /= Ssum;
-    Sxz /= Ssum;
-    Syz /= Ssum;
+/*
+ * Tree, where every ray along the x axis visits all nodes
+ */
+static KDTree *
+new_comb_kd_tree(const int depth) {
+    KDTree * tree = calloc(1, sizeof(KDTree));
+    tree->nodes_count = 2 * depth + 1;
+    tree->nodes = malloc(tree->nodes_count * sizeof(KDNode));
+    tree->objects_indexes = malloc(sizeof(int));
     
-    const int max_splits = MAX_SPLITS_OF_VOXEL;
-    const Float split_cost = SPLIT_COST;
+    Voxel v = {0, 0, 0, 1, 1, 1};
+    tree->bounding_box = v;
     
-    // Assume that at the beginning best SAH has initial voxel
-    // SAH = 0.5 * square * objects_count
-    // square of initial voxel is Sxy + Sxz + Syz = 1
-    Float bestSAH = objects_count;
-    // initial voxel doesn't have split pane
-    *p = NONE;
-    
-    Float currSAH;
-    Coord curr_split_coord;
     int i;
-    Voxel vl;
-    Voxel vr;
-    Float l;
-    Float r;
+    for(i = 0; i < depth; i++) {
+        KDNode * node = &tree->nodes[2 * i];
+        node->data.split = (float) (i + 1) / (depth + 1);
+        node->flags = ((2 * i + 1) << NODE_PLANE_BITS) | YZ;
+        
+        KDNode * leaf = &tree->nodes[2 * i + 1];
+        leaf->data.objects_offset = 0;
+        leaf->flags = NONE;
+    }
+    tree->nodes[2 * depth].data.objects_offset = 0;
+    tree->nodes[2 * depth].flags = NONE;
     
-    Float S_split;
-    Float S_non_split;
+    tree->nodes_capacity = tree->nodes_count;
+    group_tree_leaves(tree);
     
-    // Let's find split surface, which have the least SAH
+    return tree;
+}
+
+/*
+ * Time of visiting of inner node (and of its empty leaf) by the real traversal
+ */
+static Float
+measure_traversal_step(void) {
+    KDTree * tree = new_comb_kd_tree(TUNER_COMB_DEPTH);
     
-    // TODO: maybe do some refactoring (because of following 3 loops are very similar)
+    const int rays_count = 1024;
+    Point3d * starts = malloc(rays_count * sizeof(Point3d));
+    Vector3d * vectors = malloc(rays_count * sizeof(Vector3d));
     
-    // trying to minimize SAH by splitting across XY plane
-    S_split = Sxy;
-    S_non_split = Sxz + Syz;
-    for(i = 1; i < max_splits; i++) {
-
-        l = ((float) i) / max_splits;
-        r = 1 - l;
-        
-        // Current coordinate of split surface
-        curr_split_coord.z = v.z_min + l * hz;
-        
-        split_voxel(v, XY, curr_split_coord, &vl, &vr);
-        
-        currSAH = (S_split + l * S_non_split) * objects_in_voxel(objects, objects_count, vl)
-                + (S_split + r * S_non_split) * objects_in_voxel(objects, objects_count, vr)
-                + split_cost;
-        
-        if(currSAH < bestSAH) {
-            bestSAH = currSAH;
-            *p = XY;
-            *c = curr_split_coord;
-        }
+    int i;
+    for(i = 0; i < rays_count; i++) {
+        starts[i] = point3d(-1, 0.25 + (i % 32) / 64.0, 0.25 + (i / 32) / 64.0);
+        vectors[i] = vector3df(1, 1e-3 * (i % 7 - 3), 1e-3 * (i % 5 - 2));
     }
     
-    // trying to minimize SAH by splitting across XZ plane
-    S_split = Sxz;
-    S_non_split = Sxy + Syz;
-    for(i = 1; i < max_splits; i++) {
-        
-        l = ((float) i) / max_splits;
-        r = 1 - l;
+    const Float time = measure_tracing(tree, starts, vectors, rays_count);
+    
+    free(starts);
+    free(vectors);
+    release_kd_tree(tree);
+    
+    return time / TUNER_COMB_DEPTH;
+}
 
-        // Current coordinate of split surface       
-        curr_split_coord.y = v.y_min + l * hy;
-        
-        split_voxel(v, XZ, curr_split_coord, &vl, &vr);
-        
-        currSAH = (S_split + l * S_non_split) * objects_in_voxel(objects, objects_count, vl)
-                + (S_split + r * S_non_split) * objects_in_voxel(objects, objects_count, vr)
-                + split_cost;
+/*
+ * Time of intersect call for objects, whose bounding boxes are crossed by the ray
+ * (like objects in the leaves, which are visited by the ray)
+ */
+static Float
+measure_intersection(Object3d ** objects,
+                     const BoundingBoxes * const boxes,
+                     const Point3d * const starts,
+                     const Vector3d * const vectors,
+                     const int rays_count) {
+    
+    int * rays = malloc(rays_count * TUNER_OBJECTS_PER_RAY * sizeof(int));
+    Object3d ** tested = malloc(rays_count * TUNER_OBJECTS_PER_RAY * sizeof(Object3d *));
+    int count = 0;
+    
+    int i;
+    int j;
+    for(i = 0; i < rays_count; i++) {
+        int found = 0;
         
-        if(currSAH < bestSAH) {
-            bestSAH = currSAH;
-            *p = XZ;
-            *c = curr_split_coord;
+        // Only some of objects are checked - to keep tuning fast on big scenes
+        for(j = 0; (j < TUNER_OBJECTS_SCAN) && (j < boxes->count) && (found < TUNER_OBJECTS_PER_RAY); j++) {
+            const int k = (i * 7919LL + j * 104729LL) % boxes->count;
+            const Voxel box = {boxes->x_min[k], boxes->y_min[k], boxes->z_min[k],
+                               boxes->x_max[k], boxes->y_max[k], boxes->z_max[k]};
+            
+            if(voxel_intersection(vectors[i], starts[i], box)) {
+                rays[count] = i;
+                tested[count] = objects[boxes->index[k]];
+                count++;
+                found++;
+            }
         }
     }
     
-    // trying to minimize SAH by splitting across YZ plane
-    S_split = Syz;
-    S_non_split = Sxy + Sxz;
-    for(i = 1; i < max_splits; i++) {
-        
-        l = ((float) i) / max_splits;
-        r = 1 - l;
-        
-        // Current coordinate of split surface
-        curr_split_coord.x = v.x_min + l * hx;
-        
-        split_voxel(v, YZ, curr_split_coord, &vl, &vr);
-        
-        currSAH = (S_split + l * S_non_split) * objects_in_voxel(objects, objects_count, vl)
-                + (S_split + r * S_non_split) * objects_in_voxel(objects, objects_count, vr)
-                + split_cost;
+    Float best_time = FLOAT_MAX;
+    int repeat;
+    for(repeat = 0; (repeat < TUNER_REPEATS) && count; repeat++) {
+        HitRecord hit;
         
-        if(currSAH < bestSAH) {
-            bestSAH = currSAH;
-            *p = YZ;
-            *c = curr_split_coord;
+        const double start = omp_get_wtime();
+        for(i = 0; i < count; i++) {
+            tested[i]->intersect(tested[i]->data, starts[rays[i]], vectors[rays[i]], &hit);
         }
+        const double time = omp_get_wtime() - start;
+        
+        best_time = (time < best_time) ? time : best_time;
     }
-}
-
-inline int
-objects_in_voxel(Object3d ** objects,
-                 const int objects_count,
-                 const Voxel v) {
     
-    int i;
-    int count = 0;
-    for(i = 0; i < objects_count; i++)
-        if(object_in_voxel(objects[i], v))
-            ++count;
+    free(rays);
+    free(tested);
     
-    return count;
+    // Default ratio of costs, if no ray crosses objects
+    return (count) ? best_time / count : measure_traversal_step() / SPLIT_COST;
 }
 
-Voxel
-make_initial_voxel(Object3d ** objects,
-                   int objects_count) {
-    
-    if(!objects_count) {
-        Voxel v = {-1, -1, -1, 1, 1, 1};
-        return v;
-    }
-        
-    Point3d min_p = objects[0]->get_min_boundary_point(objects[0]->data);
-    Point3d max_p = objects[0]->get_max_boundary_point(objects[0]->data);
-    
-    Float x_min = min_p.x;
-    Float y_min = min_p.y;
-    Float z_min = min_p.z;
-    
-    Float x_max = max_p.x;
-    Float y_max = max_p.y;
-    Float z_max = max_p.z;
+static Float
+measure_tracing(KDTree * const tree,
+                const Point3d * const starts,
+                const Vector3d * const vectors,
+                const int rays_count) {
     
+    Float best_time = FLOAT_MAX;
+    int repeat;
     int i;
-    for(i = 0; i < objects_count; i++) {
-        min_p = objects[i]->get_min_boundary_point(objects[i]->data);
-        max_p = objects[i]->get_max_boundary_point(objects[i]->data);
+    for(repeat = 0; repeat < TUNER_REPEATS; repeat++) {
+        Object3d * obj;
+        HitRecord hit;
         
-        x_min = (x_min < min_p.x) ? x_min : min_p.x;
-        y_min = (y_min < min_p.y) ? y_min : min_p.y;
-        z_min = (z_min < min_p.z) ? z_min : min_p.z;
+        const double start = omp_get_wtime();
+        for(i = 0; i < rays_count; i++) {
+            hit.t = FLOAT_MAX;
+            find_intersection_tree(tree, starts[i], vectors[i], &obj, &hit);
+        }
+        const double time = omp_get_wtime() - start;
         
-        x_max = (x_max > max_p.x) ? x_max : max_p.x;
-        y_max = (y_max > max_p.y) ? y_max : max_p.y;
-        z_max = (z_max > max_p.z) ? z_max : max_p.z;
+        best_time = (time < best_time) ? time : best_time;
     }
-    
-    Voxel v = {x_min - 1, y_min - 1, z_min - 1, x_max + 1, y_max + 1, z_max + 1};
-    return v;
+    return best_time / rays_count;
 }
 
-
-inline __hot Boolean
-object_in_voxel(Object3d * const obj,
-                const Voxel v) {
+/*
+ * FNV-1a, applied to 8-byte words
+ */
+static inline unsigned long long
+hash_bytes(unsigned long long hash,
+           const void * data,
+           const size_t size) {
     
-    Point3d min_p = obj->get_min_boundary_point(obj->data);
-    Point3d max_p = obj->get_max_boundary_point(obj->data);
-
-    return
-        !((max_p.x < v.x_min)
-          || (max_p.y < v.y_min)
-          || (max_p.z < v.z_min)
-          || (min_p.x > v.x_max)
-          || (min_p.y > v.y_max)
-          || (min_p.z > v.z_max));
+    const unsigned char * bytes = data;
+    unsigned long long word;
+    size_t i;
+    for(i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for(; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
 }
 
-inline KDNode *
-make_leaf(Object3d ** objects,
-          int objects_count) {
+/*
+ * Triangles of mesh are hashed by their vertexes
+ * (the same vertexes can be referenced in another order)
+ */
+static unsigned long long
+hash_mesh_triangles(unsigned long long hash,
+                    const TriangleMesh * const mesh) {
     
-    KDNode * leaf = malloc(sizeof(KDNode));
-    leaf->plane = NONE;
-    leaf->objects_count = objects_count;
-    leaf->l = NULL;
-    leaf->r = NULL;
-    if(objects_count) {
-        leaf->objects = (Object3d **) malloc(objects_count * sizeof(Object3d *));
-    } else {
-        leaf->objects = NULL;
+    int i;
+    for(i = 0; i < mesh->triangles_count; i++) {
+        const int * v = mesh->triangles[i].vertexes;
+        hash = hash_bytes(hash, &mesh->vertexes[v[0]], sizeof(Point3d));
+        hash = hash_bytes(hash, &mesh->vertexes[v[1]], sizeof(Point3d));
+        hash = hash_bytes(hash, &mesh->vertexes[v[2]], sizeof(Point3d));
     }
+    return hash;
+}
+
+unsigned long long
+kd_tree_key(Object3d ** objects,
+            const BoundingBoxes * const boxes,
+            const KDTreeParams * const params) {
     
-    memcpy(leaf->objects, objects, objects_count * sizeof(Object3d *));
+    const int format[] = {KD_TREE_CACHE_VERSION, sizeof(Float), sizeof(KDNode),
+                          KD_TREE_BINS, boxes->count};
+    const size_t size = boxes->count * sizeof(Float);
     
-    return leaf;
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = hash_bytes(hash, format, sizeof(format));
+    hash = hash_bytes(hash, params, sizeof(KDTreeParams));
+    hash = hash_bytes(hash, boxes->x_min, size);
+    hash = hash_bytes(hash, boxes->y_min, size);
+    hash = hash_bytes(hash, boxes->z_min, size);
+    hash = hash_bytes(hash, boxes->x_max, size);
+    hash = hash_bytes(hash, boxes->y_max, size);
+    hash = hash_bytes(hash, boxes->z_max, size);
+    
+    // Builder clips triangles and spheres by voxels, so the tree depends on their exact geometry
+    int i;
+    for(i = 0; i < boxes->count; i++) {
+        const KDPrimitive primitive = new_kd_primitive(objects[i]);
+        
+        hash = hash_bytes(hash, &primitive.type, sizeof(primitive.type));
+        if(primitive.type == TRIANGLE_OBJECT) {
+            hash = hash_bytes(hash, &primitive.geometry.triangle, sizeof(primitive.geometry.triangle));
+        } else if(primitive.type == SPHERE_OBJECT) {
+            hash = hash_bytes(hash, &primitive.geometry.sphere.center, sizeof(Point3d));
+            hash = hash_bytes(hash, &primitive.geometry.sphere.radius, sizeof(Float));
+        } else if(primitive.type == MESH_OBJECT) {
+            hash = hash_mesh_triangles(hash, primitive.geometry.mesh_triangle.mesh);
+        }
+    }
+    return hash;
 }
 
-inline __hot Boolean
-vector_plane_intersection(const Vector3d vector,
-                          const Point3d vector_start,
-                          const enum Plane plane,
-                          const Coord coord,
-                          Point3d * const result) {
+/*
+ * Checks, that children of inner nodes and objects of leaves are inside of arrays of tree,
+ * and that tree isn't deeper than the stack of traversal
+ */
+static Boolean
+is_valid_kd_node(const KDNode * const nodes,
+                 const int nodes_count,
+                 const int * const objects_indexes,
+                 const int objects_indexes_count,
+                 const int objects_count,
+                 const int mesh_primitives_count,
+                 const int position,
+                 const int depth) {
     
-    Float k;    
-    switch(plane) {
-        case XY:
-            if(((coord.z < vector_start.z) && (vector.z > 0))
-                || ((coord.z > vector_start.z) && (vector.z < 0)))
-                return False;
-            
-            k = (coord.z - vector_start.z) / vector.z;
-            *result = point3d(vector_start.x + vector.x * k,
-                              vector_start.y + vector.y * k,
-                              coord.z);
-            break;
+    const KDNode * node = &nodes[position];
+    
+    if((node->flags & NODE_PLANE_MASK) == NONE) {
+        const unsigned int count = node->flags >> NODE_PLANE_BITS;
+        const unsigned int offset = node->data.objects_offset;
         
-        case XZ:
-            if(((coord.y < vector_start.y) && (vector.y > 0))
-               || ((coord.y > vector_start.y) && (vector.y < 0)))
-                return False;
-            
-            k = (coord.y - vector_start.y) / vector.y;
-            *result = point3d(vector_start.x + vector.x * k,
-                              coord.y,
-                              vector_start.z + vector.z * k);
-            break;
-            
-        case YZ:
-            if(((coord.x < vector_start.x) && (vector.x > 0))
-               || ((coord.x > vector_start.x) && (vector.x < 0)))
+        if((offset > objects_indexes_count) || (count > objects_indexes_count - offset))
+            return False;
+        
+        int i;
+        for(i = 0; i < count; i++) {
+            if((objects_indexes[offset + i] < -mesh_primitives_count)
+               || (objects_indexes[offset + i] >= objects_count)) {
+                
                 return False;
-            
-            k = (coord.x - vector_start.x) / vector.x;
-            *result = point3d(coord.x,
-                              vector_start.y + vector.y * k,
-                              vector_start.z + vector.z * k);
-            break;
-            
-        case NONE:
-            // Unreachable case
-            printf("[vector_plane_intersection] Plane is NONE. Error");
-            exit(1);
-            break;
+            }
+        }
+        return True;
     }
     
-    return True;
+    // Children are always placed after their parent, so the check can't loop
+    const unsigned int children = node->flags >> NODE_PLANE_BITS;
+    
+    return (depth < KD_TREE_STACK_SIZE)
+           && (children > position)
+           && (children + 1 < nodes_count)
+           && is_valid_kd_node(nodes, nodes_count, objects_indexes, objects_indexes_count,
+                               objects_count, mesh_primitives_count, children, depth + 1)
+           && is_valid_kd_node(nodes, nodes_count, objects_indexes, objects_indexes_count,
+                               objects_count, mesh_primitives_count, children + 1, depth + 1);
 }
 
-inline Boolean
-voxel_intersection(const Vector3d vector,
-                   const Point3d vector_start,
-                   const Voxel v) {
+/*
+ * Tree is written to the temporary file, which replaces the cache,
+ * so concurrent readers never see partially written tree
+ */
+void
+save_kd_tree(const KDTree * const tree,
+             const unsigned long long key,
+             const char * const file_name) {
     
-    if(point_in_voxel(vector_start, v))
-        return True;
+    KDTreeFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "KDTREE", 6);
+    header.key = key;
+    header.nodes_count = tree->nodes_count;
+    header.objects_indexes_count = tree->objects_indexes_count;
+    header.objects_count = tree->objects_count;
+    header.mesh_primitives_count = tree->mesh_primitives_count;
+    header.bounding_box = tree->bounding_box;
     
-    Point3d p;
-    Coord c;
+    char * tmp_name = malloc(strlen(file_name) + 5);
+    sprintf(tmp_name, "%s.tmp", file_name);
     
-    c.z = v.z_min;
-    if(vector_plane_intersection(vector, vector_start, XY, c, &p)
-       && (p.x > v.x_min) && (p.x < v.x_max)
-       && (p.y > v.y_min) && (p.y < v.y_max)) {
-        
-            return True;
+    FILE * f = fopen(tmp_name, "wb");
+    Boolean written = False;
+    if(f) {
+        written = (fwrite(&header, sizeof(header), 1, f) == 1)
+            && (fwrite(tree->nodes, sizeof(KDNode), tree->nodes_count, f) == tree->nodes_count)
+            && (fwrite(tree->objects_indexes, sizeof(int), tree->objects_indexes_count, f)
+                == tree->objects_indexes_count);
+        written = (fclose(f) == 0) && written;
     }
     
-    c.z = v.z_max;
-    if(vector_plane_intersection(vector, vector_start, XY, c, &p)
-       && (p.x > v.x_min) && (p.x < v.x_max)
-       && (p.y > v.y_min) && (p.y < v.y_max)) {
-        
-            return True;
+    if(written && !rename(tmp_name, file_name)) {
+        free(tmp_name);
+        return;
     }
     
-    c.y = v.y_min;
-    if(vector_plane_intersection(vector, vector_start, XZ, c, &p)
-       && (p.x > v.x_min) && (p.x < v.x_max)
-       && (p.z > v.z_min) && (p.z < v.z_max)) {
-        
-            return True;
-    }
+    fprintf(stderr, "Can't save kd-tree to the file %s\n", file_name);
+    remove(tmp_name);
+    free(tmp_name);
+}
+
+/*
+ * Arrays of tree are used right inside of the mapped file,
+ * pages are loaded on demand by the first traversals
+ */
+KDTree *
+load_kd_tree(Object3d ** objects,
+             const int objects_count,
+             const KDTreeParams * const params,
+             const unsigned long long key,
+             const char * const file_name) {
     
-    c.y = v.y_max;
-    if(vector_plane_intersection(vector, vector_start, XZ, c, &p)
-       && (p.x > v.x_min) && (p.x < v.x_max)
-       && (p.z > v.z_min) && (p.z < v.z_max)) {
-        
-            return True;
+    const int fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size < sizeof(KDTreeFileHeader)) {
+        close(fd);
+        return NULL;
     }
     
-    c.x = v.x_min;
-    if(vector_plane_intersection(vector, vector_start, YZ, c, &p)
-       && (p.y > v.y_min) && (p.y < v.y_max)
-       && (p.z > v.z_min) && (p.z < v.z_max)) {
+    // Private writable mapping: modifications of the tree don't touch the file
+    const size_t size = st.st_size;
+    void * mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED)
+        return NULL;
+    
+    int mesh_primitives_count;
+    KDPrimitive * mesh_primitives = new_mesh_primitives(objects, objects_count, &mesh_primitives_count);
+    
+    const KDTreeFileHeader * header = mapping;
+    if(memcmp(header->magic, "KDTREE", 6)
+       || header->key != key
+       || header->objects_count != objects_count
+       || header->mesh_primitives_count != mesh_primitives_count
+       || header->nodes_count < 1
+       || header->objects_indexes_count < 0
+       || size != sizeof(KDTreeFileHeader)
+                  + header->nodes_count * sizeof(KDNode)
+                  + header->objects_indexes_count * sizeof(int)) {
         
-            return True;
+        free(mesh_primitives);
+        munmap(mapping, size);
+        return NULL;
     }
     
-    c.x = v.x_max;
-    if(vector_plane_intersection(vector, vector_start, YZ, c, &p)
-       && (p.y > v.y_min) && (p.y < v.y_max)
-       && (p.z > v.z_min) && (p.z < v.z_max)) {
+    // Corrupted file can't make traversal read outside of the mapping
+    const KDNode * nodes = (const KDNode *) ((char *) mapping + sizeof(KDTreeFileHeader));
+    if(!is_valid_kd_node(nodes, header->nodes_count,
+                         (const int *) (nodes + header->nodes_count), header->objects_indexes_count,
+                         objects_count, mesh_primitives_count, 0, 0)) {
         
-            return True;
+        fprintf(stderr, "Kd-tree in the file %s is corrupted\n", file_name);
+        free(mesh_primitives);
+        munmap(mapping, size);
+        return NULL;
     }
     
-    return False;
+    KDTree * tree = malloc(sizeof(KDTree));
+    tree->nodes = (KDNode *) ((char *) mapping + sizeof(KDTreeFileHeader));
+    tree->nodes_count = header->nodes_count;
+    tree->objects_indexes = (int *) (tree->nodes + tree->nodes_count);
+    tree->objects_indexes_count = header->objects_indexes_count;
+    tree->objects = objects;
+    tree->objects_count = objects_count;
+    tree->primitives = new_kd_primitives(objects, objects_count);
+    tree->primitives_capacity = objects_count + 1;
+    tree->mesh_primitives = mesh_primitives;
+    tree->mesh_primitives_count = mesh_primitives_count;
+    tree->mesh = NULL;
+    tree->bounding_box = header->bounding_box;
+    tree->mapping = mapping;
+    tree->mapping_size = size;
+    tree->params = *params;
+    tree->nodes_capacity = tree->nodes_count;
+    tree->objects_indexes_capacity = tree->objects_indexes_count;
+    tree->garbage_count = 0;
+    tree->triangle_groups = NULL;
+    tree->leaf_groups = NULL;
+    group_tree_leaves(tree);
+    
+    tree->built_cost = node_cost(tree, 0, tree->bounding_box);
+    tree->cost = tree->built_cost;
+    return tree;
 }
 
+/*
+ * Object is added only to the leaves, which it touches,
+ * leaves which become worth splitting are rebuilt.
+ * Returns True if quality of the tree became too low and it has to be rebuilt
+ */
 Boolean
-find_intersection_tree(KDTree * const tree,
-                       const Point3d vector_start,
-                       const Vector3d vector,
-                       Object3d ** const nearest_obj_ptr,
-                       Point3d * const nearest_intersection_point_ptr,
-                       Float * const nearest_intersection_point_dist_ptr) {
+insert_kd_tree_object(KDTree * const tree,
+                      const int index) {
     
-    #ifndef NO_BOUNDING_BOX
-    return (voxel_intersection(vector, vector_start, tree->bounding_box)
-            && find_intersection_node(tree->root,
-                                      tree->bounding_box,
-                                      vector_start,
-                                      vector,
-                                      nearest_obj_ptr,
-                                      nearest_intersection_point_ptr,
-                                      nearest_intersection_point_dist_ptr));
-    #else
-    // Do not take into account scene bounds
-    return find_intersection_node(tree->root,
-                                      tree->bounding_box,
-                                      vector_start,
-                                      vector,
-                                      nearest_obj_ptr,
-                                      nearest_intersection_point_ptr,
-                                      nearest_intersection_point_dist_ptr);
-    #endif // NO_BOUNDING_BOX
+    const Object3d * obj = tree->objects[index];
+    const Voxel box = object_box(obj);
+    Voxel * const bb = &tree->bounding_box;
+    
+    // Triangles of mesh are placed by building of the whole tree
+    if(obj->type == MESH_OBJECT)
+        return True;
+    
+    if(tree->objects_count <= index)
+        tree->objects_count = index + 1;
+    
+    if(tree->primitives_capacity < tree->objects_count) {
+        tree->primitives_capacity = tree->objects_count * 2;
+        tree->primitives = realloc(tree->primitives, tree->primitives_capacity * sizeof(KDPrimitive));
+    }
+    tree->primitives[index] = new_kd_primitive(obj);
+    
+    const Boolean out_of_bounds = (box.x_min < bb->x_min) || (box.y_min < bb->y_min) || (box.z_min < bb->z_min)
+                                  || (box.x_max > bb->x_max) || (box.y_max > bb->y_max) || (box.z_max > bb->z_max);
+    
+    // Bounding box is extended in the same way as in make_initial_voxel.
+    // Voxels of leaves at the border are extended together with it,
+    // but old objects don't touch the new space
+    if(out_of_bounds) {
+        bb->x_min = (box.x_min - 1 < bb->x_min) ? box.x_min - 1 : bb->x_min;
+        bb->y_min = (box.y_min - 1 < bb->y_min) ? box.y_min - 1 : bb->y_min;
+        bb->z_min = (box.z_min - 1 < bb->z_min) ? box.z_min - 1 : bb->z_min;
+        
+        bb->x_max = (box.x_max + 1 > bb->x_max) ? box.x_max + 1 : bb->x_max;
+        bb->y_max = (box.y_max + 1 > bb->y_max) ? box.y_max + 1 : bb->y_max;
+        bb->z_max = (box.z_max + 1 > bb->z_max) ? box.z_max + 1 : bb->z_max;
+    }
+    
+    Voxel clipped = box;
+    if(clip_object_box(obj, tree->bounding_box, &clipped))
+        insert_node_object(tree, 0, tree->bounding_box, clipped, index, 0);
+    
+    // Areas of border voxels were changed
+    if(out_of_bounds)
+        tree->cost = node_cost(tree, 0, tree->bounding_box);
+    
+    if(tree->garbage_count > tree->objects_indexes_count / 2)
+        compact_objects_indexes(tree);
+    
+    return tree->cost > tree->built_cost * KD_TREE_REBUILD_THRESHOLD;
 }
 
-inline Boolean
-find_intersection_node(KDNode * const node,
-                       const Voxel v,
-                       const Point3d vector_start,
-                       const Vector3d vector,
-                       Object3d ** const nearest_obj_ptr,
-                       Point3d * const nearest_intersection_point_ptr,
-                       Float * const nearest_intersection_point_dist_ptr) {
+/*
+ * Removes object from the leaves. If object is not the last one,
+ * the last object takes its index (as it happens in the array of scene objects).
+ * Bounding box of the object must be the same as at the moment of insertion.
+ * Returns True if quality of the tree became too low and it has to be rebuilt
+ */
+Boolean
+remove_kd_tree_object(KDTree * const tree,
+                      const int index) {
+    
+    const int last = tree->objects_count - 1;
+    
+    if(tree->objects[index]->type == MESH_OBJECT)
+        return True;
+    
+    replace_node_object(tree, 0, tree->bounding_box, object_box(tree->objects[index]), index, -1);
+    
+    if(index != last) {
+        tree->primitives[index] = tree->primitives[last];
         
-    // Is leaf
-    if(node->plane == NONE) {
-        if((node->objects_count) && (node->objects)) {
+        // Leaves reference triangles of mesh, not the mesh object
+        if(tree->objects[last]->type == MESH_OBJECT) {
             int i;
-            
-            Object3d * obj = NULL;
-            Point3d intersection_point;
-            Float sqr_curr_dist;
-            
-            Object3d * nearest_obj = NULL;
-            Point3d nearest_intersection_point;
-            Float sqr_nearest_dist;            
-            
-            int intersected = False;
-            
-            // Finding nearest object
-            // and intersection point
-            for(i = 0; i < node->objects_count; i++) {
-                if(node->objects[i]) {
-                    obj = node->objects[i];
-                    
-                    #ifdef RAY_INTERSECTIONS_STAT
-                    ++intersections_per_ray;
-                    #endif // RAY_INTERSECTIONS_STAT
-                    
-                    if((obj->intersect(obj->data, vector_start, vector, &intersection_point))
-                       && (point_in_voxel(intersection_point, v))) {
-
-                        sqr_curr_dist = sqr_module_vector(vector3dp(vector_start, intersection_point));
-                        
-                        if((sqr_curr_dist < sqr_nearest_dist) || (!intersected)) {
-                            
-                            nearest_obj = obj;
-                            nearest_intersection_point = intersection_point;
-                            sqr_nearest_dist = sqr_curr_dist;
-                            intersected = True;
-                        }
-                    }
-                }
+            for(i = 0; i < tree->mesh_primitives_count; i++) {
+                if(tree->mesh_primitives[i].geometry.mesh_triangle.object == last)
+                    tree->mesh_primitives[i].geometry.mesh_triangle.object = index;
             }
-            
-            if(intersected) {
-                Float nearest_dist = sqrt(sqr_nearest_dist);
-                
-                if(nearest_dist < *nearest_intersection_point_dist_ptr) {
-                    *nearest_intersection_point_dist_ptr = nearest_dist;
-                    *nearest_obj_ptr = nearest_obj;
-                    *nearest_intersection_point_ptr = nearest_intersection_point;
-                }
-            }
-            
-            return intersected;
+        } else {
+            replace_node_object(tree, 0, tree->bounding_box, object_box(tree->objects[last]), last, index);
         }
-        return False;
     }
+    tree->objects_count--;
+    
+    if(tree->garbage_count > tree->objects_indexes_count / 2)
+        compact_objects_indexes(tree);
+    
+    return tree->cost > tree->built_cost * KD_TREE_REBUILD_THRESHOLD;
+}
+
+static inline Float
+voxel_area(const Voxel v) {
+    const Float hx = v.x_max - v.x_min;
+    const Float hy = v.y_max - v.y_min;
+    const Float hz = v.z_max - v.z_min;
+    return hx * hy + hx * hz + hy * hz;
+}
+
+/*
+ * Cost of traversal step in units of intersection test
+ */
+static inline Float
+split_cost(const KDTreeParams * const params) {
+    return params->traversal_cost / params->intersection_cost;
+}
+
+/*
+ * SAH cost of subtree, in the same units as it is estimated by find_plane
+ */
+static Float
+node_cost(const KDTree * const tree,
+          const int position,
+          const Voxel v) {
+    
+    const KDNode * node = &tree->nodes[position];
+    const enum Plane plane = node->flags & NODE_PLANE_MASK;
+    
+    if(plane == NONE) {
+        return voxel_area(v) * (node->flags >> NODE_PLANE_BITS);
+    }
+    
+    Coord c;
+    c.x = node->data.split;
+    
+    Voxel vl;
+    Voxel vr;
+    split_voxel(v, plane, c, &vl, &vr);
+    
+    const int children = node->flags >> NODE_PLANE_BITS;
+    return voxel_area(v) * split_cost(&tree->params)
+           + node_cost(tree, children, vl)
+           + node_cost(tree, children + 1, vr);
+}
 
-    // Otherwise    
+/*
+ * Grows arrays of tree (and moves them out of the cache file)
+ */
+static void
+reserve_kd_tree(KDTree * const tree,
+                const int nodes_count,
+                const int objects_indexes_count) {
+    
+    if(tree->mapping) {
+        KDNode * nodes = malloc(tree->nodes_count * sizeof(KDNode));
+        memcpy(nodes, tree->nodes, tree->nodes_count * sizeof(KDNode));
+        int * objects_indexes = malloc((tree->objects_indexes_count + 1) * sizeof(int));
+        memcpy(objects_indexes, tree->objects_indexes, tree->objects_indexes_count * sizeof(int));
+        
+        munmap(tree->mapping, tree->mapping_size);
+        tree->mapping = NULL;
+        tree->mapping_size = 0;
+        
+        tree->nodes = nodes;
+        tree->nodes_capacity = tree->nodes_count;
+        tree->objects_indexes = objects_indexes;
+        tree->objects_indexes_capacity = tree->objects_indexes_count + 1;
+    }
     
-    Voxel front_voxel;
-    Voxel back_voxel;
+    if(nodes_count > tree->nodes_capacity) {
+        const int old_capacity = tree->nodes_capacity;
+        
+        tree->nodes_capacity = (nodes_count > 2 * tree->nodes_capacity) ? nodes_count : 2 * tree->nodes_capacity;
+        tree->nodes = realloc(tree->nodes, tree->nodes_capacity * sizeof(KDNode));
         
-    KDNode * front_node;
-    KDNode * back_node;
+        // New leaves don't have groups yet
+        tree->leaf_groups = realloc(tree->leaf_groups, tree->nodes_capacity * sizeof(KDLeafGroups));
+        memset(tree->leaf_groups + old_capacity, 0, (tree->nodes_capacity - old_capacity) * sizeof(KDLeafGroups));
+    }
+    
+    if(objects_indexes_count > tree->objects_indexes_capacity) {
+        tree->objects_indexes_capacity = (objects_indexes_count > 2 * tree->objects_indexes_capacity)
+                                         ? objects_indexes_count
+                                         : 2 * tree->objects_indexes_capacity;
+        tree->objects_indexes = realloc(tree->objects_indexes, tree->objects_indexes_capacity * sizeof(int));
+    }
+}
+
+static inline Voxel
+object_box(const Object3d * const obj) {
+    const Point3d min_p = obj->get_min_boundary_point(obj->data);
+    const Point3d max_p = obj->get_max_boundary_point(obj->data);
+    
+    Voxel box = {min_p.x, min_p.y, min_p.z, max_p.x, max_p.y, max_p.z};
+    return box;
+}
+
+/*
+ * Bounding box of the part of object, which is inside of voxel,
+ * is written to clipped (voxel is left, if object can't be clipped).
+ * Returns False if object doesn't intersect with voxel
+ */
+static inline Boolean
+clip_tree_object(const KDTree * const tree,
+                 const int index,
+                 const Voxel v,
+                 Voxel * const clipped) {
+    
+    if(tree->mesh)
+        return clip_mesh_triangle_by_voxel(tree->mesh, index, v, clipped);
+    
+    if(index < 0) {
+        const KDPrimitive * primitive = tree_primitive(tree, index);
+        return clip_mesh_triangle_by_voxel(primitive->geometry.mesh_triangle.mesh,
+                                           primitive->geometry.mesh_triangle.index, v, clipped);
+    }
+    
+    const Object3d * obj = tree->objects[index];
+    return !obj->clip_by_voxel || obj->clip_by_voxel(obj->data, v, clipped);
+}
+
+/*
+ * Same as clip_bounding_box, but for the single box
+ */
+static inline Boolean
+clip_object_box(const Object3d * const obj,
+                const Voxel v,
+                Voxel * const box) {
+    
+    Voxel clipped = v;
+    if(obj->clip_by_voxel && !obj->clip_by_voxel(obj->data, v, &clipped)) {
+        return False;
+    }
+    
+    box->x_min = (box->x_min > clipped.x_min) ? box->x_min : clipped.x_min;
+    box->y_min = (box->y_min > clipped.y_min) ? box->y_min : clipped.y_min;
+    box->z_min = (box->z_min > clipped.z_min) ? box->z_min : clipped.z_min;
+    
+    box->x_max = (box->x_max < clipped.x_max) ? box->x_max : clipped.x_max;
+    box->y_max = (box->y_max < clipped.y_max) ? box->y_max : clipped.y_max;
+    box->z_max = (box->z_max < clipped.z_max) ? box->z_max : clipped.z_max;
+    
+    return (box->x_min <= box->x_max)
+           && (box->y_min <= box->y_max)
+           && (box->z_min <= box->z_max);
+}
 
-    switch(node->plane) {
+/*
+ * Walks down in the same way as filter_split_objects distributes objects.
+ * Nodes are addressed by positions, because arrays can be reallocated
+ */
+static void
+insert_node_object(KDTree * const tree,
+                   const int position,
+                   const Voxel v,
+                   Voxel box,
+                   const int index,
+                   const int depth) {
+    
+    const KDNode node = tree->nodes[position];
+    const enum Plane plane = node.flags & NODE_PLANE_MASK;
+    
+    if(plane == NONE) {
+        const int count = node.flags >> NODE_PLANE_BITS;
+        int offset = node.data.objects_offset;
+        
+        // Leaf at the end of array grows in place,
+        // otherwise its objects are moved to the end
+        if(offset + count != tree->objects_indexes_count) {
+            reserve_kd_tree(tree, tree->nodes_count, tree->objects_indexes_count + count + 1);
+            memcpy(tree->objects_indexes + tree->objects_indexes_count,
+                   tree->objects_indexes + offset,
+                   count * sizeof(int));
+            
+            offset = tree->objects_indexes_count;
+            tree->objects_indexes_count += count;
+            tree->garbage_count += count;
+        } else {
+            reserve_kd_tree(tree, tree->nodes_count, tree->objects_indexes_count + 1);
+        }
+        
+        tree->objects_indexes[offset + count] = index;
+        tree->objects_indexes_count++;
+        
+        tree->nodes[position].data.objects_offset = offset;
+        tree->nodes[position].flags = ((count + 1) << NODE_PLANE_BITS) | NONE;
+        
+        tree->cost += voxel_area(v);
+        
+        // Object, which fills the whole voxel, gets into both sides of any split,
+        // so it only makes splitting less profitable
+        if((box.x_min > v.x_min) || (box.y_min > v.y_min) || (box.z_min > v.z_min)
+           || (box.x_max < v.x_max) || (box.y_max < v.y_max) || (box.z_max < v.z_max)) {
+            
+            rebuild_leaf(tree, position, v, depth);
+        }
+        group_node_leaves(tree, position);
+        return;
+    }
+    
+    Coord c;
+    c.x = node.data.split;
+    
+    Voxel vl;
+    Voxel vr;
+    split_voxel(v, plane, c, &vl, &vr);
+    
+    const int children = node.flags >> NODE_PLANE_BITS;
+    
+    Float min;
+    Float max;
+    switch(plane) {
         case XY:
-            if(((node->coord.z > v.z_min) && (node->coord.z > vector_start.z))
-               || ((node->coord.z < v.z_min) && (node->coord.z < vector_start.z))) {
-                   
-                front_node = node->l;
-                back_node = node->r;
-                split_voxel(v, node->plane, node->coord, &front_voxel, &back_voxel);
-            } else {
-                front_node = node->r;
-                back_node = node->l;
-                split_voxel(v, node->plane, node->coord, &back_voxel, &front_voxel);
-            }
+            min = box.z_min;
+            max = box.z_max;
             break;
-                
         case XZ:
-            if(((node->coord.y > v.y_min) && (node->coord.y > vector_start.y))
-               || ((node->coord.y < v.y_min) && (node->coord.y < vector_start.y))) {
-                   
-                front_node = node->l;
-                back_node = node->r;
-                split_voxel(v, node->plane, node->coord, &front_voxel, &back_voxel);
-            } else {
-                front_node = node->r;
-                back_node = node->l;
-                split_voxel(v, node->plane, node->coord, &back_voxel, &front_voxel);
-            }
+            min = box.y_min;
+            max = box.y_max;
             break;
-            
-        case YZ:
-            if(((node->coord.x > v.x_min) && (node->coord.x > vector_start.x))
-               || ((node->coord.x < v.x_min) && (node->coord.x < vector_start.x))) {
-                   
-                front_node = node->l;
-                back_node = node->r;
-                split_voxel(v, node->plane, node->coord, &front_voxel, &back_voxel);
-            } else {
-                front_node = node->r;
-                back_node = node->l;
-                split_voxel(v, node->plane, node->coord, &back_voxel, &front_voxel);
-            }
+        default:
+            min = box.x_min;
+            max = box.x_max;
             break;
-            
-        case NONE:
-            // Unreachable case
-            printf("[find_intersection_node] Plane is NONE. Error");
-            exit(1);
+    }
+    
+    // Object, which is crossed by the plane, is clipped by subvoxels
+    Voxel sub_box;
+    if(min <= c.x) {
+        sub_box = box;
+        if((max <= c.x) || clip_object_box(tree->objects[index], vl, &sub_box))
+            insert_node_object(tree, children, vl, sub_box, index, depth + 1);
+    }
+    if(max >= c.x) {
+        sub_box = box;
+        if((min >= c.x) || clip_object_box(tree->objects[index], vr, &sub_box))
+            insert_node_object(tree, children + 1, vr, sub_box, index, depth + 1);
+    }
+}
+
+/*
+ * Replaces index of object in all leaves, which overlap with its box.
+ * Object is removed when new_index is negative
+ */
+static void
+replace_node_object(KDTree * const tree,
+                    const int position,
+                    const Voxel v,
+                    const Voxel box,
+                    const int index,
+                    const int new_index) {
+    
+    const KDNode * node = &tree->nodes[position];
+    const enum Plane plane = node->flags & NODE_PLANE_MASK;
+    
+    if(plane == NONE) {
+        const int count = node->flags >> NODE_PLANE_BITS;
+        int * objects_indexes = tree->objects_indexes + node->data.objects_offset;
+        
+        int i;
+        for(i = 0; (i < count) && (objects_indexes[i] != index); i++);
+        if(i == count)
+            return;
+        
+        if(new_index >= 0) {
+            objects_indexes[i] = new_index;
+        } else {
+            // Order of objects is kept
+            memmove(objects_indexes + i, objects_indexes + i + 1, (count - i - 1) * sizeof(int));
+            tree->nodes[position].flags = ((count - 1) << NODE_PLANE_BITS) | NONE;
+            tree->garbage_count++;
+            tree->cost -= voxel_area(v);
+        }
+        group_node_leaves(tree, position);
+        return;
+    }
+    
+    Coord c;
+    c.x = node->data.split;
+    
+    Voxel vl;
+    Voxel vr;
+    split_voxel(v, plane, c, &vl, &vr);
+    
+    const int children = node->flags >> NODE_PLANE_BITS;
+    
+    Float min;
+    Float max;
+    switch(plane) {
+        case XY:
+            min = box.z_min;
+            max = box.z_max;
+            break;
+        case XZ:
+            min = box.y_min;
+            max = box.y_max;
             break;
+        default:
+            min = box.x_min;
+            max = box.x_max;
+            break;
+    }
+    
+    if(min <= c.x)
+        replace_node_object(tree, children, vl, box, index, new_index);
+    if(max >= c.x)
+        replace_node_object(tree, children + 1, vr, box, index, new_index);
+}
+
+/*
+ * Replaces leaf by the subtree, if SAH finds split plane for its objects
+ */
+static void
+rebuild_leaf(KDTree * const tree,
+             const int position,
+             const Voxel v,
+             const int depth) {
+    
+    const KDNode leaf = tree->nodes[position];
+    const int count = leaf.flags >> NODE_PLANE_BITS;
+    
+    // SAH of any split is bigger than the cost of splitting
+    if(count <= split_cost(&tree->params))
+        return;
+    
+    BoundingBoxes * boxes = alloc_bounding_boxes(count);
+    int i;
+    for(i = 0; i < count; i++) {
+        const int index = tree->objects_indexes[leaf.data.objects_offset + i];
+        const Voxel box = tree_primitive_box(tree, index);
+        
+        boxes->x_min[i] = box.x_min;
+        boxes->y_min[i] = box.y_min;
+        boxes->z_min[i] = box.z_min;
+        
+        boxes->x_max[i] = box.x_max;
+        boxes->y_max[i] = box.y_max;
+        boxes->z_max[i] = box.z_max;
+        
+        boxes->index[i] = index;
+    }
+    
+    // Quick estimation by not clipped boxes: clipping of all objects
+    // is much more expensive than insertion itself.
+    // Missed splits increase cost of the tree, which leads to the full rebuild
+    enum Plane p;
+    Coord c;
+    Bins bins;
+    fill_bins(boxes, 0, boxes->count, v, &bins);
+    find_plane(&bins, boxes->count, v, depth, &tree->params, &p, &c);
+    
+    if(p == NONE) {
+        release_bounding_boxes(boxes);
+        return;
+    }
+    
+    clip_bounding_boxes(tree, boxes, v);
+    BuildNode * root = rec_build(tree, boxes, v, depth, &tree->params);
+    release_bounding_boxes(boxes);
+    
+    int nodes_count = 0;
+    int indexes_count = 0;
+    count_build_nodes(root, &nodes_count, &indexes_count);
+    
+    // Root of subtree takes place of the leaf
+    reserve_kd_tree(tree, tree->nodes_count + nodes_count - 1, tree->objects_indexes_count + indexes_count);
+    
+    int next_node = tree->nodes_count;
+    int next_index = tree->objects_indexes_count;
+    flatten_build_node(tree, root, position, &next_node, &next_index);
+    release_build_node(root);
+    
+    tree->nodes_count = next_node;
+    tree->objects_indexes_count = next_index;
+    tree->garbage_count += count;
+    
+    tree->cost += node_cost(tree, position, v) - voxel_area(v) * count;
+}
+
+/*
+ * Removes ranges of objects indexes, which are not used by leaves anymore
+ */
+static void
+compact_objects_indexes(KDTree * const tree) {
+    reserve_kd_tree(tree, tree->nodes_count, tree->objects_indexes_count);
+    
+    int * objects_indexes = malloc(tree->objects_indexes_capacity * sizeof(int));
+    int count = 0;
+    
+    int i;
+    for(i = 0; i < tree->nodes_count; i++) {
+        KDNode * node = &tree->nodes[i];
+        if((node->flags & NODE_PLANE_MASK) == NONE) {
+            const int leaf_count = node->flags >> NODE_PLANE_BITS;
+            memcpy(objects_indexes + count,
+                   tree->objects_indexes + node->data.objects_offset,
+                   leaf_count * sizeof(int));
+            node->data.objects_offset = count;
+            count += leaf_count;
+        }
+    }
+    
+    free(tree->objects_indexes);
+    tree->objects_indexes = objects_indexes;
+    tree->objects_indexes_count = count;
+    tree->garbage_count = 0;
+    
+    group_tree_leaves(tree);
+}
+
+/*
+ * Groups of all leaves are made from scratch
+ */
+static void
+group_tree_leaves(KDTree * const tree) {
+    free(tree->triangle_groups);
+    free(tree->leaf_groups);
+    
+    tree->triangle_groups = NULL;
+    tree->triangle_groups_count = 0;
+    tree->triangle_groups_capacity = 0;
+    tree->triangle_groups_garbage = 0;
+    tree->leaf_groups = calloc((tree->nodes_capacity > 1) ? tree->nodes_capacity : 1, sizeof(KDLeafGroups));
+    
+    int i;
+    for(i = 0; i < tree->nodes_count; i++) {
+        if((tree->nodes[i].flags & NODE_PLANE_MASK) == NONE)
+            group_leaf(tree, i);
+    }
+}
+
+/*
+ * Leaves of the subtree, which was changed by update of tree, are grouped again
+ */
+static void
+group_node_leaves(KDTree * const tree,
+                  const int position) {
+    
+    const KDNode node = tree->nodes[position];
+    
+    if((node.flags & NODE_PLANE_MASK) == NONE) {
+        group_leaf(tree, position);
+        
+        // Regrouping of all leaves is cheaper, than growing of garbage
+        if(tree->triangle_groups_garbage > tree->triangle_groups_count / 2)
+            group_tree_leaves(tree);
+        return;
+    }
+    
+    const int children = node.flags >> NODE_PLANE_BITS;
+    group_node_leaves(tree, children);
+    group_node_leaves(tree, children + 1);
+}
+
+/*
+ * Moves triangles to the beginning of leaf (keeping the order of objects)
+ * and appends their groups to the array of groups
+ */
+static void
+group_leaf(KDTree * const tree,
+           const int position) {
+    
+    const KDNode leaf = tree->nodes[position];
+    const int count = leaf.flags >> NODE_PLANE_BITS;
+    int * objects_indexes = tree->objects_indexes + leaf.data.objects_offset;
+    KDLeafGroups * leaf_groups = &tree->leaf_groups[position];
+    
+    Point3d p[3];
+    int triangles_count = 0;
+    int i;
+    
+    // Leaf was grouped before - its groups become garbage
+    tree->triangle_groups_garbage += (leaf_groups->triangles_count + TRIANGLE_GROUP_SIZE - 1) / TRIANGLE_GROUP_SIZE;
+    leaf_groups->triangles_count = 0;
+    
+    for(i = 0; i < count; i++) {
+        if(get_tree_triangle(tree, objects_indexes[i], p))
+            triangles_count++;
+    }
+    
+    if(triangles_count < MIN_GROUPED_TRIANGLES)
+        return;
+    
+    if(triangles_count < count) {
+        int * others = malloc((count - triangles_count) * sizeof(int));
+        int t = 0;
+        int o = 0;
+        
+        for(i = 0; i < count; i++) {
+            if(get_tree_triangle(tree, objects_indexes[i], p))
+                objects_indexes[t++] = objects_indexes[i];
+            else
+                others[o++] = objects_indexes[i];
+        }
+        memcpy(objects_indexes + t, others, o * sizeof(int));
+        free(others);
+    }
+    
+    const int groups_count = (triangles_count + TRIANGLE_GROUP_SIZE - 1) / TRIANGLE_GROUP_SIZE;
+    
+    if(tree->triangle_groups_count + groups_count > tree->triangle_groups_capacity) {
+        tree->triangle_groups_capacity = 2 * (tree->triangle_groups_count + groups_count);
+        tree->triangle_groups = realloc(tree->triangle_groups,
+                                        tree->triangle_groups_capacity * sizeof(KDTriangleGroup));
+    }
+    
+    KDTriangleGroup * groups = tree->triangle_groups + tree->triangle_groups_count;
+    memset(groups, 0, groups_count * sizeof(KDTriangleGroup));
+    
+    for(i = 0; i < triangles_count; i++) {
+        KDTriangleGroup * group = &groups[i / TRIANGLE_GROUP_SIZE];
+        const int lane = i % TRIANGLE_GROUP_SIZE;
+        
+        get_tree_triangle(tree, objects_indexes[i], p);
+        
+        group->p1[0][lane] = p[0].x;
+        group->p1[1][lane] = p[0].y;
+        group->p1[2][lane] = p[0].z;
+        
+        group->p2[0][lane] = p[1].x;
+        group->p2[1][lane] = p[1].y;
+        group->p2[2][lane] = p[1].z;
+        
+        group->p3[0][lane] = p[2].x;
+        group->p3[1][lane] = p[2].y;
+        group->p3[2][lane] = p[2].z;
+    }
+    
+    leaf_groups->first_group = tree->triangle_groups_count;
+    leaf_groups->triangles_count = triangles_count;
+    tree->triangle_groups_count += groups_count;
+}
+
+/*
+ * Vertexes of triangle of mesh or of triangle object.
+ * Returns False for other objects
+ */
+static inline Boolean
+get_tree_triangle(const KDTree * const tree,
+                  const int index,
+                  Point3d * const p) {
+    
+    if(tree->mesh) {
+        const int * v = tree->mesh->triangles[index].vertexes;
+        p[0] = tree->mesh->vertexes[v[0]];
+        p[1] = tree->mesh->vertexes[v[1]];
+        p[2] = tree->mesh->vertexes[v[2]];
+        return True;
     }
     
-    if(voxel_intersection(vector, vector_start, front_voxel)
-       && find_intersection_node(front_node,
-                                 front_voxel,
-                                 vector_start,
-                                 vector,
-                                 nearest_obj_ptr,
-                                 nearest_intersection_point_ptr,
-                                 nearest_intersection_point_dist_ptr))
+    const KDPrimitive * primitive = tree_primitive(tree, index);
+    
+    if(primitive->type == MESH_OBJECT) {
+        const TriangleMesh * mesh = primitive->geometry.mesh_triangle.mesh;
+        const int * v = mesh->triangles[primitive->geometry.mesh_triangle.index].vertexes;
+        p[0] = mesh->vertexes[v[0]];
+        p[1] = mesh->vertexes[v[1]];
+        p[2] = mesh->vertexes[v[2]];
         return True;
-            
-    return (voxel_intersection(vector, vector_start, back_voxel)
-            && find_intersection_node(back_node,
-                                      back_voxel,
-                                      vector_start,
-                                      vector,
-                                      nearest_obj_ptr,
-                                      nearest_intersection_point_ptr,
-                                      nearest_intersection_point_dist_ptr));
-}
\ No newline at end of file
+    }
+    
+    if(primitive->type != TRIANGLE_OBJECT)
+        return False;
+    
+    p[0] = primitive->geometry.triangle.p1;
+    p[1] = primitive->geometry.triangle.p2;
+    p[2] = primitive->geometry.triangle.p3;
+    return True;
+}
+
+static void
+release_build_node(BuildNode * node) {
+    if(node->l)
+        release_build_node(node->l);
+    if(node->r)
+        release_build_node(node->r);
+    if(node->indexes)
+        free(node->indexes);
+    free(node);
+}
+
+BoundingBoxes *
+new_bounding_boxes(Object3d ** objects,
+                   int objects_count) {
+    
+    BoundingBoxes * boxes = alloc_bounding_boxes(objects_count);
+    
+    int i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < objects_count; i++) {
+        const Point3d min_p = objects[i]->get_min_boundary_point(objects[i]->data);
+        const Point3d max_p = objects[i]->get_max_boundary_point(objects[i]->data);
+        
+        boxes->x_min[i] = min_p.x;
+        boxes->y_min[i] = min_p.y;
+        boxes->z_min[i] = min_p.z;
+        
+        boxes->x_max[i] = max_p.x;
+        boxes->y_max[i] = max_p.y;
+        boxes->z_max[i] = max_p.z;
+        
+        boxes->index[i] = i;
+    }
+    
+    return boxes;
+}
+
+static BoundingBoxes *
+new_mesh_bounding_boxes(const TriangleMesh * const mesh) {
+    
+    BoundingBoxes * boxes = alloc_bounding_boxes(mesh->triangles_count);
+    
+    int i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < mesh->triangles_count; i++) {
+        const Voxel box = get_mesh_triangle_box(mesh, i);
+        
+        boxes->x_min[i] = box.x_min;
+        boxes->y_min[i] = box.y_min;
+        boxes->z_min[i] = box.z_min;
+        
+        boxes->x_max[i] = box.x_max;
+        boxes->y_max[i] = box.y_max;
+        boxes->z_max[i] = box.z_max;
+        
+        boxes->index[i] = i;
+    }
+    
+    return boxes;
+}
+
+void
+release_bounding_boxes(BoundingBoxes * boxes) {
+    free(boxes);
+}
+
+static BoundingBoxes *
+alloc_bounding_boxes(const int count) {
+    
+    // All arrays are placed in the single block of memory, right after the header
+    BoundingBoxes * boxes = malloc(sizeof(BoundingBoxes)
+                                   + count * (6 * sizeof(Float) + sizeof(int)));
+    
+    Float * coords = (Float *) (boxes + 1);
+    
+    boxes->x_min = coords;
+    boxes->y_min = coords + count;
+    boxes->z_min = coords + 2 * count;
+    
+    boxes->x_max = coords + 3 * count;
+    boxes->y_max = coords + 4 * count;
+    boxes->z_max = coords + 5 * count;
+    
+    boxes->index = (int *) (coords + 6 * count);
+    boxes->count = count;
+    
+    return boxes;
+}
+
+/*
+ * Returns table of bounding boxes of given objects.
+ * Expects that i-th box of source table belongs to i-th object
+ */
+static BoundingBoxes *
+gather_bounding_boxes(const BoundingBoxes * const boxes,
+                      const int * indices,
+                      const int indices_count) {
+    
+    BoundingBoxes * result = alloc_bounding_boxes(indices_count);
+    
+    int i;
+    for(i = 0; i < indices_count; i++) {
+        copy_bounding_box(boxes, indices[i], result, i);
+    }
+    
+    return result;
+}
+
+static inline void
+copy_bounding_box(const BoundingBoxes * const src,
+                  const int src_i,
+                  BoundingBoxes * const dst,
+                  const int dst_i) {
+    
+    dst->x_min[dst_i] = src->x_min[src_i];
+    dst->y_min[dst_i] = src->y_min[src_i];
+    dst->z_min[dst_i] = src->z_min[src_i];
+    
+    dst->x_max[dst_i] = src->x_max[src_i];
+    dst->y_max[dst_i] = src->y_max[src_i];
+    dst->z_max[dst_i] = src->z_max[src_i];
+    
+    dst->index[dst_i] = src->index[src_i];
+}
+
+KDTree *
+build_kd_tree(Object3d ** objects,
+              const BoundingBoxes * boxes,
+              const KDTreeParams * const params) {
+    
+    return build_tree(objects, NULL, boxes, params);
+}
+
+KDTree *
+build_mesh_kd_tree(const TriangleMesh * const mesh,
+                   const KDTreeParams * const params) {
+    
+    BoundingBoxes * boxes = new_mesh_bounding_boxes(mesh);
+    KDTree * tree = build_tree(NULL, mesh, boxes, params);
+    release_bounding_boxes(boxes);
+    return tree;
+}
+
+static KDTree *
+build_tree(Object3d ** objects,
+           const TriangleMesh * const mesh,
+           const BoundingBoxes * boxes,
+           const KDTreeParams * const params) {
+    
+    KDTree * tree = malloc(sizeof(KDTree));
+    tree->params = *params;
+    tree->objects = objects;
+    tree->objects_count = boxes->count;
+    tree->primitives = (objects) ? new_kd_primitives(objects, boxes->count) : NULL;
+    tree->primitives_capacity = (objects) ? boxes->count + 1 : 0;
+    tree->mesh_primitives = NULL;
+    tree->mesh_primitives_count = 0;
+    tree->mesh = mesh;
+    tree->mapping = NULL;
+    tree->mapping_size = 0;
+    tree->garbage_count = 0;
+    
+    // Boxes of mesh objects are replaced by boxes of their triangles
+    BoundingBoxes * primitives_boxes = NULL;
+    if(objects) {
+        tree->mesh_primitives = new_mesh_primitives(objects, boxes->count, &tree->mesh_primitives_count);
+        if(tree->mesh_primitives) {
+            primitives_boxes = new_primitives_bounding_boxes(tree, boxes);
+            boxes = primitives_boxes;
+        }
+    }
+    
+    tree->bounding_box = make_initial_voxel(boxes);
+    
+    BuildNode * root;
+    
+    // Builder addresses boxes by positions in the table
+    int * indices = malloc(boxes->count * sizeof(int));
+    int i;
+    for(i = 0; i < boxes->count; i++)
+        indices[i] = i;
+    
+    // Upper levels of tree are built sequentially (but each node - by all threads),
+    // until subtrees become small enough to be built independently
+    BuildTasks tasks = {.tasks = NULL, .count = 0, .capacity = 0};
+    rec_build_parallel(tree, boxes, indices, boxes->count, tree->bounding_box, 0,
+                       params, &root, &tasks);
+    
+    // Biggest subtrees go first - for better balancing between threads.
+    // Result doesn't depend on the order of building of subtrees
+    qsort(tasks.tasks, tasks.count, sizeof(BuildTask), compare_build_tasks);
+    
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(i = 0; i < tasks.count; i++) {
+        BuildTask * task = &tasks.tasks[i];
+        BoundingBoxes * task_boxes = gather_bounding_boxes(boxes, task->indices, task->indices_count);
+        free(task->indices);
+        
+        // Upper levels are working with bounding boxes of whole objects,
+        // so objects of subtree have to be clipped by its voxel
+        clip_bounding_boxes(tree, task_boxes, task->v);
+        
+        *task->node = rec_build(tree, task_boxes, task->v, task->iter, params);
+        release_bounding_boxes(task_boxes);
+    }
+    
+    free(tasks.tasks);
+    
+    if(primitives_boxes)
+        release_bounding_boxes(primitives_boxes);
+    
+    // Nodes are placed into the single array
+    tree->nodes_count = 0;
+    tree->objects_indexes_count = 0;
+    count_build_nodes(root, &tree->nodes_count, &tree->objects_indexes_count);
+    
+    tree->nodes = malloc(tree->nodes_count * sizeof(KDNode));
+    tree->objects_indexes = malloc((tree->objects_indexes_count + 1) * sizeof(int));
+    
+    int next_node = 1;
+    int next_index = 0;
+    flatten_build_node(tree, root, 0, &next_node, &next_index);
+    
+    release_build_node(root);
+    
+    tree->nodes_capacity = tree->nodes_count;
+    tree->objects_indexes_capacity = tree->objects_indexes_count + 1;
+    tree->triangle_groups = NULL;
+    tree->leaf_groups = NULL;
+    group_tree_leaves(tree);
+    
+    tree->built_cost = node_cost(tree, 0, tree->bounding_box);
+    tree->cost = tree->built_cost;
+    return tree;
+}
+
+static void
+count_build_nodes(const BuildNode * const node,
+                  int * const nodes_count,
+                  int * const indexes_count) {
+    
+    ++*nodes_count;
+    
+    if(node->plane == NONE) {
+        *indexes_count += node->indexes_count;
+        return;
+    }
+    
+    count_build_nodes(node->l, nodes_count, indexes_count);
+    count_build_nodes(node->r, nodes_count, indexes_count);
+}
+
+/*
+ * Writes node to the given position of array.
+ * Children of inner node take next two free positions,
+ * so they are always placed side by side
+ */
+static void
+flatten_build_node(KDTree * const tree,
+                   const BuildNode * const node,
+                   const int position,
+                   int * const next_node,
+                   int * const next_index) {
+    
+    KDNode * flat = &tree->nodes[position];
+    
+    if(node->plane == NONE) {
+        flat->data.objects_offset = *next_index;
+        flat->flags = (node->indexes_count << NODE_PLANE_BITS) | NONE;
+        
+        memcpy(tree->objects_indexes + *next_index, node->indexes, node->indexes_count * sizeof(int));
+        *next_index += node->indexes_count;
+        return;
+    }
+    
+    const int children = *next_node;
+    *next_node += 2;
+    
+    // All fields of Coord share the same value
+    flat->data.split = (float) node->coord.x;
+    flat->flags = (children << NODE_PLANE_BITS) | node->plane;
+    
+    flatten_build_node(tree, node->l, children, next_node, next_index);
+    flatten_build_node(tree, node->r, children + 1, next_node, next_index);
+}
+
+/*
+ * Builds node, which contains huge number of objects,
+ * using all threads for binning and filtering of objects.
+ * Subtrees with less than PARALLEL_BUILD_THRESHOLD objects
+ * are postponed to the list of tasks.
+ *
+ * Upper nodes refer to the objects by indexes in the table of bounding boxes,
+ * so there are no copies of the entire table.
+ * Takes ownership of indices array.
+ */
+static void
+rec_build_parallel(const KDTree * const tree,
+                   const BoundingBoxes * const boxes,
+                   int * indices,
+                   int indices_count,
+                   Voxel v,
+                   int iter,
+                   const KDTreeParams * const params,
+                   BuildNode ** const node_ptr,
+                   BuildTasks * const tasks) {
+    
+    if(indices_count < PARALLEL_BUILD_THRESHOLD) {
+        add_build_task(tasks, node_ptr, indices, indices_count, v, iter);
+        return;
+    }
+    
+    enum Plane p;
+    Coord c;
+    Bins bins;
+    fill_bins_parallel(boxes, indices, indices_count, v, &bins);
+    find_plane(&bins, indices_count, v, iter, params, &p, &c);
+    
+    if(p == NONE) {
+        BoundingBoxes * leaf_boxes = gather_bounding_boxes(boxes, indices, indices_count);
+        *node_ptr = make_leaf(tree, leaf_boxes);
+        release_bounding_boxes(leaf_boxes);
+        free(indices);
+        return;
+    }
+    
+    Voxel vl;
+    Voxel vr;
+    split_voxel(v, p, c, &vl, &vr);
+    
+    int l_indices_count;
+    int r_indices_count;
+    int * l_indices = filter_split_objects_parallel(boxes, indices, indices_count, p, c, True, &l_indices_count);
+    int * r_indices = filter_split_objects_parallel(boxes, indices, indices_count, p, c, False, &r_indices_count);
+    free(indices);
+    
+    BuildNode * node = malloc(sizeof(BuildNode));
+    node->indexes = NULL;
+    node->indexes_count = 0;
+    node->plane = p;
+    node->coord = c;
+    *node_ptr = node;
+    
+    rec_build_parallel(tree, boxes, l_indices, l_indices_count, vl, iter + 1, params, &node->l, tasks);
+    rec_build_parallel(tree, boxes, r_indices, r_indices_count, vr, iter + 1, params, &node->r, tasks);
+}
+
+static void
+add_build_task(BuildTasks * const tasks,
+               BuildNode ** const node_ptr,
+               int * indices,
+               int indices_count,
+               Voxel v,
+               int iter) {
+    
+    if(tasks->count == tasks->capacity) {
+        tasks->capacity = (tasks->capacity) ? tasks->capacity * 2 : 64;
+        tasks->tasks = realloc(tasks->tasks, tasks->capacity * sizeof(BuildTask));
+    }
+    
+    BuildTask * task = &tasks->tasks[tasks->count++];
+    task->node = node_ptr;
+    task->indices = indices;
+    task->indices_count = indices_count;
+    task->v = v;
+    task->iter = iter;
+}
+
+static int
+compare_build_tasks(const void * a,
+                    const void * b) {
+    
+    const BuildTask * ta = a;
+    const BuildTask * tb = b;
+    return tb->indices_count - ta->indices_count;
+}
+
+inline BuildNode *
+rec_build(const KDTree * const tree,
+          const BoundingBoxes * const boxes,
+          Voxel v,
+          int iter,
+          const KDTreeParams * const params) {
+    
+    enum Plane p;
+    Coord c;
+    Bins bins;
+    fill_bins(boxes, 0, boxes->count, v, &bins);
+    find_plane(&bins, boxes->count, v, iter, params, &p, &c);
+    
+    if(p == NONE) {
+        return make_leaf(tree, boxes);
+    }
+    
+    Voxel vl;
+    Voxel vr;
+    split_voxel(v, p, c, &vl, &vr);
+    
+    BoundingBoxes * sub_boxes = alloc_bounding_boxes(boxes->count);
+    
+    sub_boxes->count = filter_split_objects(tree, boxes, p, c, True, vl, sub_boxes);
+    BuildNode * l = rec_build(tree, sub_boxes, vl, iter + 1, params);
+    
+    sub_boxes->count = filter_split_objects(tree, boxes, p, c, False, vr, sub_boxes);
+    BuildNode * r = rec_build(tree, sub_boxes, vr, iter + 1, params);
+    
+    release_bounding_boxes(sub_boxes);
+    
+    BuildNode * node = malloc(sizeof(BuildNode));
+    node->indexes = NULL;
+    node->indexes_count = 0;
+    node->plane = p;
+    node->coord = c;
+    node->l = l;
+    node->r = r;
+    
+    return node;
+}
+
+/*
+ * Copies bounding boxes of objects, which overlap with the left (or right) subvoxel,
+ * to the result. Returns number of copied boxes.
+ *
+ * All objects of the node overlap with its voxel, so only the coordinate,
+ * which is orthogonal to the splitting plane, has to be checked.
+ * Objects, which are crossed by the splitting plane, are clipped by subvoxel
+ * ("perfect splits") - so they don't get into subvoxels, which they don't touch
+ */
+inline int
+filter_split_objects(const KDTree * const tree,
+                     const BoundingBoxes * const boxes,
+                     const enum Plane p,
+                     const Coord c,
+                     const Boolean left,
+                     const Voxel sub_v,
+                     BoundingBoxes * const result) {
+    
+    Float coord;
+    const Float * bounds = split_bounds(boxes, p, c, left, &coord);
+    const Float * opposite_bounds = split_bounds(boxes, p, c, !left, &coord);
+    
+    unsigned char flags[SIMD_BLOCK];
+    int count = 0;
+    int n;
+    int i;
+    int j;
+    
+    // Keeping order of objects - so tree doesn't depend on anything
+    // except of the input array
+    for(i = 0; i < boxes->count; i += SIMD_BLOCK) {
+        n = (boxes->count - i < SIMD_BLOCK) ? boxes->count - i : SIMD_BLOCK;
+        
+        split_flags(bounds + i, n, coord, left, flags);
+        
+        for(j = 0; j < n; j++) {
+            if(flags[j]) {
+                copy_bounding_box(boxes, i + j, result, count);
+                
+                if(((left) ? opposite_bounds[i + j] > coord : opposite_bounds[i + j] < coord)
+                   && !clip_bounding_box(tree, result, count, sub_v)) {
+                    continue;
+                }
+                count++;
+            }
+        }
+    }
+    
+    return count;
+}
+
+/*
+ * Replaces i-th bounding box by the bounding box of the part of object,
+ * which is inside of voxel. Returns False if object doesn't intersect with voxel
+ */
+static inline Boolean
+clip_bounding_box(const KDTree * const tree,
+                  BoundingBoxes * const boxes,
+                  const int i,
+                  const Voxel v) {
+    
+    Voxel clipped = v;
+    if(!clip_tree_object(tree, boxes->index[i], v, &clipped)) {
+        return False;
+    }
+    
+    boxes->x_min[i] = (boxes->x_min[i] > clipped.x_min) ? boxes->x_min[i] : clipped.x_min;
+    boxes->y_min[i] = (boxes->y_min[i] > clipped.y_min) ? boxes->y_min[i] : clipped.y_min;
+    boxes->z_min[i] = (boxes->z_min[i] > clipped.z_min) ? boxes->z_min[i] : clipped.z_min;
+    
+    boxes->x_max[i] = (boxes->x_max[i] < clipped.x_max) ? boxes->x_max[i] : clipped.x_max;
+    boxes->y_max[i] = (boxes->y_max[i] < clipped.y_max) ? boxes->y_max[i] : clipped.y_max;
+    boxes->z_max[i] = (boxes->z_max[i] < clipped.z_max) ? boxes->z_max[i] : clipped.z_max;
+    
+    return (boxes->x_min[i] <= boxes->x_max[i])
+           && (boxes->y_min[i] <= boxes->y_max[i])
+           && (boxes->z_min[i] <= boxes->z_max[i]);
+}
+
+/*
+ * Clips all objects, which are not entirely inside of voxel.
+ * Objects, which don't intersect with voxel, are removed from the table
+ */
+static void
+clip_bounding_boxes(const KDTree * const tree,
+                    BoundingBoxes * const boxes,
+                    const Voxel v) {
+    
+    int count = 0;
+    int i;
+    for(i = 0; i < boxes->count; i++) {
+        copy_bounding_box(boxes, i, boxes, count);
+        
+        if((boxes->x_min[count] < v.x_min) || (boxes->y_min[count] < v.y_min) || (boxes->z_min[count] < v.z_min)
+           || (boxes->x_max[count] > v.x_max) || (boxes->y_max[count] > v.y_max) || (boxes->z_max[count] > v.z_max)) {
+            
+            if(!clip_bounding_box(tree, boxes, count, v)) {
+                continue;
+            }
+        }
+        count++;
+    }
+    boxes->count = count;
+}
+
+/*
+ * Same as filter_split_objects, but objects are given by indexes in the table
+ * and result is the new array of indexes.
+ *
+ * Array is divided into chunks of FILTER_CHUNK objects,
+ * which are processed by different threads.
+ * Chunks don't depend on number of threads,
+ * so the order of filtered objects is the same as in sequential version.
+ */
+static int *
+filter_split_objects_parallel(const BoundingBoxes * const boxes,
+                              const int * indices,
+                              const int indices_count,
+                              const enum Plane p,
+                              const Coord c,
+                              const Boolean left,
+                              int * const result_count) {
+    
+    Float coord;
+    const Float * bounds = split_bounds(boxes, p, c, left, &coord);
+    
+    const int chunks = (indices_count + FILTER_CHUNK - 1) / FILTER_CHUNK;
+    int * offsets = malloc((chunks + 1) * sizeof(int));
+    int i;
+    
+    offsets[0] = 0;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < chunks; i++) {
+        const int from = i * FILTER_CHUNK;
+        const int to = (from + FILTER_CHUNK < indices_count) ? from + FILTER_CHUNK : indices_count;
+        offsets[i + 1] = filter_split_indices(bounds, indices + from, to - from, coord, left, NULL);
+    }
+    
+    for(i = 0; i < chunks; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    
+    int * result = malloc(offsets[chunks] * sizeof(int));
+    
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < chunks; i++) {
+        const int from = i * FILTER_CHUNK;
+        const int to = (from + FILTER_CHUNK < indices_count) ? from + FILTER_CHUNK : indices_count;
+        filter_split_indices(bounds, indices + from, to - from, coord, left, result + offsets[i]);
+    }
+    
+    *result_count = offsets[chunks];
+    free(offsets);
+    return result;
+}
+
+/*
+ * Writes indexes of objects, which overlap with subvoxel, to the result
+ * (if it is not NULL). Returns number of such objects
+ */
+static inline int
+filter_split_indices(const Float * bounds,
+                     const int * indices,
+                     const int indices_count,
+                     const Float coord,
+                     const Boolean left,
+                     int * const result) {
+    
+    Float gathered[SIMD_BLOCK];
+    unsigned char flags[SIMD_BLOCK];
+    int count = 0;
+    int n;
+    int i;
+    int j;
+    
+    for(i = 0; i < indices_count; i += SIMD_BLOCK) {
+        n = (indices_count - i < SIMD_BLOCK) ? indices_count - i : SIMD_BLOCK;
+        
+        for(j = 0; j < n; j++) {
+            gathered[j] = bounds[indices[i + j]];
+        }
+        split_flags(gathered, n, coord, left, flags);
+        
+        if(result) {
+            for(j = 0; j < n; j++) {
+                if(flags[j]) {
+                    result[count++] = indices[i + j];
+                }
+            }
+        } else {
+            for(j = 0; j < n; j++) {
+                count += flags[j];
+            }
+        }
+    }
+    
+    return count;
+}
+
+/*
+ * Returns minimal (for the left subvoxel) or maximal (for the right one)
+ * coordinates of objects along the axis, which is orthogonal to the splitting plane
+ */
+static inline const Float *
+split_bounds(const BoundingBoxes * const boxes,
+             const enum Plane p,
+             const Coord c,
+             const Boolean left,
+             Float * const coord) {
+    
+    switch(p) {
+        case XY:
+            *coord = c.z;
+            return (left) ? boxes->z_min : boxes->z_max;
+            
+        case XZ:
+            *coord = c.y;
+            return (left) ? boxes->y_min : boxes->y_max;
+            
+        case YZ:
+            *coord = c.x;
+            return (left) ? boxes->x_min : boxes->x_max;
+            
+        case NONE:
+        default:
+            // Unreachable case
+            printf("[split_bounds] Plane is NONE. Error");
+            exit(1);
+    }
+}
+
+/*
+ * flags[i] is 1 if i-th object reaches the splitting plane and 0 otherwise.
+ * There are no branches inside of loops - so they are vectorized
+ */
+static inline void
+split_flags(const Float * bounds,
+            const int n,
+            const Float coord,
+            const Boolean left,
+            unsigned char * const flags) {
+    
+    int i;
+    if(left) {
+        #pragma omp simd
+        for(i = 0; i < n; i++) {
+            flags[i] = (bounds[i] <= coord);
+        }
+    } else {
+        #pragma omp simd
+        for(i = 0; i < n; i++) {
+            flags[i] = (bounds[i] >= coord);
+        }
+    }
+}
+
+/*
+ * Copies bounding boxes of n objects to the block,
+ * and makes view of the block (which can be processed as usual table)
+ */
+static inline void
+gather_block(const BoundingBoxes * const boxes,
+             const int * indices,
+             const int n,
+             BoxesBlock * const block,
+             BoundingBoxes * const view) {
+    
+    int i;
+    for(i = 0; i < n; i++) {
+        block->x_min[i] = boxes->x_min[indices[i]];
+        block->y_min[i] = boxes->y_min[indices[i]];
+        block->z_min[i] = boxes->z_min[indices[i]];
+        
+        block->x_max[i] = boxes->x_max[indices[i]];
+        block->y_max[i] = boxes->y_max[indices[i]];
+        block->z_max[i] = boxes->z_max[indices[i]];
+    }
+    
+    view->x_min = block->x_min;
+    view->y_min = block->y_min;
+    view->z_min = block->z_min;
+    
+    view->x_max = block->x_max;
+    view->y_max = block->y_max;
+    view->z_max = block->z_max;
+    
+    view->index = NULL;
+    view->count = n;
+}
+
+inline void
+split_voxel(const Voxel v,
+            const enum Plane p,
+            const Coord c,
+            Voxel * const vl,
+            Voxel * const vr) {
+    
+    *vl = v;
+    *vr = v;
+    
+    switch(p) {
+        case XY:
+            vl->z_max = c.z;
+            vr->z_min = c.z;
+            break;
+            
+        case XZ:
+            vl->y_max = c.y;
+            vr->y_min = c.y;
+            break;
+            
+        case YZ:
+            vl->x_max = c.x;
+            vr->x_min = c.x;
+            break;
+        case NONE:
+            // Unreachable case
+            printf("[split_voxel] Plane is NONE. Error");
+            exit(1);
+            break;
+    }
+}
+
+/*
+ * Using Surface Area Heuristic (SAH) for finding best split pane
+ *
+ * SAH = 0.5 * voxel_surface_area * number_of_objects_in_voxel
+ *
+ * splitted_SAH = split_cost
+ *                + 0.5 * left_voxel_surface_area * number_of_objects_in_left_voxel
+ *                + 0.5 * right_voxel_surface_area * number_of_objects_in_right_voxel
+ *
+ * Candidate split planes are the borders of KD_TREE_BINS buckets along each axis.
+ * During the single pass through the objects, for each axis we are counting
+ * how many objects begin and how many objects end in every bucket.
+ * After that, numbers of objects at the left and at the right side
+ * of every candidate plane are obtained by prefix sums over the buckets.
+ *
+ * Finding coordinate of split plane (XY, XZ or YZ) which minimizing SAH
+ *
+ * If can't find optimal split plane - returns NONE
+ *
+ * see: http://stackoverflow.com/a/4633332/653511
+ * see: "On fast Construction of SAH-based Bounding Volume Hierarchies", I. Wald, 2007
+ */
+inline void
+find_plane(const Bins * const bins,
+           const int objects_count,
+           const Voxel v,
+           const int tree_depth,
+           const KDTreeParams * const params,
+           enum Plane * const p,
+           Coord * const c) {
+    
+    if((tree_depth >= params->max_depth)
+       || (tree_depth >= KD_TREE_STACK_SIZE)
+       || (objects_count <= params->objects_in_leaf)) {
+        *p = NONE;
+        return;
+    }
+    
+    const Float hx = v.x_max - v.x_min;
+    const Float hy = v.y_max - v.y_min;
+    const Float hz = v.z_max - v.z_min;
+    
+    // Calculating square of each side of initial voxel
+    Float Sxy = hx * hy;
+    Float Sxz = hx * hz;
+    Float Syz = hy * hz;
+    
+    const Float Ssum = Sxy + Sxz + Syz;
+
+    // Let's normalize square of each side of initial voxel
+    // to satisfy the following relationship:
+    // Sxy + Sxz + Syz = 1
+    Sxy /= Ssum;
+    Sxz /= Ssum;
+    Syz /= Ssum;
+    
+    // Assume that at the beginning best SAH has initial voxel
+    // SAH = 0.5 * square * objects_count
+    // square of initial voxel is Sxy + Sxz + Syz = 1
+    Float bestSAH = objects_count;
+    // initial voxel doesn't have split pane
+    *p = NONE;
+    
+    const Float cost = split_cost(params);
+    
+    // Let's find split surface, which have the least SAH
+    
+    // trying to minimize SAH by splitting across XY plane
+    sweep_bins(bins->z_starts, bins->z_ends, objects_count, Sxy, Sxz + Syz,
+               XY, v.z_min, hz, cost, &bestSAH, p, c);
+    
+    // trying to minimize SAH by splitting across XZ plane
+    sweep_bins(bins->y_starts, bins->y_ends, objects_count, Sxz, Sxy + Syz,
+               XZ, v.y_min, hy, cost, &bestSAH, p, c);
+    
+    // trying to minimize SAH by splitting across YZ plane
+    sweep_bins(bins->x_starts, bins->x_ends, objects_count, Syz, Sxy + Sxz,
+               YZ, v.x_min, hx, cost, &bestSAH, p, c);
+}
+
+inline void
+fill_bins(const BoundingBoxes * const boxes,
+          const int from,
+          const int to,
+          const Voxel v,
+          Bins * const bins) {
+    
+    memset(bins, 0, sizeof(Bins));
+    update_bins(boxes, from, to, v, bins);
+}
+
+/*
+ * Adds objects from range [from, to) to the buckets
+ */
+inline void
+update_bins(const BoundingBoxes * const boxes,
+            const int from,
+            const int to,
+            const Voxel v,
+            Bins * const bins) {
+    
+    const Float kx = KD_TREE_BINS / (v.x_max - v.x_min);
+    const Float ky = KD_TREE_BINS / (v.y_max - v.y_min);
+    const Float kz = KD_TREE_BINS / (v.z_max - v.z_min);
+    
+    // Indexes of buckets are calculated by vectorized loop,
+    // and after that the counters are incremented
+    int x_min_bin[SIMD_BLOCK];
+    int x_max_bin[SIMD_BLOCK];
+    int y_min_bin[SIMD_BLOCK];
+    int y_max_bin[SIMD_BLOCK];
+    int z_min_bin[SIMD_BLOCK];
+    int z_max_bin[SIMD_BLOCK];
+    
+    int n;
+    int i;
+    int j;
+    for(i = from; i < to; i += SIMD_BLOCK) {
+        n = (to - i < SIMD_BLOCK) ? to - i : SIMD_BLOCK;
+        
+        const Float * x_min = boxes->x_min + i;
+        const Float * y_min = boxes->y_min + i;
+        const Float * z_min = boxes->z_min + i;
+        const Float * x_max = boxes->x_max + i;
+        const Float * y_max = boxes->y_max + i;
+        const Float * z_max = boxes->z_max + i;
+        
+        #pragma omp simd
+        for(j = 0; j < n; j++) {
+            x_min_bin[j] = bin_index(x_min[j], v.x_min, kx);
+            x_max_bin[j] = bin_index(x_max[j], v.x_min, kx);
+            y_min_bin[j] = bin_index(y_min[j], v.y_min, ky);
+            y_max_bin[j] = bin_index(y_max[j], v.y_min, ky);
+            z_min_bin[j] = bin_index(z_min[j], v.z_min, kz);
+            z_max_bin[j] = bin_index(z_max[j], v.z_min, kz);
+        }
+        
+        for(j = 0; j < n; j++) {
+            ++bins->x_starts[x_min_bin[j]];
+            ++bins->x_ends[x_max_bin[j]];
+            ++bins->y_starts[y_min_bin[j]];
+            ++bins->y_ends[y_max_bin[j]];
+            ++bins->z_starts[z_min_bin[j]];
+            ++bins->z_ends[z_max_bin[j]];
+        }
+    }
+}
+
+/*
+ * Each thread fills its own buckets, after that buckets are summed.
+ * Counters are integers, so result doesn't depend on number of threads.
+ */
+static void
+fill_bins_parallel(const BoundingBoxes * const boxes,
+                   const int * indices,
+                   const int indices_count,
+                   const Voxel v,
+                   Bins * const bins) {
+    
+    memset(bins, 0, sizeof(Bins));
+    
+    #pragma omp parallel
+    {
+        const int threads = omp_get_num_threads();
+        const int thread = omp_get_thread_num();
+        const int from = (int) ((long) indices_count * thread / threads);
+        const int to = (int) ((long) indices_count * (thread + 1) / threads);
+        
+        BoxesBlock block;
+        BoundingBoxes view;
+        Bins local_bins;
+        int n;
+        int i;
+        
+        memset(&local_bins, 0, sizeof(Bins));
+        for(i = from; i < to; i += SIMD_BLOCK) {
+            n = (to - i < SIMD_BLOCK) ? to - i : SIMD_BLOCK;
+            gather_block(boxes, indices + i, n, &block, &view);
+            update_bins(&view, 0, n, v, &local_bins);
+        }
+        
+        #pragma omp critical
+        {
+            int i;
+            for(i = 0; i < KD_TREE_BINS; i++) {
+                bins->x_starts[i] += local_bins.x_starts[i];
+                bins->x_ends[i] += local_bins.x_ends[i];
+                bins->y_starts[i] += local_bins.y_starts[i];
+                bins->y_ends[i] += local_bins.y_ends[i];
+                bins->z_starts[i] += local_bins.z_starts[i];
+                bins->z_ends[i] += local_bins.z_ends[i];
+            }
+        }
+    }
+}
+
+static inline int
+bin_index(const Float x,
+          const Float min,
+          const Float k) {
+    
+    // Bounds of object can be wider than voxel.
+    // Voxel of zero width (deep trees) gives NaN, which goes to the first bucket
+    Float i = (x - min) * k;
+    i = (i > 0) ? i : 0;
+    i = (i > KD_TREE_BINS - 1) ? KD_TREE_BINS - 1 : i;
+    return (int) i;
+}
+
+static inline void
+sweep_bins(const int * starts,
+           const int * ends,
+           const int objects_count,
+           const Float S_split,
+           const Float S_non_split,
+           const enum Plane plane,
+           const Float min,
+           const Float h,
+           const Float split_cost,
+           Float * const bestSAH,
+           enum Plane * const p,
+           Coord * const c) {
+    
+    // Number of objects at the left and at the right side
+    // of the border between (i - 1)-th and i-th buckets
+    int l_count = 0;
+    int r_count = objects_count;
+    
+    Float currSAH;
+    Float l;
+    Float r;
+    int i;
+    
+    for(i = 1; i < KD_TREE_BINS; i++) {
+        l_count += starts[i - 1];
+        r_count -= ends[i - 1];
+        
+        l = ((Float) i) / KD_TREE_BINS;
+        r = 1 - l;
+        
+        currSAH = (S_split + l * S_non_split) * l_count
+                + (S_split + r * S_non_split) * r_count
+                + split_cost;
+        
+        if(currSAH < *bestSAH) {
+            *bestSAH = currSAH;
+            *p = plane;
+            
+            // Coordinate of plane is stored in the tree as float,
+            // so it is rounded right away - to build tree for the same plane
+            switch(plane) {
+                case XY:
+                    c->z = (float) (min + l * h);
+                    break;
+                case XZ:
+                    c->y = (float) (min + l * h);
+                    break;
+                case YZ:
+                    c->x = (float) (min + l * h);
+                    break;
+                case NONE:
+                    break;
+            }
+        }
+    }
+}
+
+Voxel
+make_initial_voxel(const BoundingBoxes * const boxes) {
+    
+    if(!boxes->count) {
+        Voxel v = {-1, -1, -1, 1, 1, 1};
+        return v;
+    }
+    
+    Float x_min = boxes->x_min[0];
+    Float y_min = boxes->y_min[0];
+    Float z_min = boxes->z_min[0];
+    
+    Float x_max = boxes->x_max[0];
+    Float y_max = boxes->y_max[0];
+    Float z_max = boxes->z_max[0];
+    
+    int i;
+    for(i = 0; i < boxes->count; i++) {
+        x_min = (x_min < boxes->x_min[i]) ? x_min : boxes->x_min[i];
+        y_min = (y_min < boxes->y_min[i]) ? y_min : boxes->y_min[i];
+        z_min = (z_min < boxes->z_min[i]) ? z_min : boxes->z_min[i];
+        
+        x_max = (x_max > boxes->x_max[i]) ? x_max : boxes->x_max[i];
+        y_max = (y_max > boxes->y_max[i]) ? y_max : boxes->y_max[i];
+        z_max = (z_max > boxes->z_max[i]) ? z_max : boxes->z_max[i];
+    }
+    
+    Voxel v = {x_min - 1, y_min - 1, z_min - 1, x_max + 1, y_max + 1, z_max + 1};
+    return v;
+}
+
+inline BuildNode *
+make_leaf(const KDTree * const tree,
+          const BoundingBoxes * const boxes) {
+    
+    BuildNode * leaf = malloc(sizeof(BuildNode));
+    leaf->plane = NONE;
+    leaf->indexes_count = boxes->count;
+    leaf->l = NULL;
+    leaf->r = NULL;
+    if(boxes->count) {
+        leaf->indexes = malloc(boxes->count * sizeof(int));
+        memcpy(leaf->indexes, boxes->index, boxes->count * sizeof(int));
+    } else {
+        leaf->indexes = NULL;
+    }
+    
+    return leaf;
+}
+
+inline __hot Boolean
+vector_plane_intersection(const Vector3d vector,
+                          const Point3d vector_start,
+                          const enum Plane plane,
+                          const Coord coord,
+                          Point3d * const result) {
+    
+    Float k;    
+    switch(plane) {
+        case XY:
+            if(((coord.z < vector_start.z) && (vector.z > 0))
+                || ((coord.z > vector_start.z) && (vector.z < 0)))
+                return False;
+            
+            k = (coord.z - vector_start.z) / vector.z;
+            *result = point3d(vector_start.x + vector.x * k,
+                              vector_start.y + vector.y * k,
+                              coord.z);
+            break;
+        
+        case XZ:
+            if(((coord.y < vector_start.y) && (vector.y > 0))
+               || ((coord.y > vector_start.y) && (vector.y < 0)))
+                return False;
+            
+            k = (coord.y - vector_start.y) / vector.y;
+            *result = point3d(vector_start.x + vector.x * k,
+                              coord.y,
+                              vector_start.z + vector.z * k);
+            break;
+            
+        case YZ:
+            if(((coord.x < vector_start.x) && (vector.x > 0))
+               || ((coord.x > vector_start.x) && (vector.x < 0)))
+                return False;
+            
+            k = (coord.x - vector_start.x) / vector.x;
+            *result = point3d(coord.x,
+                              vector_start.y + vector.y * k,
+                              vector_start.z + vector.z * k);
+            break;
+            
+        case NONE:
+            // Unreachable case
+            printf("[vector_plane_intersection] Plane is NONE. Error");
+            exit(1);
+            break;
+    }
+    
+    return True;
+}
+
+inline Boolean
+voxel_intersection(const Vector3d vector,
+                   const Point3d vector_start,
+                   const Voxel v) {
+    
+    if(point_in_voxel(vector_start, v))
+        return True;
+    
+    Point3d p;
+    Coord c;
+    
+    c.z = v.z_min;
+    if(vector_plane_intersection(vector, vector_start, XY, c, &p)
+       && (p.x > v.x_min) && (p.x < v.x_max)
+       && (p.y > v.y_min) && (p.y < v.y_max)) {
+        
+            return True;
+    }
+    
+    c.z = v.z_max;
+    if(vector_plane_intersection(vector, vector_start, XY, c, &p)
+       && (p.x > v.x_min) && (p.x < v.x_max)
+       && (p.y > v.y_min) && (p.y < v.y_max)) {
+        
+            return True;
+    }
+    
+    c.y = v.y_min;
+    if(vector_plane_intersection(vector, vector_start, XZ, c, &p)
+       && (p.x > v.x_min) && (p.x < v.x_max)
+       && (p.z > v.z_min) && (p.z < v.z_max)) {
+        
+            return True;
+    }
+    
+    c.y = v.y_max;
+    if(vector_plane_intersection(vector, vector_start, XZ, c, &p)
+       && (p.x > v.x_min) && (p.x < v.x_max)
+       && (p.z > v.z_min) && (p.z < v.z_max)) {
+        
+            return True;
+    }
+    
+    c.x = v.x_min;
+    if(vector_plane_intersection(vector, vector_start, YZ, c, &p)
+       && (p.y > v.y_min) && (p.y < v.y_max)
+       && (p.z > v.z_min) && (p.z < v.z_max)) {
+        
+            return True;
+    }
+    
+    c.x = v.x_max;
+    if(vector_plane_intersection(vector, vector_start, YZ, c, &p)
+       && (p.y > v.y_min) && (p.y < v.y_max)
+       && (p.z > v.z_min) && (p.z < v.z_max)) {
+        
+            return True;
+    }
+    
+    return False;
+}
+
+/*
+ * Iterative front-to-back traversal. Ray is clipped by the bounding box of tree,
+ * and after that each inner node only splits the interval [t_min, t_max]
+ * of the ray by the distance to its plane. Far child waits in the stack.
+ * Traversal stops, when the nearest intersection is inside the current leaf
+ */
+Boolean
+find_intersection_tree(KDTree * const tree,
+                       const Point3d vector_start,
+                       const Vector3d vector,
+                       Object3d ** const nearest_obj_ptr,
+                       HitRecord * const nearest_hit) {
+    
+    HitRecord hit;
+    const int nearest_index = find_nearest_tree_object(tree, vector_start, vector, &hit);
+    
+    if(nearest_index == NO_TREE_OBJECT)
+        return False;
+    
+    if(hit.t < nearest_hit->t) {
+        *nearest_obj_ptr = tree_object(tree, nearest_index);
+        *nearest_hit = hit;
+    }
+    return True;
+}
+
+int
+find_intersection_index_tree(KDTree * const tree,
+                             const Point3d vector_start,
+                             const Vector3d vector,
+                             HitRecord * const nearest_hit) {
+    
+    const int nearest_index = find_nearest_tree_object(tree, vector_start, vector, nearest_hit);
+    return (nearest_index == NO_TREE_OBJECT) ? -1 : nearest_index;
+}
+
+/*
+ * The same traversal, which is limited by max_dist
+ * and stops at the first intersected object
+ */
+Boolean
+is_intersect_anything_tree(KDTree * const tree,
+                           const Point3d vector_start,
+                           const Vector3d vector,
+                           const Float max_dist) {
+    
+    const KDRay ray = new_kd_ray(vector_start, vector);
+    
+    Float t_min = 0;
+    Float t_max = max_dist / module_vector(vector);
+    
+    #ifndef NO_BOUNDING_BOX
+    if(!clip_ray_by_voxel(&ray, tree->bounding_box, &t_min, &t_max))
+        return False;
+    #endif // NO_BOUNDING_BOX
+    
+    new_mailbox_stamp(tree_mailbox(tree));
+    return is_intersect_anything_subtree(tree, tree->nodes, &ray, vector_start, vector,
+                                         t_min, t_max, 1, max_dist);
+}
+
+/*
+ * Index of the nearest intersected object of tree (NO_TREE_OBJECT if there is no intersection)
+ */
+static inline int
+find_nearest_tree_object(KDTree * const tree,
+                         const Point3d vector_start,
+                         const Vector3d vector,
+                         HitRecord * const nearest_hit) {
+    
+    const KDRay ray = new_kd_ray(vector_start, vector);
+    
+    Float t_min = 0;
+    Float t_max = FLOAT_MAX;
+    
+    #ifndef NO_BOUNDING_BOX
+    if(!clip_ray_by_voxel(&ray, tree->bounding_box, &t_min, &t_max))
+        return NO_TREE_OBJECT;
+    #endif // NO_BOUNDING_BOX
+    
+    int nearest_index = NO_TREE_OBJECT;
+    nearest_hit->t = FLOAT_MAX;
+    
+    new_mailbox_stamp(tree_mailbox(tree));
+    find_intersection_subtree(tree, tree->nodes, &ray, vector_start, vector, t_min, t_max, 1,
+                              &nearest_index, nearest_hit);
+    return nearest_index;
+}
+
+/*
+ * Traversal of the subtree by interval [t_min, t_max] of the ray.
+ * nearest_hit is the nearest intersection, which was found before.
+ * Returns True, if the nearest intersection of the whole tree is found
+ */
+static inline Boolean
+find_intersection_subtree(const KDTree * const tree,
+                          const KDNode * node,
+                          const KDRay * const ray,
+                          const Point3d vector_start,
+                          const Vector3d vector,
+                          Float t_min,
+                          Float t_max,
+                          const int ray_bit,
+                          int * const nearest_index,
+                          HitRecord * const nearest_hit) {
+    
+    Mailbox * const mailbox = tree_mailbox(tree);
+    
+    TraversalEntry stack[KD_TREE_STACK_SIZE];
+    int stack_size = 0;
+    
+    while(True) {
+        node = find_leaf(tree->nodes, node, ray, t_min, &t_max, stack, &stack_size);
+        
+        const int objects_count = node->flags >> NODE_PLANE_BITS;
+        const int * objects_indexes = tree->objects_indexes + node->data.objects_offset;
+        const KDLeafGroups * leaf_groups = &tree->leaf_groups[node - tree->nodes];
+        int i;
+        
+        if(leaf_groups->triangles_count) {
+            intersect_leaf_groups(tree, leaf_groups, objects_indexes, ray, vector_start, vector, ray_bit,
+                                  nearest_index, nearest_hit);
+        }
+        
+        for(i = leaf_groups->triangles_count; i < objects_count; i++) {
+            if(!mailbox_untested(mailbox, objects_indexes[i], ray_bit))
+                continue;
+            
+            HitRecord hit;
+            
+            #ifdef RAY_INTERSECTIONS_STAT
+            ++intersections_per_ray;
+            #endif // RAY_INTERSECTIONS_STAT
+            
+            if(intersect_tree_object(tree, objects_indexes[i], vector_start, vector, &hit)
+               && (hit.t < nearest_hit->t)) {
+                
+                *nearest_index = objects_indexes[i];
+                *nearest_hit = hit;
+            }
+        }
+        
+        // Objects of leaf can be intersected outside of it,
+        // so only intersection inside the leaf is the nearest one
+        if(nearest_hit->t <= t_max)
+            return True;
+        
+        if(!stack_size)
+            return False;
+        
+        stack_size--;
+        node = tree->nodes + stack[stack_size].node;
+        t_min = stack[stack_size].t_min;
+        t_max = stack[stack_size].t_max;
+        
+        if(nearest_hit->t < t_min)
+            return True;
+    }
+}
+
+static inline Boolean
+is_intersect_anything_subtree(const KDTree * const tree,
+                              const KDNode * node,
+                              const KDRay * const ray,
+                              const Point3d vector_start,
+                              const Vector3d vector,
+                              Float t_min,
+                              Float t_max,
+                              const int ray_bit,
+                              const Float max_dist) {
+    
+    Mailbox * const mailbox = tree_mailbox(tree);
+    
+    TraversalEntry stack[KD_TREE_STACK_SIZE];
+    int stack_size = 0;
+    
+    while(True) {
+        node = find_leaf(tree->nodes, node, ray, t_min, &t_max, stack, &stack_size);
+        
+        const int objects_count = node->flags >> NODE_PLANE_BITS;
+        const int * objects_indexes = tree->objects_indexes + node->data.objects_offset;
+        const KDLeafGroups * leaf_groups = &tree->leaf_groups[node - tree->nodes];
+        int i;
+        
+        if(leaf_groups->triangles_count
+           && is_leaf_groups_intersected(tree, leaf_groups, objects_indexes, ray, vector_start, vector,
+                                         ray_bit, max_dist)) {
+            
+            return True;
+        }
+        
+        for(i = leaf_groups->triangles_count; i < objects_count; i++) {
+            if(!mailbox_untested(mailbox, objects_indexes[i], ray_bit))
+                continue;
+            
+            #ifdef RAY_INTERSECTIONS_STAT
+            ++intersections_per_ray;
+            #endif // RAY_INTERSECTIONS_STAT
+            
+            if(is_tree_object_intersected(tree, objects_indexes[i], vector_start, vector, max_dist))
+                return True;
+        }
+        
+        if(!stack_size)
+            return False;
+        
+        stack_size--;
+        node = tree->nodes + stack[stack_size].node;
+        t_min = stack[stack_size].t_min;
+        t_max = stack[stack_size].t_max;
+    }
+}
+
+/*
+ * Packet goes through the tree while all its active rays are at the same side
+ * of each plane (rays with the common start always are). Each ray has its own
+ * interval, so the rays, which don't cross the child, are masked out.
+ * Subtree, where rays go different ways, is traversed by each ray separately.
+ * Every ray visits the same leaves in the same order, as the single ray does,
+ * so results are equal to the results of find_intersection_tree.
+ * Returns mask of intersected rays
+ */
+int
+find_intersection_tree_packet(KDTree * const tree,
+                              const RayPacket * const packet,
+                              const int mask,
+                              Object3d ** const nearest_objs,
+                              HitRecord * const nearest_hits) {
+    
+    int nearest_index[PACKET_SIZE];
+    HitRecord hits[PACKET_SIZE];
+    
+    const int intersected = find_nearest_tree_objects_packet(tree, packet, mask, nearest_index, hits);
+    int r;
+    for(r = 0; intersected >> r; r++) {
+        if((intersected & (1 << r)) && (hits[r].t < nearest_hits[r].t)) {
+            nearest_objs[r] = tree_object(tree, nearest_index[r]);
+            nearest_hits[r] = hits[r];
+        }
+    }
+    return intersected;
+}
+
+int
+find_intersection_index_tree_packet(KDTree * const tree,
+                                    const RayPacket * const packet,
+                                    const int mask,
+                                    int * const nearest_indexes,
+                                    HitRecord * const nearest_hits) {
+    
+    return find_nearest_tree_objects_packet(tree, packet, mask, nearest_indexes, nearest_hits);
+}
+
+/*
+ * Indexes of the nearest intersected objects for rays of packet.
+ * Returns mask of intersected rays
+ */
+static inline int
+find_nearest_tree_objects_packet(KDTree * const tree,
+                                 const RayPacket * const packet,
+                                 const int mask,
+                                 int * const nearest_index,
+                                 HitRecord * const nearest_hits) {
+    
+    KDPacket p;
+    new_kd_packet(packet, &p);
+    
+    Mailbox * const mailbox = tree_mailbox(tree);
+    new_mailbox_stamp(mailbox);
+    
+    PacketFloat t_min = packet_float(0);
+    PacketFloat t_max = packet_float(FLOAT_MAX);
+    int active = mask;
+    
+    #ifndef NO_BOUNDING_BOX
+    active = clip_packet_by_voxel(&p, mask, tree->bounding_box, &t_min, &t_max);
+    #endif // NO_BOUNDING_BOX
+    
+    PacketFloat nearest_t = packet_float(FLOAT_MAX);
+    int r;
+    for(r = 0; r < PACKET_SIZE; r++) {
+        nearest_index[r] = NO_TREE_OBJECT;
+        nearest_hits[r].t = FLOAT_MAX;
+    }
+    
+    // Rays, whose nearest intersection is found
+    int finished = 0;
+    
+    PacketTraversalEntry stack[KD_TREE_STACK_SIZE];
+    int stack_size = 0;
+    
+    const KDNode * node = tree->nodes;
+    
+    while(active) {
+        node = find_packet_leaf(tree->nodes, node, &p, &active, &t_min, &t_max, stack, &stack_size);
+        
+        if((node->flags & NODE_PLANE_MASK) != NONE) {
+            for(r = 0; r < PACKET_SIZE; r++) {
+                if(active & (1 << r)) {
+                    if(find_intersection_subtree(tree, node, &p.rays[r], p.starts[r], p.vectors[r],
+                                                 t_min[r], t_max[r], 1 << r,
+                                                 &nearest_index[r], &nearest_hits[r])) {
+                        finished |= 1 << r;
+                    }
+                    nearest_t[r] = nearest_hits[r].t;
+                }
+            }
+        } else {
+            const int objects_count = node->flags >> NODE_PLANE_BITS;
+            const int * objects_indexes = tree->objects_indexes + node->data.objects_offset;
+            int i;
+            
+            for(i = 0; i < objects_count; i++) {
+                const int rays = mailbox_untested(mailbox, objects_indexes[i], active);
+                if(!rays)
+                    continue;
+                
+                #ifdef RAY_INTERSECTIONS_STAT
+                intersections_per_ray += __builtin_popcount(rays);
+                #endif // RAY_INTERSECTIONS_STAT
+                
+                HitRecord hits[PACKET_SIZE];
+                const int intersected = intersect_tree_object_packet(tree, objects_indexes[i], &p, packet, rays,
+                                                                     hits);
+                
+                for(r = 0; intersected >> r; r++) {
+                    if((intersected & (1 << r)) && (hits[r].t < nearest_t[r])) {
+                        nearest_t[r] = hits[r].t;
+                        nearest_index[r] = objects_indexes[i];
+                        nearest_hits[r] = hits[r];
+                    }
+                }
+            }
+            
+            finished |= active & packet_mask_bits(nearest_t <= t_max);
+        }
+        
+        active = 0;
+        while(!active && stack_size) {
+            stack_size--;
+            node = tree->nodes + stack[stack_size].node;
+            t_min = stack[stack_size].t_min;
+            t_max = stack[stack_size].t_max;
+            
+            finished |= stack[stack_size].mask & packet_mask_bits(nearest_t < t_min);
+            active = stack[stack_size].mask & ~finished;
+        }
+    }
+    
+    int intersected = 0;
+    for(r = 0; r < PACKET_SIZE; r++) {
+        if(nearest_index[r] != NO_TREE_OBJECT)
+            intersected |= 1 << r;
+    }
+    return intersected;
+}
+
+/*
+ * The same traversal of packet, which drops each ray
+ * after its first intersection (closer than max_dists[ray])
+ */
+int
+is_intersect_anything_tree_packet(KDTree * const tree,
+                                  const RayPacket * const packet,
+                                  const int mask,
+                                  const Float * const max_dists) {
+    
+    KDPacket p;
+    new_kd_packet(packet, &p);
+    
+    Mailbox * const mailbox = tree_mailbox(tree);
+    new_mailbox_stamp(mailbox);
+    
+    PacketFloat t_min = packet_float(0);
+    PacketFloat t_max;
+    int r;
+    for(r = 0; r < PACKET_SIZE; r++)
+        t_max[r] = max_dists[r] / module_vector(p.vectors[r]);
+    int active = mask;
+    
+    #ifndef NO_BOUNDING_BOX
+    active = clip_packet_by_voxel(&p, mask, tree->bounding_box, &t_min, &t_max);
+    #endif // NO_BOUNDING_BOX
+    
+    int intersected = 0;
+    
+    PacketTraversalEntry stack[KD_TREE_STACK_SIZE];
+    int stack_size = 0;
+    
+    const KDNode * node = tree->nodes;
+    
+    while(active) {
+        node = find_packet_leaf(tree->nodes, node, &p, &active, &t_min, &t_max, stack, &stack_size);
+        
+        if((node->flags & NODE_PLANE_MASK) != NONE) {
+            for(r = 0; r < PACKET_SIZE; r++) {
+                if((active & (1 << r))
+                   && is_intersect_anything_subtree(tree, node, &p.rays[r], p.starts[r], p.vectors[r],
+                                                    t_min[r], t_max[r], 1 << r, max_dists[r])) {
+                    
+                    intersected |= 1 << r;
+                }
+            }
+        } else {
+            const int objects_count = node->flags >> NODE_PLANE_BITS;
+            const int * objects_indexes = tree->objects_indexes + node->data.objects_offset;
+            int i;
+            
+            for(i = 0; (i < objects_count) && (active & ~intersected); i++) {
+                const int rays = mailbox_untested(mailbox, objects_indexes[i], active & ~intersected);
+                if(!rays)
+                    continue;
+                
+                #ifdef RAY_INTERSECTIONS_STAT
+                intersections_per_ray += __builtin_popcount(rays);
+                #endif // RAY_INTERSECTIONS_STAT
+                
+                intersected |= is_tree_object_intersected_packet(tree, objects_indexes[i], &p, packet, rays,
+                                                                 max_dists);
+            }
+        }
+        
+        active = 0;
+        while(!active && stack_size) {
+            stack_size--;
+            node = tree->nodes + stack[stack_size].node;
+            t_min = stack[stack_size].t_min;
+            t_max = stack[stack_size].t_max;
+            active = stack[stack_size].mask & ~intersected;
+        }
+    }
+    return intersected;
+}
+
+/*
+ * Object of tree by its index: Object3d or triangle of mesh
+ */
+static inline Boolean
+intersect_tree_object(const KDTree * const tree,
+                      const int index,
+                      const Point3d vector_start,
+                      const Vector3d vector,
+                      HitRecord * const hit) {
+    
+    if(tree->mesh)
+        return intersect_mesh_triangle(tree->mesh, index, vector_start, vector, hit);
+    
+    const KDPrimitive * primitive = tree_primitive(tree, index);
+    const Object3d * obj;
+    
+    switch(primitive->type) {
+        case TRIANGLE_OBJECT:
+            return intersect_triangle_primitive(primitive, vector_start, vector, hit);
+        case SPHERE_OBJECT:
+            return intersect_sphere_primitive(primitive, vector_start, vector, hit);
+        case MESH_OBJECT:
+            return intersect_mesh_triangle(primitive->geometry.mesh_triangle.mesh,
+                                           primitive->geometry.mesh_triangle.index,
+                                           vector_start, vector, hit);
+        default:
+            obj = tree->objects[index];
+            return obj->intersect(obj->data, vector_start, vector, hit);
+    }
+}
+
+/*
+ * Intersects object with rays of mask. Returns mask of intersected rays,
+ * their hits are written to the array, which is indexed by rays
+ */
+static inline int
+intersect_tree_object_packet(const KDTree * const tree,
+                             const int index,
+                             const KDPacket * const p,
+                             const RayPacket * const packet,
+                             const int mask,
+                             HitRecord * const hits) {
+    
+    const KDPrimitive * primitive = (tree->mesh) ? NULL : tree_primitive(tree, index);
+    const Object3d * obj = custom_tree_object(tree, index);
+    
+    // Spheres and objects without packet test intersect rays one by one
+    if((primitive && (primitive->type == SPHERE_OBJECT)) || (obj && !obj->intersect_packet)) {
+        int intersected = 0;
+        int r;
+        for(r = 0; r < PACKET_SIZE; r++) {
+            if((mask & (1 << r))
+               && intersect_tree_object(tree, index, p->starts[r], p->vectors[r], &hits[r])) {
+                
+                intersected |= 1 << r;
+            }
+        }
+        return intersected;
+    }
+    
+    if(tree->mesh)
+        return intersect_mesh_triangle_packet(tree->mesh, index, packet, mask, hits);
+    
+    if(primitive->type == MESH_OBJECT)
+        return intersect_mesh_triangle_packet(primitive->geometry.mesh_triangle.mesh,
+                                              primitive->geometry.mesh_triangle.index,
+                                              packet, mask, hits);
+    
+    if(obj)
+        return obj->intersect_packet(obj->data, packet, mask, hits);
+    
+    return intersect_triangle_primitive_packet(primitive, packet, mask, hits);
+}
+
+/*
+ * Checks, if object is intersected not farther than max_dist
+ */
+static inline Boolean
+is_tree_object_intersected(const KDTree * const tree,
+                           const int index,
+                           const Point3d vector_start,
+                           const Vector3d vector,
+                           const Float max_dist) {
+    
+    const Object3d * obj = custom_tree_object(tree, index);
+    
+    if(obj && obj->is_intersected)
+        return obj->is_intersected(obj->data, vector_start, vector, max_dist);
+    
+    HitRecord hit;
+    return intersect_tree_object(tree, index, vector_start, vector, &hit)
+           && (sqr_module_vector(vector3dp(vector_start, hit.point)) <= max_dist * max_dist);
+}
+
+/*
+ * Returns mask of rays, which intersect object not farther than max_dists[ray]
+ */
+static inline int
+is_tree_object_intersected_packet(const KDTree * const tree,
+                                  const int index,
+                                  const KDPacket * const p,
+                                  const RayPacket * const packet,
+                                  const int mask,
+                                  const Float * const max_dists) {
+    
+    const Object3d * obj = custom_tree_object(tree, index);
+    
+    if(obj && obj->is_intersected_packet)
+        return obj->is_intersected_packet(obj->data, packet, mask, max_dists);
+    
+    HitRecord hits[PACKET_SIZE];
+    const int hit_rays = intersect_tree_object_packet(tree, index, p, packet, mask, hits);
+    
+    int intersected = 0;
+    int r;
+    for(r = 0; hit_rays >> r; r++) {
+        if((hit_rays & (1 << r))
+           && (sqr_module_vector(vector3dp(p->starts[r], hits[r].point)) <= max_dists[r] * max_dists[r])) {
+            
+            intersected |= 1 << r;
+        }
+    }
+    return intersected;
+}
+
+/*
+ * The same watertight test as in triangle.c: the same shear of ray, the same
+ * edge functions and the same rule for the ray, which crosses the edge
+ * (the makefile turns off contraction to FMA, so rounding is the same too).
+ * All triangles of group are tested at once (only lanes of mask).
+ * Returns mask of intersected lanes, their distances (in lengths of vector)
+ * and weights of vertexes are written to t, w1, w2, w3
+ */
+static inline int
+intersect_triangle_group(const KDTriangleGroup * const group,
+                         const int lanes,
+                         const KDRay * const ray,
+                         GroupFloat * const t,
+                         GroupFloat * const w1,
+                         GroupFloat * const w2,
+                         GroupFloat * const w3) {
+    
+    const int kx = ray->kx;
+    const int ky = ray->ky;
+    const int kz = ray->kz;
+    const Float sx = ray->sx;
+    const Float sy = ray->sy;
+    const Float sz = ray->sz;
+    
+    const GroupFloat a[3] = {group->p1[0] - ray->start[0], group->p1[1] - ray->start[1], group->p1[2] - ray->start[2]};
+    const GroupFloat b[3] = {group->p2[0] - ray->start[0], group->p2[1] - ray->start[1], group->p2[2] - ray->start[2]};
+    const GroupFloat c[3] = {group->p3[0] - ray->start[0], group->p3[1] - ray->start[1], group->p3[2] - ray->start[2]};
+    
+    const GroupFloat ax = a[kx] - sx * a[kz];
+    const GroupFloat ay = a[ky] - sy * a[kz];
+    const GroupFloat bx = b[kx] - sx * b[kz];
+    const GroupFloat by = b[ky] - sy * b[kz];
+    const GroupFloat cx = c[kx] - sx * c[kz];
+    const GroupFloat cy = c[ky] - sy * c[kz];
+    
+    const GroupFloat u = cx * by - cy * bx;
+    const GroupFloat v = ax * cy - ay * cx;
+    const GroupFloat w = bx * ay - by * ax;
+    
+    const GroupFloat det = u + v + w;
+    GroupMask miss = (((u < 0) | (v < 0) | (w < 0)) & ((u > 0) | (v > 0) | (w > 0))) | (det == 0);
+    
+    int hits = 0;
+    int i;
+    for(i = 0; i < TRIANGLE_GROUP_SIZE; i++)
+        hits |= (!miss[i]) << i;
+    hits &= lanes;
+    
+    if(!hits)
+        return 0;
+    
+    *t = (u * (sz * a[kz]) + v * (sz * b[kz]) + w * (sz * c[kz])) / det;
+    miss = (*t < EPSILON);
+    
+    for(i = 0; i < TRIANGLE_GROUP_SIZE; i++)
+        hits &= ~((miss[i] & 1) << i);
+    
+    *w1 = u / det;
+    *w2 = v / det;
+    *w3 = w / det;
+    return hits;
+}
+
+/*
+ * Lanes of group, whose triangles haven't been tested by the ray yet
+ * (triangles of lanes are marked as tested)
+ */
+static inline int
+untested_group_lanes(Mailbox * const mailbox,
+                     const int * const objects_indexes,
+                     const int lanes_count,
+                     const int ray_bit) {
+    
+    int lanes = 0;
+    int j;
+    for(j = 0; j < lanes_count; j++) {
+        if(mailbox_untested(mailbox, objects_indexes[j], ray_bit))
+            lanes |= 1 << j;
+    }
+    return lanes;
+}
+
+/*
+ * Hit of the nearest intersected lane is made from the result of group test,
+ * it is the same as the hit of the test of single triangle
+ */
+static inline void
+intersect_leaf_groups(const KDTree * const tree,
+                      const KDLeafGroups * const leaf_groups,
+                      const int * const objects_indexes,
+                      const KDRay * const ray,
+                      const Point3d vector_start,
+                      const Vector3d vector,
+                      const int ray_bit,
+                      int * const nearest_index,
+                      HitRecord * const nearest_hit) {
+    
+    Mailbox * const mailbox = tree_mailbox(tree);
+    const KDTriangleGroup * group = tree->triangle_groups + leaf_groups->first_group;
+    int i;
+    int j;
+    
+    for(i = 0; i < leaf_groups->triangles_count; i += TRIANGLE_GROUP_SIZE, group++) {
+        
+        const int lanes_count = (leaf_groups->triangles_count - i < TRIANGLE_GROUP_SIZE)
+                                ? leaf_groups->triangles_count - i
+                                : TRIANGLE_GROUP_SIZE;
+        
+        const int lanes = untested_group_lanes(mailbox, objects_indexes + i, lanes_count, ray_bit);
+        if(!lanes)
+            continue;
+        
+        #ifdef RAY_INTERSECTIONS_STAT
+        intersections_per_ray += __builtin_popcount(lanes);
+        #endif // RAY_INTERSECTIONS_STAT
+        
+        GroupFloat t;
+        GroupFloat w1;
+        GroupFloat w2;
+        GroupFloat w3;
+        const int hits = intersect_triangle_group(group, lanes, ray, &t, &w1, &w2, &w3);
+        if(!hits)
+            continue;
+        
+        // The first lane wins on equal distances - as by the tests one by one
+        int nearest = -1;
+        for(j = 0; j < TRIANGLE_GROUP_SIZE; j++) {
+            if((hits & (1 << j)) && ((nearest < 0) || (t[j] < t[nearest])))
+                nearest = j;
+        }
+        
+        if(t[nearest] < nearest_hit->t) {
+            const int index = objects_indexes[i + nearest];
+            
+            nearest_hit->t = t[nearest];
+            nearest_hit->point = point3d(vector_start.x + vector.x * t[nearest],
+                                         vector_start.y + vector.y * t[nearest],
+                                         vector_start.z + vector.z * t[nearest]);
+            nearest_hit->w1 = w1[nearest];
+            nearest_hit->w2 = w2[nearest];
+            nearest_hit->w3 = w3[nearest];
+            set_tree_triangle_hit_norm(tree, index, nearest_hit);
+            *nearest_index = index;
+        }
+    }
+}
+
+/*
+ * Normal vector of triangle of group (triangle of mesh or triangle object)
+ */
+static inline void
+set_tree_triangle_hit_norm(const KDTree * const tree,
+                           const int index,
+                           HitRecord * const hit) {
+    
+    if(tree->mesh) {
+        set_mesh_triangle_hit_norm(tree->mesh, index, hit);
+        return;
+    }
+    
+    const KDPrimitive * primitive = tree_primitive(tree, index);
+    if(primitive->type == MESH_OBJECT) {
+        set_mesh_triangle_hit_norm(primitive->geometry.mesh_triangle.mesh,
+                                   primitive->geometry.mesh_triangle.index, hit);
+    } else {
+        set_triangle_primitive_hit_norm(primitive, hit);
+    }
+}
+
+/*
+ * Lane is intersected, if its intersection point is not farther than max_dist
+ * (as by is_tree_object_intersected for single triangle)
+ */
+static inline Boolean
+is_leaf_groups_intersected(const KDTree * const tree,
+                           const KDLeafGroups * const leaf_groups,
+                           const int * const objects_indexes,
+                           const KDRay * const ray,
+                           const Point3d vector_start,
+                           const Vector3d vector,
+                           const int ray_bit,
+                           const Float max_dist) {
+    
+    Mailbox * const mailbox = tree_mailbox(tree);
+    const KDTriangleGroup * group = tree->triangle_groups + leaf_groups->first_group;
+    const Float sqr_max_dist = max_dist * max_dist;
+    int i;
+    int j;
+    
+    for(i = 0; i < leaf_groups->triangles_count; i += TRIANGLE_GROUP_SIZE, group++) {
+        
+        const int lanes_count = (leaf_groups->triangles_count - i < TRIANGLE_GROUP_SIZE)
+                                ? leaf_groups->triangles_count - i
+                                : TRIANGLE_GROUP_SIZE;
+        
+        const int lanes = untested_group_lanes(mailbox, objects_indexes + i, lanes_count, ray_bit);
+        if(!lanes)
+            continue;
+        
+        #ifdef RAY_INTERSECTIONS_STAT
+        intersections_per_ray += __builtin_popcount(lanes);
+        #endif // RAY_INTERSECTIONS_STAT
+        
+        GroupFloat t;
+        GroupFloat w1;
+        GroupFloat w2;
+        GroupFloat w3;
+        const int hits = intersect_triangle_group(group, lanes, ray, &t, &w1, &w2, &w3);
+        
+        for(j = 0; hits >> j; j++) {
+            if(!(hits & (1 << j)))
+                continue;
+            
+            const Point3d intersection_point = point3d(vector_start.x + vector.x * t[j],
+                                                       vector_start.y + vector.y * t[j],
+                                                       vector_start.z + vector.z * t[j]);
+            
+            if(sqr_module_vector(vector3dp(vector_start, intersection_point)) <= sqr_max_dist)
+                return True;
+        }
+    }
+    return False;
+}
+
+/*
+ * Object, which is intersected by its callbacks
+ * (NULL for built-in primitives and for triangles of mesh)
+ */
+static inline const Object3d *
+custom_tree_object(const KDTree * const tree,
+                   const int index) {
+    
+    if(tree->mesh || (tree_primitive(tree, index)->type != CUSTOM_OBJECT))
+        return NULL;
+    
+    return tree->objects[index];
+}
+
+/*
+ * Primitive of object or triangle of mesh, which is referenced by leaf of scene tree
+ */
+static inline const KDPrimitive *
+tree_primitive(const KDTree * const tree,
+               const int index) {
+    
+    return (index < 0) ? &tree->mesh_primitives[-1 - index] : &tree->primitives[index];
+}
+
+/*
+ * Object, which is shaded at the intersection with primitive of leaf
+ */
+static inline Object3d *
+tree_object(const KDTree * const tree,
+            const int index) {
+    
+    return tree->objects[(index < 0) ? tree_primitive(tree, index)->geometry.mesh_triangle.object : index];
+}
+
+static inline Voxel
+tree_primitive_box(const KDTree * const tree,
+                   const int index) {
+    
+    if(index >= 0)
+        return object_box(tree->objects[index]);
+    
+    const KDPrimitive * primitive = tree_primitive(tree, index);
+    return get_mesh_triangle_box(primitive->geometry.mesh_triangle.mesh,
+                                 primitive->geometry.mesh_triangle.index);
+}
+
+static inline KDPrimitive
+new_kd_primitive(const Object3d * const obj) {
+    switch(obj->type) {
+        case TRIANGLE_OBJECT:
+            return new_triangle_primitive(obj);
+        case SPHERE_OBJECT:
+            return new_sphere_primitive(obj);
+        default: {
+            KDPrimitive primitive;
+            primitive.type = CUSTOM_OBJECT;
+            primitive.data = obj->data;
+            return primitive;
+        }
+    }
+}
+
+static KDPrimitive *
+new_kd_primitives(Object3d ** objects,
+                  const int objects_count) {
+    
+    KDPrimitive * primitives = malloc((objects_count + 1) * sizeof(KDPrimitive));
+    
+    int i;
+    for(i = 0; i < objects_count; i++)
+        primitives[i] = new_kd_primitive(objects[i]);
+    
+    return primitives;
+}
+
+/*
+ * Primitives of all triangles of MESH_OBJECT objects (in the order of objects).
+ * Returns NULL if there are no such objects
+ */
+static KDPrimitive *
+new_mesh_primitives(Object3d ** objects,
+                    const int objects_count,
+                    int * const mesh_primitives_count) {
+    
+    Boolean has_meshes = False;
+    int count = 0;
+    int i;
+    for(i = 0; i < objects_count; i++) {
+        if(objects[i]->type == MESH_OBJECT) {
+            const TriangleMesh * mesh = objects[i]->data;
+            count += mesh->triangles_count;
+            has_meshes = True;
+        }
+    }
+    
+    *mesh_primitives_count = count;
+    if(!has_meshes)
+        return NULL;
+    
+    KDPrimitive * primitives = malloc((count + 1) * sizeof(KDPrimitive));
+    
+    int n = 0;
+    for(i = 0; i < objects_count; i++) {
+        if(objects[i]->type != MESH_OBJECT)
+            continue;
+        
+        const TriangleMesh * mesh = objects[i]->data;
+        int j;
+        for(j = 0; j < mesh->triangles_count; j++) {
+            KDPrimitive * primitive = &primitives[n++];
+            primitive->type = MESH_OBJECT;
+            primitive->data = mesh;
+            primitive->geometry.mesh_triangle.mesh = mesh;
+            primitive->geometry.mesh_triangle.index = j;
+            primitive->geometry.mesh_triangle.object = i;
+        }
+    }
+    return primitives;
+}
+
+/*
+ * Table of boxes of primitives of leaves: boxes of objects,
+ * where mesh objects are replaced by boxes of their triangles
+ */
+static BoundingBoxes *
+new_primitives_bounding_boxes(const KDTree * const tree,
+                              const BoundingBoxes * const boxes) {
+    
+    int count = tree->mesh_primitives_count;
+    int i;
+    for(i = 0; i < boxes->count; i++) {
+        if(tree->objects[boxes->index[i]]->type != MESH_OBJECT)
+            count++;
+    }
+    
+    BoundingBoxes * result = alloc_bounding_boxes(count);
+    
+    int n = 0;
+    for(i = 0; i < boxes->count; i++) {
+        if(tree->objects[boxes->index[i]]->type != MESH_OBJECT)
+            copy_bounding_box(boxes, i, result, n++);
+    }
+    
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < tree->mesh_primitives_count; i++) {
+        const Voxel box = tree_primitive_box(tree, -1 - i);
+        
+        result->x_min[n + i] = box.x_min;
+        result->y_min[n + i] = box.y_min;
+        result->z_min[n + i] = box.z_min;
+        
+        result->x_max[n + i] = box.x_max;
+        result->y_max[n + i] = box.y_max;
+        result->z_max[n + i] = box.z_max;
+        
+        result->index[n + i] = -1 - i;
+    }
+    
+    return result;
+}
+
+static inline KDRay
+new_kd_ray(const Point3d vector_start,
+           const Vector3d vector) {
+    
+    KDRay ray;
+    ray.start[0] = vector_start.x;
+    ray.start[1] = vector_start.y;
+    ray.start[2] = vector_start.z;
+    
+    ray.dir[0] = vector.x;
+    ray.dir[1] = vector.y;
+    ray.dir[2] = vector.z;
+    
+    ray.inv_dir[0] = 1 / vector.x;
+    ray.inv_dir[1] = 1 / vector.y;
+    ray.inv_dir[2] = 1 / vector.z;
+    
+    ray_shear(vector, &ray.kx, &ray.ky, &ray.kz, &ray.sx, &ray.sy, &ray.sz);
+    
+    return ray;
+}
+
+/*
+ * Descends from the node to the first leaf, which is crossed by [t_min, t_max].
+ * Far children are pushed to the stack, t_max is narrowed to the leaf
+ */
+static inline const KDNode *
+find_leaf(const KDNode * const nodes,
+          const KDNode * node,
+          const KDRay * const ray,
+          const Float t_min,
+          Float * const t_max,
+          TraversalEntry * const stack,
+          int * const stack_size) {
+    
+    enum Plane plane;
+    while((plane = node->flags & NODE_PLANE_MASK) != NONE) {
+        // XY - z, XZ - y, YZ - x
+        const int axis = 2 - plane;
+        const Float split = node->data.split;
+        const Float t_split = (split - ray->start[axis]) * ray->inv_dir[axis];
+        
+        // Near child is the side of plane, where the ray starts
+        const int below = (ray->start[axis] < split)
+                          || ((ray->start[axis] == split) && (ray->dir[axis] <= 0));
+        const KDNode * children = nodes + (node->flags >> NODE_PLANE_BITS);
+        const KDNode * near_node = children + !below;
+        const KDNode * far_node = children + below;
+        
+        // NaN (ray is parallel to the plane) goes to the near child
+        if(!(t_split <= *t_max) || (t_split <= 0)) {
+            node = near_node;
+        } else if(t_split < t_min) {
+            node = far_node;
+        } else {
+            stack[*stack_size].node = far_node - nodes;
+            stack[*stack_size].t_min = t_split;
+            stack[*stack_size].t_max = *t_max;
+            (*stack_size)++;
+            
+            node = near_node;
+            *t_max = t_split;
+        }
+    }
+    return node;
+}
+
+/*
+ * Narrows interval [t_min, t_max] of the ray to the part inside voxel.
+ * Returns False if the ray doesn't cross voxel
+ */
+static inline Boolean
+clip_ray_by_voxel(const KDRay * const ray,
+                  const Voxel v,
+                  Float * const t_min,
+                  Float * const t_max) {
+    
+    const Float min[3] = {v.x_min, v.y_min, v.z_min};
+    const Float max[3] = {v.x_max, v.y_max, v.z_max};
+    
+    int i;
+    for(i = 0; i < 3; i++) {
+        Float t0 = (min[i] - ray->start[i]) * ray->inv_dir[i];
+        Float t1 = (max[i] - ray->start[i]) * ray->inv_dir[i];
+        
+        if(ray->inv_dir[i] < 0) {
+            const Float t = t0;
+            t0 = t1;
+            t1 = t;
+        }
+        
+        // NaN (ray lies in the plane of side) doesn't change the interval
+        *t_min = (t0 > *t_min) ? t0 : *t_min;
+        *t_max = (t1 < *t_max) ? t1 : *t_max;
+    }
+    return *t_min <= *t_max;
+}
+
+/*
+ * Starts the new traversal: entries with the other stamp are not valid
+ */
+static inline Mailbox *
+tree_mailbox(const KDTree * const tree) {
+    return (tree->mesh) ? &mesh_mailbox : &objects_mailbox;
+}
+
+static inline void
+new_mailbox_stamp(Mailbox * const mailbox) {
+    if(!++mailbox->stamp) {
+        // Stamps are reused after overflow
+        memset(mailbox->entries, 0, sizeof(mailbox->entries));
+        mailbox->stamp = 1;
+    }
+}
+
+/*
+ * Returns rays of mask, which haven't tested object yet, and marks them.
+ * Colliding object replaces the entry, so object can be tested twice
+ */
+static inline int
+mailbox_untested(Mailbox * const mailbox,
+                 const int index,
+                 const int mask) {
+    
+    MailboxEntry * const entry = &mailbox->entries[index & (MAILBOX_SIZE - 1)];
+    
+    if((entry->stamp != mailbox->stamp) || (entry->index != index)) {
+        entry->stamp = mailbox->stamp;
+        entry->index = index;
+        entry->mask = mask;
+        return mask;
+    }
+    
+    const int untested = mask & ~entry->mask;
+    entry->mask |= mask;
+    return untested;
+}
+
+static inline void
+new_kd_packet(const RayPacket * const packet,
+              KDPacket * const p) {
+    
+    p->start[0] = packet->start.x;
+    p->start[1] = packet->start.y;
+    p->start[2] = packet->start.z;
+    
+    p->dir[0] = packet->vector.x;
+    p->dir[1] = packet->vector.y;
+    p->dir[2] = packet->vector.z;
+    
+    p->inv_dir[0] = 1 / packet->vector.x;
+    p->inv_dir[1] = 1 / packet->vector.y;
+    p->inv_dir[2] = 1 / packet->vector.z;
+    
+    int r;
+    for(r = 0; r < PACKET_SIZE; r++) {
+        p->starts[r] = point3d(packet->start.x[r], packet->start.y[r], packet->start.z[r]);
+        p->vectors[r] = vector3df(packet->vector.x[r], packet->vector.y[r], packet->vector.z[r]);
+        p->rays[r] = new_kd_ray(p->starts[r], p->vectors[r]);
+    }
+}
+
+/*
+ * Clips interval of each ray of mask by voxel.
+ * Returns mask of rays, which cross voxel
+ */
+static inline int
+clip_packet_by_voxel(const KDPacket * const p,
+                     const int mask,
+                     const Voxel v,
+                     PacketFloat * const t_min,
+                     PacketFloat * const t_max) {
+    
+    int result = 0;
+    int r;
+    for(r = 0; r < PACKET_SIZE; r++) {
+        Float ray_t_min = (*t_min)[r];
+        Float ray_t_max = (*t_max)[r];
+        
+        if((mask & (1 << r)) && clip_ray_by_voxel(&p->rays[r], v, &ray_t_min, &ray_t_max))
+            result |= 1 << r;
+        
+        (*t_min)[r] = ray_t_min;
+        (*t_max)[r] = ray_t_max;
+    }
+    return result;
+}
+
+/*
+ * find_leaf for all rays of mask at once. Mask is narrowed to the rays,
+ * which cross the leaf. Returns inner node, if rays of mask
+ * are at the different sides of its plane
+ */
+static inline const KDNode *
+find_packet_leaf(const KDNode * const nodes,
+                 const KDNode * node,
+                 const KDPacket * const p,
+                 int * const mask,
+                 PacketFloat * const t_min,
+                 PacketFloat * const t_max,
+                 PacketTraversalEntry * const stack,
+                 int * const stack_size) {
+    
+    enum Plane plane;
+    while((plane = node->flags & NODE_PLANE_MASK) != NONE) {
+        // XY - z, XZ - y, YZ - x
+        const int axis = 2 - plane;
+        const Float split = node->data.split;
+        const PacketFloat start = p->start[axis];
+        const PacketFloat t_split = (split - start) * p->inv_dir[axis];
+        
+        const int below = *mask & packet_mask_bits((start < split)
+                                                   | ((start == split) & (p->dir[axis] <= 0)));
+        if(below && (below != *mask))
+            return node;
+        
+        const KDNode * children = nodes + (node->flags >> NODE_PLANE_BITS);
+        const KDNode * near_node = children + !below;
+        const KDNode * far_node = children + !!below;
+        
+        // The same choice, as in find_leaf, for each ray
+        const PacketMask near_only = ~(t_split <= *t_max) | (t_split <= 0);
+        const PacketMask far_only = ~near_only & (t_split < *t_min);
+        const PacketMask both = ~near_only & ~far_only;
+        
+        const int near_mask = *mask & ~packet_mask_bits(far_only);
+        const int far_mask = *mask & ~packet_mask_bits(near_only);
+        
+        if(!near_mask) {
+            node = far_node;
+            *mask = far_mask;
+            continue;
+        }
+        
+        if(far_mask) {
+            stack[*stack_size].node = far_node - nodes;
+            stack[*stack_size].mask = far_mask;
+            stack[*stack_size].t_min = packet_select(both, t_split, *t_min);
+            stack[*stack_size].t_max = *t_max;
+            (*stack_size)++;
+            
+            *t_max = packet_select(both, t_split, *t_max);
+        }
+        
+        node = near_node;
+        *mask = near_mask;
+    }
+    return node;
+}
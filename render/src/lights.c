@@ -0,0 +1,457 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include <render.h>
+#include <lights.h>
+#include <utils.h>
+
+// Bounds of cosines and radiuses of spheres are extended by this value,
+// so rounding never culls light, which contributes
+#define LIGHT_BOUND_PADDING 1e-4
+
+// Declarations
+// --------------------------------------------------------------
+
+static int
+build_light_node(LightTree * const tree,
+                 LightSource3d ** light_sources,
+                 const int first,
+                 const int count);
+
+static inline Float
+light_coordinate(const LightSource3d * const light_source,
+                 const int axis);
+
+static inline void
+select_median(LightSource3d ** light_sources,
+              int * const indexes,
+              const int count,
+              const int axis);
+
+// Directions from the point to the lights of node
+typedef
+struct {
+    Vector3d axis;
+    Float inv_dist;
+    
+    // Half-angle
+    Float sin;
+    Float cos;
+}
+LightCone;
+
+static inline Boolean
+light_cone(const LightTreeNode * const node,
+           const Point3d point,
+           LightCone * const cone);
+
+static inline Float
+max_cos(const LightCone * const cone,
+        const Float cos_axis);
+
+static inline Float
+min_cos(const LightCone * const cone,
+        const Float cos_axis);
+
+static inline Float
+max_specular(const LightCone * const cone,
+             const LightsQuery * const query);
+
+static inline void
+contribution_bounds(const LightTreeNode * const node,
+                    const LightsQuery * const query,
+                    Float * const min_contribution,
+                    Float * const max_contribution);
+
+static inline Float
+importance(const LightTreeNode * const node,
+           const LightsQuery * const query);
+
+static inline Float
+random_number(const Point3d point,
+              const int sample);
+
+// Code
+// --------------------------------------------------------------
+
+LightTree *
+build_light_tree(LightSource3d ** light_sources,
+                 const int light_sources_count) {
+    
+    LightTree * tree = malloc(sizeof(LightTree));
+    tree->lights = malloc((light_sources_count ? light_sources_count : 1) * sizeof(int));
+    tree->lights_count = 0;
+    int i;
+    
+    // Array of scene can have empty slots
+    for(i = 0; i < light_sources_count; i++) {
+        if(light_sources[i]) {
+            tree->lights[tree->lights_count++] = i;
+        }
+    }
+    
+    const int count = tree->lights_count;
+    tree->nodes = malloc((count ? 2 * count - 1 : 1) * sizeof(LightTreeNode));
+    tree->nodes_count = 0;
+    if(count) {
+        build_light_node(tree, light_sources, 0, count);
+    }
+    return tree;
+}
+
+void
+release_light_tree(LightTree * tree) {
+    free(tree->nodes);
+    free(tree->lights);
+    free(tree);
+}
+
+/*
+ * Lights are split by the median of the longest axis of their box
+ */
+static int
+build_light_node(LightTree * const tree,
+                 LightSource3d ** light_sources,
+                 const int first,
+                 const int count) {
+    
+    int * const indexes = tree->lights + first;
+    const int node_index = tree->nodes_count++;
+    LightTreeNode * node = &tree->nodes[node_index];
+    node->first = first;
+    node->count = count;
+    
+    if(count == 1) {
+        const LightSource3d * ls = light_sources[indexes[0]];
+        const Color c = ls->color;
+        const Float intensity = (c.r > c.g) ? ((c.r > c.b) ? c.r : c.b) : ((c.g > c.b) ? c.g : c.b);
+        
+        node->center = ls->location;
+        node->radius = 0;
+        node->max_intensity = intensity;
+        node->min_intensity = intensity;
+        node->intensity = intensity;
+        node->right = -1;
+        return node_index;
+    }
+    
+    Float min[3] = {FLOAT_MAX, FLOAT_MAX, FLOAT_MAX};
+    Float max[3] = {-FLOAT_MAX, -FLOAT_MAX, -FLOAT_MAX};
+    int axis;
+    int i;
+    for(i = 0; i < count; i++) {
+        for(axis = 0; axis < 3; axis++) {
+            const Float x = light_coordinate(light_sources[indexes[i]], axis);
+            min[axis] = (x < min[axis]) ? x : min[axis];
+            max[axis] = (x > max[axis]) ? x : max[axis];
+        }
+    }
+    
+    axis = 0;
+    for(i = 1; i < 3; i++) {
+        if(max[i] - min[i] > max[axis] - min[axis])
+            axis = i;
+    }
+    
+    select_median(light_sources, indexes, count, axis);
+    
+    const int left_index = build_light_node(tree, light_sources, first, count / 2);
+    const int right_index = build_light_node(tree, light_sources, first + count / 2, count - count / 2);
+    
+    // Nodes array isn't reallocated, but node is written after its children
+    const LightTreeNode * l = &tree->nodes[left_index];
+    const LightTreeNode * r = &tree->nodes[right_index];
+    node = &tree->nodes[node_index];
+    
+    // Sphere around the box
+    const Vector3d half_diagonal = vector3df((max[0] - min[0]) / 2, (max[1] - min[1]) / 2, (max[2] - min[2]) / 2);
+    node->center = point3d(min[0] + half_diagonal.x, min[1] + half_diagonal.y, min[2] + half_diagonal.z);
+    node->radius = module_vector(half_diagonal) * (1 + LIGHT_BOUND_PADDING);
+    node->max_intensity = (l->max_intensity > r->max_intensity) ? l->max_intensity : r->max_intensity;
+    node->min_intensity = (l->min_intensity < r->min_intensity) ? l->min_intensity : r->min_intensity;
+    node->intensity = l->intensity + r->intensity;
+    node->right = right_index;
+    return node_index;
+}
+
+static inline Float
+light_coordinate(const LightSource3d * const light_source,
+                 const int axis) {
+    
+    return (axis == 0) ? light_source->location.x
+                       : ((axis == 1) ? light_source->location.y : light_source->location.z);
+}
+
+/*
+ * Quickselect: lights, which are closer than median along the axis,
+ * are moved to the first half of indexes
+ */
+static inline void
+select_median(LightSource3d ** light_sources,
+              int * const indexes,
+              const int count,
+              const int axis) {
+    
+    const int k = count / 2;
+    int from = 0;
+    int to = count - 1;
+    
+    while(from < to) {
+        const Float pivot = light_coordinate(light_sources[indexes[(from + to) / 2]], axis);
+        int i = from;
+        int j = to;
+        
+        while(i <= j) {
+            while(light_coordinate(light_sources[indexes[i]], axis) < pivot)
+                i++;
+            while(light_coordinate(light_sources[indexes[j]], axis) > pivot)
+                j--;
+            if(i <= j) {
+                const int tmp = indexes[i];
+                indexes[i] = indexes[j];
+                indexes[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+        
+        if(k <= j) {
+            to = j;
+        } else if(k >= i) {
+            from = i;
+        } else {
+            break;
+        }
+    }
+}
+
+void
+start_lights_culling(LightsCulling * const culling,
+                     const LightTree * const tree,
+                     const LightsQuery * const query,
+                     const Float threshold) {
+    
+    culling->tree = tree;
+    culling->query = query;
+    culling->threshold = threshold;
+    culling->stack_size = 0;
+    culling->next = 0;
+    culling->end = 0;
+    if(tree->nodes_count) {
+        culling->stack[culling->stack_size++] = 0;
+    }
+}
+
+/*
+ * Subtree is skipped, if none of its lights can reach the threshold,
+ * and all its lights are taken, if each of them reaches it
+ */
+int
+next_light(LightsCulling * const culling) {
+    const LightTreeNode * nodes = culling->tree->nodes;
+    Float min_contribution;
+    Float max_contribution;
+    
+    if(culling->next < culling->end)
+        return culling->tree->lights[culling->next++];
+    
+    while(culling->stack_size) {
+        int node_index = culling->stack[--culling->stack_size];
+        
+        while(True) {
+            const LightTreeNode * node = &nodes[node_index];
+            contribution_bounds(node, culling->query, &min_contribution, &max_contribution);
+            
+            if(max_contribution < culling->threshold)
+                break;
+            
+            if((node->right < 0) || (min_contribution >= culling->threshold)) {
+                culling->next = node->first + 1;
+                culling->end = node->first + node->count;
+                return culling->tree->lights[node->first];
+            }
+            
+            culling->stack[culling->stack_size++] = node->right;
+            node_index++;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Random number selects the child of each node and then it is rescaled,
+ * so the single number is enough for the whole path from the root to the leaf
+ */
+int
+sample_light(const LightTree * const tree,
+             const LightsQuery * const query,
+             const int sample,
+             Float * const probability) {
+    
+    const LightTreeNode * nodes = tree->nodes;
+    Float u = random_number(query->point, sample);
+    Float p = 1;
+    int node_index = 0;
+    
+    if(!tree->nodes_count || (importance(&nodes[0], query) <= 0))
+        return -1;
+    
+    while(nodes[node_index].right >= 0) {
+        const Float l = importance(&nodes[node_index + 1], query);
+        const Float r = importance(&nodes[nodes[node_index].right], query);
+        
+        // Bound of parent is looser than bounds of children
+        if(l + r <= 0)
+            return -1;
+        
+        const Float p_l = l / (l + r);
+        
+        if(u < p_l) {
+            u = u / p_l;
+            p *= p_l;
+            node_index++;
+        } else {
+            u = (u - p_l) / (1 - p_l);
+            p *= 1 - p_l;
+            node_index = nodes[node_index].right;
+        }
+        u = (u < 1) ? u : 0;
+    }
+    
+    *probability = p;
+    return tree->lights[nodes[node_index].first];
+}
+
+/*
+ * Lights of node are bounded by sphere, so directions from the point to them
+ * lie inside the cone. False, if the point is inside the sphere
+ */
+static inline Boolean
+light_cone(const LightTreeNode * const node,
+           const Point3d point,
+           LightCone * const cone) {
+    
+    cone->axis = vector3dp(point, node->center);
+    
+    const Float sqr_dist = sqr_module_vector(cone->axis);
+    if(sqr_dist <= node->radius * node->radius)
+        return False;
+    
+    cone->inv_dist = 1 / sqrt(sqr_dist);
+    cone->sin = node->radius * cone->inv_dist;
+    cone->cos = sqrt(1 - cone->sin * cone->sin);
+    return True;
+}
+
+/*
+ * Angle between vector and any direction of the cone is not less than
+ * angle to the axis of cone (its cos is given) minus half-angle of cone
+ */
+static inline Float
+max_cos(const LightCone * const cone,
+        const Float cos_axis) {
+    
+    if(!cone->sin)
+        return cos_axis + LIGHT_BOUND_PADDING;
+    if(cos_axis >= cone->cos)
+        return 1;
+    return cos_axis * cone->cos + sqrt(fabs(1 - cos_axis * cos_axis)) * cone->sin + LIGHT_BOUND_PADDING;
+}
+
+/*
+ * ... and not greater than angle to the axis plus half-angle.
+ * Cos of angle, which exceeds right angle, is bounded by 0
+ */
+static inline Float
+min_cos(const LightCone * const cone,
+        const Float cos_axis) {
+    
+    const Float c = cos_axis * cone->cos - sqrt(fabs(1 - cos_axis * cos_axis)) * cone->sin - LIGHT_BOUND_PADDING;
+    return (c > 0) ? c : 0;
+}
+
+static inline Float
+max_specular(const LightCone * const cone,
+             const LightsQuery * const query) {
+    
+    const Float cos_ls = max_cos(cone, dot_product(query->reflected_ray, cone->axis) * cone->inv_dist);
+    if(cos_ls <= EPSILON)
+        return 0;
+    return pow((cos_ls < 1) ? cos_ls : 1, query->material->p);
+}
+
+/*
+ * Bounds of the largest value, which light of node adds to a channel
+ * of diffuse or specular color (as it is calculated by tracer).
+ * Only diffuse color is taken into account by the lower bound
+ */
+static inline void
+contribution_bounds(const LightTreeNode * const node,
+                    const LightsQuery * const query,
+                    Float * const min_contribution,
+                    Float * const max_contribution) {
+    
+    LightCone cone;
+    *min_contribution = 0;
+    *max_contribution = node->max_intensity;
+    if(!light_cone(node, query->point, &cone))
+        return;
+    
+    Float k = 0;
+    if(query->material->Kd) {
+        const Float cos_axis = fabs(dot_product(query->norm, cone.axis) * cone.inv_dist);
+        k = max_cos(&cone, cos_axis);
+        *min_contribution = node->min_intensity * min_cos(&cone, cos_axis);
+    }
+    if(query->material->Ks && (k < 1)) {
+        const Float specular = max_specular(&cone, query);
+        k = (specular > k) ? specular : k;
+    }
+    *max_contribution = node->max_intensity * ((k < 1) ? k : 1);
+}
+
+/*
+ * Bound of the sum of contributions of lights of node to the color of hit
+ */
+static inline Float
+importance(const LightTreeNode * const node,
+           const LightsQuery * const query) {
+    
+    LightCone cone;
+    if(!light_cone(node, query->point, &cone))
+        return node->intensity * (query->material->Kd + query->material->Ks);
+    
+    Float k = 0;
+    if(query->material->Kd) {
+        const Float diffuse = max_cos(&cone, fabs(dot_product(query->norm, cone.axis) * cone.inv_dist));
+        k += query->material->Kd * ((diffuse < 1) ? diffuse : 1);
+    }
+    if(query->material->Ks) {
+        k += query->material->Ks * max_specular(&cone, query);
+    }
+    return node->intensity * k;
+}
+
+/*
+ * Number from [0, 1), which is hashed from the bits of point (FNV-1a)
+ * and of the number of sample (MurmurHash3 finalizer)
+ */
+static inline Float
+random_number(const Point3d point,
+              const int sample) {
+    
+    const unsigned char * bytes = (const unsigned char *) &point;
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t i;
+    for(i = 0; i < sizeof(Point3d); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    hash ^= (unsigned long long) sample << 32;
+    
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return (hash >> 40) / (Float) (1 << 24);
+}
@@ -32,9 +32,36 @@ parse_face_str(char * str,
                int * vt_index,
                int * vn_index);
 
+static inline void
+add_face(const SceneFaceHandlerParams * const params,
+         Object3d * const face);
+
+static void
+add_triangle_mesh_faces(const SceneFaceHandlerParams * const params,
+                        Queue * face_vertexes,
+                        Queue * face_norm_vectors);
+
+static inline int
+add_triangle_mesh_face_vertex(const SceneFaceHandlerParams * const params,
+                              const Point3d * const p,
+                              const Vector3d * const n);
+
+static inline Point3d
+transform_point(const SceneFaceHandlerParams * const params,
+                const Point3d p);
+
+static inline Vector3d
+transform_vector(const SceneFaceHandlerParams * const params,
+                 const Vector3d v);
+
 static Point3d vertexes[MAX_VERTEX_COUNT];
 static Vector3d norm_vectors[MAX_VERTEX_COUNT];
 
+// For each vertex of file: index of vertex of the indexed mesh plus 1 (0 - not added yet)
+// and index of normal plus 1 (0 - without normal), which it was added with
+static int triangle_mesh_vertexes[MAX_VERTEX_COUNT];
+static int triangle_mesh_norms[MAX_VERTEX_COUNT];
+
 // TODO: use LinkedList instead of arrays
 
 void
@@ -47,6 +74,10 @@ load_obj(const char * filename,
     int vertexes_cnt = 0;
     int norm_vectors_cnt = 0;
     
+    // Vertexes of the previous file are not shared
+    memset(triangle_mesh_vertexes, 0, sizeof(triangle_mesh_vertexes));
+    memset(triangle_mesh_norms, 0, sizeof(triangle_mesh_norms));
+    
     FILE * fp = fopen(filename, "r");
     
     char * line = NULL;
@@ -75,13 +106,13 @@ load_obj(const char * filename,
 void
 parse_vertex(const char * str,
              Point3d * v) {
-    sscanf(str, "%lf %lf %lf", &v->y, &v->z, &v->x);
+    sscanf(str, FLOAT_FORMAT FLOAT_FORMAT FLOAT_FORMAT, &v->y, &v->z, &v->x);
 }
 
 void
 parse_norm_vector(const char * str,
                   Vector3d * v) {
-    sscanf(str, "%lf %lf %lf", &v->y, &v->z, &v->x);
+    sscanf(str, FLOAT_FORMAT FLOAT_FORMAT FLOAT_FORMAT, &v->y, &v->z, &v->x);
 }
 
 void
@@ -177,13 +208,27 @@ parse_face_str(char * str,
         *vn_index = atoi(str);
 }
 
+static inline void
+add_face(const SceneFaceHandlerParams * const params,
+         Object3d * const face) {
+    
+    if(params->mesh)
+        add_mesh_object(params->mesh, face);
+    else
+        add_object(params->scene, face);
+}
+
 void
 scene_face_handler(Queue * vertexes,
                    Queue * norm_vectors,
                    void * arg) {
     SceneFaceHandlerParams * params = (SceneFaceHandlerParams *) arg;
     
-    Scene * scene = params->scene;
+    if(params->triangle_mesh) {
+        add_triangle_mesh_faces(params, vertexes, norm_vectors);
+        return;
+    }
+    
     Float scale = params->scale;
     Float dx = params->dx;
     Float dy = params->dy;
@@ -247,25 +292,102 @@ scene_face_handler(Queue * vertexes,
             v3 = rotate_vector_y(v3, sin_al_y, cos_al_y);
             v3 = rotate_vector_z(v3, sin_al_z, cos_al_z);
             
-            add_object(scene, new_triangle_with_norms(
-                                                      point3d(p1.x * scale + dx, p1.y * scale + dy, p1.z * scale + dz),
-                                                      point3d(p2.x * scale + dx, p2.y * scale + dy, p2.z * scale + dz),
-                                                      point3d(p3.x * scale + dx, p3.y * scale + dy, p3.z * scale + dz),
-                                                      v1,
-                                                      v2,
-                                                      v3,
-                                                      default_color,
-                                                      default_material));
+            add_face(params, new_triangle_with_norms(
+                                                     point3d(p1.x * scale + dx, p1.y * scale + dy, p1.z * scale + dz),
+                                                     point3d(p2.x * scale + dx, p2.y * scale + dy, p2.z * scale + dz),
+                                                     point3d(p3.x * scale + dx, p3.y * scale + dy, p3.z * scale + dz),
+                                                     v1,
+                                                     v2,
+                                                     v3,
+                                                     default_color,
+                                                     default_material));
         } else {
-            add_object(scene, new_triangle(
-                                           point3d(p1.x * scale + dx, p1.y * scale + dy, p1.z * scale + dz),
-                                           point3d(p2.x * scale + dx, p2.y * scale + dy, p2.z * scale + dz),
-                                           point3d(p3.x * scale + dx, p3.y * scale + dy, p3.z * scale + dz),
-                                           default_color,
-                                           default_material));
+            add_face(params, new_triangle(
+                                          point3d(p1.x * scale + dx, p1.y * scale + dy, p1.z * scale + dz),
+                                          point3d(p2.x * scale + dx, p2.y * scale + dy, p2.z * scale + dz),
+                                          point3d(p3.x * scale + dx, p3.y * scale + dy, p3.z * scale + dz),
+                                          default_color,
+                                          default_material));
         }
         
         p_p2 = p_p3;
         p_v2 = p_v3;
     }
-}
\ No newline at end of file
+}
+
+static void
+add_triangle_mesh_faces(const SceneFaceHandlerParams * const params,
+                        Queue * face_vertexes,
+                        Queue * face_norm_vectors) {
+    
+    const Point3d * p1 = (Point3d *) get(face_vertexes);
+    const Point3d * p2 = (Point3d *) get(face_vertexes);
+    const Point3d * p3 = NULL;
+    
+    const Vector3d * n1 = (Vector3d *) get(face_norm_vectors);
+    const Vector3d * n2 = (Vector3d *) get(face_norm_vectors);
+    const Vector3d * n3 = NULL;
+    
+    while(!is_empty(face_vertexes)) {
+        p3 = (Point3d *) get(face_vertexes);
+        n3 = (Vector3d *) get(face_norm_vectors);
+        
+        // Normals are used only if all vertexes have them (as by scene_face_handler)
+        const Boolean with_norms = n1 && n2 && n3;
+        
+        const int v1 = add_triangle_mesh_face_vertex(params, p1, (with_norms) ? n1 : NULL);
+        const int v2 = add_triangle_mesh_face_vertex(params, p2, (with_norms) ? n2 : NULL);
+        const int v3 = add_triangle_mesh_face_vertex(params, p3, (with_norms) ? n3 : NULL);
+        
+        add_triangle_mesh_triangle(params->triangle_mesh, v1, v2, v3, params->triangle_mesh_material);
+        
+        p2 = p3;
+        n2 = n3;
+    }
+}
+
+static inline int
+add_triangle_mesh_face_vertex(const SceneFaceHandlerParams * const params,
+                              const Point3d * const p,
+                              const Vector3d * const n) {
+    
+    const int p_index = p - vertexes;
+    const int n_key = (n) ? n - norm_vectors + 1 : 0;
+    
+    if(triangle_mesh_vertexes[p_index] && (triangle_mesh_norms[p_index] == n_key))
+        return triangle_mesh_vertexes[p_index] - 1;
+    
+    // Zero normal makes triangle flat
+    const int index = add_triangle_mesh_vertex(params->triangle_mesh,
+                                               transform_point(params, *p),
+                                               (n) ? transform_vector(params, *n) : vector3df(0, 0, 0),
+                                               point2d(0, 0));
+    
+    if(!triangle_mesh_vertexes[p_index]) {
+        triangle_mesh_vertexes[p_index] = index + 1;
+        triangle_mesh_norms[p_index] = n_key;
+    }
+    return index;
+}
+
+static inline Point3d
+transform_point(const SceneFaceHandlerParams * const params,
+                const Point3d p) {
+    
+    Point3d r = rotate_point_x(p, params->sin_al_x, params->cos_al_x);
+    r = rotate_point_y(r, params->sin_al_y, params->cos_al_y);
+    r = rotate_point_z(r, params->sin_al_z, params->cos_al_z);
+    
+    return point3d(r.x * params->scale + params->dx,
+                   r.y * params->scale + params->dy,
+                   r.z * params->scale + params->dz);
+}
+
+static inline Vector3d
+transform_vector(const SceneFaceHandlerParams * const params,
+                 const Vector3d v) {
+    
+    Vector3d r = rotate_vector_x(v, params->sin_al_x, params->cos_al_x);
+    r = rotate_vector_y(r, params->sin_al_y, params->cos_al_y);
+    return rotate_vector_z(r, params->sin_al_z, params->cos_al_z);
+}
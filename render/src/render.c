@@ -4,6 +4,7 @@
 #include <render.h>
 #include <canvas.h>
 #include <color.h>
+#include <utils.h>
 
 #define ANTIALIASING 1
 
@@ -11,18 +12,79 @@
 
 #define CHUNK 10
 
+// Primary rays of block of pixels are traced as packet
+#define PACKET_WIDTH 2
+#define PACKET_HEIGHT (PACKET_SIZE / PACKET_WIDTH)
+
+// Wavefront rendering traces tiles of pixels, size is a multiple of blocks of packets
+#ifndef TILE_SIZE
+    #define TILE_SIZE 16
+#endif // TILE_SIZE
+
 /* collapse is a feature from OpenMP 3 (2008) */
 #if _OPENMP < 200805
     #define collapse(x) 
 #endif
 
 #ifdef RAY_INTERSECTIONS_STAT
-extern long
+long
 intersections_per_ray;
+
+long
+shadow_rays;
 #endif // RAY_INTERSECTIONS_STAT
 
 #include <stdio.h>
 
+/*
+ * Tiles of TILE_SIZE x TILE_SIZE pixels are traced by trace_wavefront.
+ * Rays of each block of PACKET_WIDTH x PACKET_HEIGHT pixels are consecutive,
+ * so the first stage traces the same packets as trace_packet
+ */
+static void
+render_wavefront(const Scene * const scene,
+                 const Camera * const camera,
+                 Canvas * canvas) {
+    
+    const int w = canvas->w;
+    const int h = canvas->h;
+    
+    int i;
+    int j;
+    #pragma omp parallel private(i, j)
+    #pragma omp for collapse(2) schedule(dynamic, 1)
+    for(i = 0; i < w; i += TILE_SIZE) {
+        for(j = 0; j < h; j += TILE_SIZE) {
+            Vector3d rays[TILE_SIZE * TILE_SIZE];
+            Color colors[TILE_SIZE * TILE_SIZE];
+            int count = 0;
+            int x;
+            int y;
+            int k;
+            
+            for(x = i; (x < i + TILE_SIZE) && (x < w); x += PACKET_WIDTH) {
+                for(y = j; (y < j + TILE_SIZE) && (y < h); y += PACKET_HEIGHT) {
+                    for(k = 0; k < PACKET_SIZE; k++) {
+                        rays[count++] = camera_ray_vector(camera, x + k % PACKET_WIDTH, y + k / PACKET_WIDTH, w, h);
+                    }
+                }
+            }
+            
+            trace_wavefront(scene, camera, rays, count, colors);
+            
+            // Block can be cut by the border of canvas
+            count = 0;
+            for(x = i; (x < i + TILE_SIZE) && (x < w); x += PACKET_WIDTH) {
+                for(y = j; (y < j + TILE_SIZE) && (y < h); y += PACKET_HEIGHT) {
+                    for(k = 0; k < PACKET_SIZE; k++, count++) {
+                        if((x + k % PACKET_WIDTH < w) && (y + k / PACKET_WIDTH < h))
+                            set_pixel(x + k % PACKET_WIDTH, y + k / PACKET_WIDTH, colors[count], canvas);
+                    }
+                }
+            }
+        }
+    }
+}
 
 void
 render_scene(const Scene * const scene,
@@ -32,9 +94,6 @@ render_scene(const Scene * const scene,
     
     const int w = canvas->w;
     const int h = canvas->h;
-    const Float dx = w / 2.0;
-    const Float dy = h / 2.0;
-    const Float focus = camera->proj_plane_dist;
     
     // TODO: consider possibility to define these OpenMP parameters
     // in declarative style (using directives of preprocessor)
@@ -46,19 +105,34 @@ render_scene(const Scene * const scene,
     // in case of incrementing this variable
     omp_set_num_threads(1);
     intersections_per_ray = 0;
+    shadow_rays = 0;
     #endif // RAY_INTERSECTIONS_STAT
     
     int i;
     int j;
-    #pragma omp parallel private(i, j)
-    #pragma omp for collapse(2) schedule(dynamic, CHUNK)
-    for(i = 0; i < w; i++) {
-        for(j = 0; j < h; j++) {
-            const Float x = i - dx;
-            const Float y = j - dy;
-            const Vector3d ray = vector3df(x, y, focus);
-            const Color col = trace(scene, camera, ray);
-            set_pixel(i, j, col, canvas);
+    if(scene->rendering_mode == WAVEFRONT_RENDERING) {
+        render_wavefront(scene, camera, canvas);
+    } else {
+        #pragma omp parallel private(i, j)
+        #pragma omp for collapse(2) schedule(dynamic, CHUNK)
+        for(i = 0; i < w; i += PACKET_WIDTH) {
+            for(j = 0; j < h; j += PACKET_HEIGHT) {
+                Vector3d rays[PACKET_SIZE];
+                Color colors[PACKET_SIZE];
+                int k;
+                
+                for(k = 0; k < PACKET_SIZE; k++) {
+                    rays[k] = camera_ray_vector(camera, i + k % PACKET_WIDTH, j + k / PACKET_WIDTH, w, h);
+                }
+                
+                trace_packet(scene, camera, rays, colors);
+                
+                // Block can be cut by the border of canvas
+                for(k = 0; k < PACKET_SIZE; k++) {
+                    if((i + k % PACKET_WIDTH < w) && (j + k / PACKET_WIDTH < h))
+                        set_pixel(i + k % PACKET_WIDTH, j + k / PACKET_WIDTH, colors[k], canvas);
+                }
+            }
         }
     }
     
@@ -74,19 +148,16 @@ render_scene(const Scene * const scene,
                 // edges canvas is grayscaled
                 // it means that color components (r, g, b) are equal
                 Byte gray = get_pixel(i, j, edges).r;
-            
+                
                 // TODO: improve
                 if(gray > 10) {
-                    const Float x = i - dx;
-                    const Float y = j - dy;
-                
                     Color c = get_pixel(i, j, canvas);
                 
                     const Float weight = 1.0 / 4;
                     c = mul_color(c, weight);
-                    c = add_colors(c, mul_color(trace(scene, camera, vector3df(x + 0.5, y, focus)), weight));
-                    c = add_colors(c, mul_color(trace(scene, camera, vector3df(x, y + 0.5, focus)), weight));
-                    c = add_colors(c, mul_color(trace(scene, camera, vector3df(x + 0.5, y + 0.5, focus)), weight));
+                    c = add_colors(c, mul_color(trace(scene, camera, camera_ray_vector(camera, i + 0.5, j, w, h)), weight));
+                    c = add_colors(c, mul_color(trace(scene, camera, camera_ray_vector(camera, i, j + 0.5, w, h)), weight));
+                    c = add_colors(c, mul_color(trace(scene, camera, camera_ray_vector(camera, i + 0.5, j + 0.5, w, h)), weight));
                 
                     set_pixel(i, j, c, canvas);
                 }
@@ -98,5 +169,6 @@ render_scene(const Scene * const scene,
     #ifdef RAY_INTERSECTIONS_STAT
     intersections_per_ray /= (w * h);
     printf("Average intersections number per pixel: %li\n", intersections_per_ray);
+    printf("Average shadow rays number per pixel: %.2f\n", (double) shadow_rays / (w * h));
     #endif // RAY_INTERSECTIONS_STAT
 }
\ No newline at end of file
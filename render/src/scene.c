@@ -2,11 +2,26 @@
 #include <stdio.h>
 #include <float.h>
 #include <math.h>
+#include <string.h>
 
 #include <render.h>
 #include <utils.h>
 #include <color.h>
 #include <kdtree.h>
+#include <bvh.h>
+#include <lights.h>
+
+// Tuner of kd-tree traces TUNER_RAYS x TUNER_RAYS primary rays
+#define TUNER_RAYS 64
+
+// Default limits of reflections
+#ifndef MAX_RAY_RECURSION_LEVEL
+    #define MAX_RAY_RECURSION_LEVEL 10
+#endif // MAX_RAY_RECURSION_LEVEL
+
+#ifndef THRESHOLD_RAY_INTENSITY
+    #define THRESHOLD_RAY_INTENSITY 10
+#endif // THRESHOLD_RAY_INTENSITY
 
 // Declarations
 // --------------------------------------------------------------
@@ -14,6 +29,12 @@
 static inline void
 rebuild_kd_tree(Scene * scene);
 
+static inline void
+rebuild_bvh(Scene * scene);
+
+static inline void
+rebuild_light_tree(Scene * scene);
+
 // Code
 // --------------------------------------------------------------
 
@@ -35,7 +56,21 @@ new_scene(const int objects_count,
     s->fog_parameters = NULL;
     s->fog_density = NULL;
     
+    s->acceleration_structure = KD_TREE_STRUCTURE;
     s->kd_tree = NULL;
+    s->bvh = NULL;
+    s->kd_tree_cache_file = NULL;
+    s->kd_tree_params = default_kd_tree_params();
+    
+    s->light_selection = ALL_LIGHTS;
+    s->light_tree = NULL;
+    s->lights_threshold = 1;
+    s->lights_per_hit = 1;
+    
+    // Level is clamped by the size of ray stack
+    set_reflections_limits(s, MAX_RAY_RECURSION_LEVEL, THRESHOLD_RAY_INTENSITY);
+    
+    s->rendering_mode = PACKET_RENDERING;
     return s;
 }
 
@@ -64,6 +99,12 @@ release_scene(Scene * scene) {
     
     if(scene->kd_tree)
         release_kd_tree(scene->kd_tree);
+    if(scene->bvh)
+        release_bvh(scene->bvh);
+    if(scene->light_tree)
+        release_light_tree(scene->light_tree);
+    if(scene->kd_tree_cache_file)
+        free(scene->kd_tree_cache_file);
     free(scene);
 }
 
@@ -72,11 +113,145 @@ add_object(Scene * const scene,
            Object3d * const object) {
     
     scene->objects[++scene->last_object_index] = object;
+    
+    if(scene->kd_tree
+       && insert_kd_tree_object(scene->kd_tree, scene->last_object_index)) {
+        rebuild_kd_tree(scene);
+    }
+    
+    if(scene->bvh
+       && insert_bvh_object(scene->bvh, scene->last_object_index)) {
+        rebuild_bvh(scene);
+    }
+}
+
+void
+remove_object(Scene * const scene,
+              Object3d * const object) {
+    
+    int i;
+    for(i = scene->last_object_index; (i >= 0) && (scene->objects[i] != object); i--);
+    if(i < 0)
+        return;
+    
+    Boolean rebuild = False;
+    if(scene->kd_tree)
+        rebuild = remove_kd_tree_object(scene->kd_tree, i);
+    
+    Boolean rebuild_hierarchy = False;
+    if(scene->bvh)
+        rebuild_hierarchy = remove_bvh_object(scene->bvh, i);
+    
+    scene->objects[i] = scene->objects[scene->last_object_index];
+    scene->objects[scene->last_object_index--] = NULL;
+    
+    if(rebuild)
+        rebuild_kd_tree(scene);
+    
+    if(rebuild_hierarchy)
+        rebuild_bvh(scene);
 }
 
 void
 prepare_scene(Scene * const scene) {
-    rebuild_kd_tree(scene);    
+    if(scene->acceleration_structure == BVH_STRUCTURE) {
+        if(scene->kd_tree) {
+            release_kd_tree(scene->kd_tree);
+            scene->kd_tree = NULL;
+        }
+        rebuild_bvh(scene);
+    } else {
+        if(scene->bvh) {
+            release_bvh(scene->bvh);
+            scene->bvh = NULL;
+        }
+        rebuild_kd_tree(scene);
+    }
+    
+    // Lights could be added or moved
+    if(scene->light_selection != ALL_LIGHTS)
+        rebuild_light_tree(scene);
+}
+
+void
+set_acceleration_structure(Scene * const scene,
+                           const enum AccelerationStructure structure) {
+    
+    scene->acceleration_structure = structure;
+}
+
+void
+set_rendering_mode(Scene * const scene,
+                   const enum RenderingMode mode) {
+    
+    scene->rendering_mode = mode;
+}
+
+void
+set_reflections_limits(Scene * const scene,
+                       const int max_recursion_level,
+                       const Float threshold_intensity) {
+    
+    scene->max_ray_recursion_level = (max_recursion_level < RAY_STACK_SIZE - 1)
+                                     ? max_recursion_level
+                                     : RAY_STACK_SIZE - 1;
+    scene->threshold_ray_intensity = threshold_intensity;
+}
+
+void
+set_kd_tree_cache(Scene * const scene,
+                  const char * const file_name) {
+    
+    if(scene->kd_tree_cache_file)
+        free(scene->kd_tree_cache_file);
+    
+    scene->kd_tree_cache_file = NULL;
+    if(file_name) {
+        scene->kd_tree_cache_file = malloc(strlen(file_name) + 1);
+        strcpy(scene->kd_tree_cache_file, file_name);
+    }
+}
+
+void
+set_kd_tree_params(Scene * const scene,
+                   const KDTreeParams params) {
+    
+    scene->kd_tree_params = params;
+    if(scene->kd_tree)
+        rebuild_kd_tree(scene);
+}
+
+KDTreeParams
+tune_kd_tree(Scene * const scene,
+             const Camera * const camera,
+             const int canvas_w,
+             const int canvas_h) {
+    
+    Point3d * starts = malloc(TUNER_RAYS * TUNER_RAYS * sizeof(Point3d));
+    Vector3d * vectors = malloc(TUNER_RAYS * TUNER_RAYS * sizeof(Vector3d));
+    
+    // Rays through the grid of pixels, as they are traced by render_scene
+    int i;
+    int j;
+    for(i = 0; i < TUNER_RAYS; i++) {
+        for(j = 0; j < TUNER_RAYS; j++) {
+            const Float x = (i + 0.5) * canvas_w / TUNER_RAYS;
+            const Float y = (j + 0.5) * canvas_h / TUNER_RAYS;
+            
+            starts[i * TUNER_RAYS + j] = camera->camera_position;
+            vectors[i * TUNER_RAYS + j] = camera_to_world_vector(camera, camera_ray_vector(camera, x, y, canvas_w, canvas_h));
+        }
+    }
+    
+    BoundingBoxes * boxes = new_bounding_boxes(scene->objects, scene->last_object_index + 1);
+    const KDTreeParams params = tune_kd_tree_params(scene->objects, boxes, starts, vectors,
+                                                    TUNER_RAYS * TUNER_RAYS);
+    release_bounding_boxes(boxes);
+    free(starts);
+    free(vectors);
+    
+    set_kd_tree_params(scene, params);
+    return params;
 }
 
 void
@@ -84,13 +259,79 @@ add_light_source(Scene * const scene,
                  LightSource3d * const light_source) {
     
     scene->light_sources[++scene->last_light_source_index] = light_source;
+    
+    // Tree isn't rebuilt for each light: adding of many lights would be quadratic
+    if(scene->light_tree) {
+        release_light_tree(scene->light_tree);
+        scene->light_tree = NULL;
+    }
+}
+
+void
+set_all_lights(Scene * const scene) {
+    scene->light_selection = ALL_LIGHTS;
+    if(scene->light_tree) {
+        release_light_tree(scene->light_tree);
+        scene->light_tree = NULL;
+    }
+}
+
+void
+set_lights_culling(Scene * const scene,
+                   const Float threshold) {
+    
+    scene->light_selection = CULLED_LIGHTS;
+    scene->lights_threshold = threshold;
+    rebuild_light_tree(scene);
+}
+
+void
+set_lights_sampling(Scene * const scene,
+                    const int lights_per_hit) {
+    
+    scene->light_selection = SAMPLED_LIGHTS;
+    scene->lights_per_hit = lights_per_hit;
+    rebuild_light_tree(scene);
 }
 
 static inline void
 rebuild_kd_tree(Scene * scene) {
     if(scene->kd_tree)
         release_kd_tree(scene->kd_tree);
-    scene->kd_tree = build_kd_tree(scene->objects, scene->last_object_index + 1);
+    
+    // Bounding boxes of objects are calculated only once
+    // and after that builder of kd-tree works only with them
+    BoundingBoxes * boxes = new_bounding_boxes(scene->objects, scene->last_object_index + 1);
+    
+    if(scene->kd_tree_cache_file) {
+        const unsigned long long key = kd_tree_key(scene->objects, boxes, &scene->kd_tree_params);
+        scene->kd_tree = load_kd_tree(scene->objects, boxes->count, &scene->kd_tree_params,
+                                      key, scene->kd_tree_cache_file);
+        
+        if(!scene->kd_tree) {
+            scene->kd_tree = build_kd_tree(scene->objects, boxes, &scene->kd_tree_params);
+            save_kd_tree(scene->kd_tree, key, scene->kd_tree_cache_file);
+        }
+    } else {
+        scene->kd_tree = build_kd_tree(scene->objects, boxes, &scene->kd_tree_params);
+    }
+    release_bounding_boxes(boxes);
+}
+
+static inline void
+rebuild_bvh(Scene * scene) {
+    if(scene->bvh)
+        release_bvh(scene->bvh);
+    
+    scene->bvh = build_bvh(scene->objects, scene->last_object_index + 1);
+}
+
+static inline void
+rebuild_light_tree(Scene * scene) {
+    if(scene->light_tree)
+        release_light_tree(scene->light_tree);
+    
+    scene->light_tree = build_light_tree(scene->light_sources, scene->last_light_source_index + 1);
 }
 
 void
@@ -3,6 +3,7 @@
 
 #include <render.h>
 #include <utils.h>
+#include <kdtree.h>
 
 // Declarations
 // --------------------------------------------------------------
@@ -20,7 +21,14 @@ static Boolean
 intersect_sphere(const void * data,
                  const Point3d vector_start,
                  const Vector3d vector,
-                 Point3d * const intersection_point);
+                 HitRecord * const hit);
+
+static inline Boolean
+intersect_sphere_geometry(const Point3d center,
+                          const Float r,
+                          const Point3d vector_start,
+                          const Vector3d vector,
+                          HitRecord * const hit);
 
 static Point3d
 get_min_sphere_boundary_point(const void * data);
@@ -30,15 +38,15 @@ get_max_sphere_boundary_point(const void * data);
 
 static Color
 get_sphere_color(const void * data,
-                 const Point3d intersection_point);
+                 const HitRecord * const hit);
 
 static Vector3d
 get_sphere_normal_vector(const void * data,
-                         const Point3d intersection_point);
+                         const HitRecord * const hit);
 
 static Material
 get_sphere_material(const void * data,
-                    const Point3d intersection_point);
+                    const HitRecord * const hit);
 
 void
 release_sphere_data(void * data);
@@ -60,6 +68,7 @@ new_sphere(const Point3d center,
     
     Object3d * obj = malloc(sizeof(Object3d));
     obj->data = sphere;
+    obj->type = SPHERE_OBJECT;
     obj->release_data = release_sphere_data;
 	obj->get_color = get_sphere_color;
 	obj->intersect = intersect_sphere;
@@ -67,29 +76,30 @@ new_sphere(const Point3d center,
     obj->get_material = get_sphere_material;
     obj->get_min_boundary_point = get_min_sphere_boundary_point;
     obj->get_max_boundary_point = get_max_sphere_boundary_point;
+    obj->clip_by_voxel = NULL;
+    obj->intersect_packet = NULL;
+    obj->is_intersected = NULL;
+    obj->is_intersected_packet = NULL;
     
     return obj;
 }
 
 static Color
 get_sphere_color(const void * data,
-                 const Point3d intersection_point) {
+                 const HitRecord * const hit) {
 	const Sphere * sphere = data;
 	return sphere->color;
 }
 
 static Vector3d
 get_sphere_normal_vector(const void * data,
-                         const Point3d intersection_point) {
-  	const Sphere * sphere = data;    
-    Vector3d n = vector3dp(sphere->center, intersection_point);
-    normalize_vector(&n);
-    return n;
+                         const HitRecord * const hit) {
+    return hit->norm;
 }
 
 static Material
 get_sphere_material(const void * data,
-                      const Point3d intersection_point) {
+                    const HitRecord * const hit) {
     const Sphere * sphere = data;
     return sphere->material;
 }
@@ -120,12 +130,43 @@ static Boolean
 intersect_sphere(const void * data,
                  const Point3d vector_start,
                  const Vector3d vector,
-                 Point3d * const intersection_point) {
+                 HitRecord * const hit) {
     
     const Sphere * sphere = data;
+    return intersect_sphere_geometry(sphere->center, sphere->radius, vector_start, vector, hit);
+}
+
+KDPrimitive
+new_sphere_primitive(const Object3d * const obj) {
+    const Sphere * sphere = obj->data;
     
-    const Point3d center = sphere->center;
-    const Float r = sphere->radius;
+    KDPrimitive primitive;
+    primitive.type = SPHERE_OBJECT;
+    primitive.data = sphere;
+    primitive.geometry.sphere.center = sphere->center;
+    primitive.geometry.sphere.radius = sphere->radius;
+    return primitive;
+}
+
+Boolean
+intersect_sphere_primitive(const KDPrimitive * const primitive,
+                           const Point3d vector_start,
+                           const Vector3d vector,
+                           HitRecord * const hit) {
+    
+    return intersect_sphere_geometry(primitive->geometry.sphere.center, primitive->geometry.sphere.radius,
+                                     vector_start, vector, hit);
+}
+
+/*
+ * Normal vector of hit goes from the center (its length is radius)
+ */
+static inline Boolean
+intersect_sphere_geometry(const Point3d center,
+                          const Float r,
+                          const Point3d vector_start,
+                          const Vector3d vector,
+                          HitRecord * const hit) {
     
     const Float a = vector.x * vector.x
                     + vector.y * vector.y
@@ -165,9 +206,11 @@ intersect_sphere(const void * data,
     if(t < EPSILON)
         return False;
     
-    *intersection_point = point3d(vector_start.x + t * vector.x,
-                                  vector_start.y + t * vector.y,
-                                  vector_start.z + t * vector.z);
+    hit->t = t;
+    hit->point = point3d(vector_start.x + t * vector.x,
+                         vector_start.y + t * vector.y,
+                         vector_start.z + t * vector.z);
+    hit->norm = vector3dp(center, hit->point);
     
     return True;
 }
\ No newline at end of file
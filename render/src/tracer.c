@@ -6,47 +6,176 @@
 #include <render.h>
 #include <utils.h>
 #include <kdtree.h>
+#include <bvh.h>
+#include <lights.h>
 #include <color.h>
 
 #define INITIAL_RAY_INTENSITY 100
-#define THRESHOLD_RAY_INTENSITY 10
-#define MAX_RAY_RECURSION_LEVEL 10
+
+// Visibility of light sources from intersection points of packet is found
+// by packets of shadow rays, when scene has no more light sources than this
+#ifndef MAX_PACKET_LIGHT_SOURCES
+    #define MAX_PACKET_LIGHT_SOURCES 16
+#endif // MAX_PACKET_LIGHT_SOURCES
 
 // Declarations
 // --------------------------------------------------------------
 
+// Hit of the chain of reflections: its color without reflection
+// and the way, how color of reflected ray is mixed into it
+typedef
+struct {
+    Color color;
+    Float Kr;
+    Float fog_density;
+}
+RayState;
+
+// Chain of reflections of the ray, which is being traced by thread
+static __thread RayState
+ray_stack[RAY_STACK_SIZE];
+
 Color
-trace_recursively(const Scene * const scene,
+trace_ray(const Scene * const scene,
+          const Point3d vector_start,
+          const Vector3d vector);
+
+static inline Color
+trace_reflections(const Scene * const scene,
+                  Point3d vector_start,
+                  Vector3d vector,
+                  Object3d * obj,
+                  HitRecord hit,
+                  const Boolean * lights_visibility);
+
+static inline Color
+mix_reflection(const Scene * const scene,
+               const RayState * const state,
+               const Color reflected_color);
+
+// Ray of the queue of wavefront: primary ray or reflection of its chain
+typedef
+struct {
+    // Index of primary ray
+    int index;
+    Float intensity;
+    
+    Point3d start;
+    Vector3d vector;
+    
+    Object3d * obj;
+    HitRecord hit;
+}
+QueuedRay;
+
+// Shadow ray from hit of ray of queue to the light, which is chosen for the hit.
+// Slot is the position of light in the order, in which lights are chosen
+typedef
+struct {
+    int ray;
+    int slot;
+    int light;
+}
+QueuedShadowRay;
+
+static inline int
+intersect_queue(const Scene * const scene,
+                QueuedRay * const queue,
+                const int queue_size);
+
+static inline int
+lights_slots_count(const Scene * const scene);
+
+static inline void
+get_lights_visibility_queue(const Scene * const scene,
+                            const QueuedRay * const queue,
+                            const int queue_size,
+                            const int slots_count,
+                            QueuedShadowRay * const shadow_queue,
+                            Boolean * const lights_visibility);
+
+static inline int
+queue_shadow_rays(const Scene * const scene,
+                  const QueuedRay * const ray,
+                  const int index,
+                  QueuedShadowRay * const shadow_queue);
+
+static int
+compare_shadow_rays(const void * a,
+                    const void * b);
+
+static inline Boolean
+uses_all_lights(const Scene * const scene);
+
+static inline LightsQuery
+new_lights_query(const HitRecord * const hit,
+                 const Vector3d norm_v,
+                 const Vector3d reflected_ray,
+                 const Material * const material);
+
+static inline Boolean
+find_intersection(const Scene * const scene,
                   const Point3d vector_start,
                   const Vector3d vector,
-                  const Float intensity,
-                  const int recursion_level);
+                  Object3d ** const nearest_obj_ptr,
+                  HitRecord * const nearest_hit);
+
+static inline int
+find_intersection_packet(const Scene * const scene,
+                         const RayPacket * const packet,
+                         const int mask,
+                         Object3d ** const nearest_objs,
+                         HitRecord * const nearest_hits);
+
+static inline int
+is_intersect_anything_packet(const Scene * const scene,
+                             const RayPacket * const packet,
+                             const int mask,
+                             const Float * const max_dists);
 
 inline Boolean
 is_viewable(const Point3d target_point,
             const Point3d starting_point,
             const Scene * const scene);
 
-inline Color
-get_lighting_color(const Point3d point,
-                   const Vector3d norm_v,
-                   const Scene * const scene);
+static inline void
+get_lights_visibility_packet(const Scene * const scene,
+                             const HitRecord * const hits,
+                             const int mask,
+                             Boolean lights_visibility[][MAX_PACKET_LIGHT_SOURCES]);
 
-inline Color
-get_specular_color(const Point3d point,
-                   const Vector3d reflected_ray,
-                   const Scene * const scene,
-                   const Float p);
+inline void
+get_lights_colors(const HitRecord * const hit,
+                  const Vector3d norm_v,
+                  const Vector3d reflected_ray,
+                  const Scene * const scene,
+                  const Material * const material,
+                  const Boolean * const lights_visibility,
+                  Color * const diffuse_light_color,
+                  Color * const specular_light_color);
 
-inline Color
+static inline Boolean
+is_lit(const HitRecord * const hit,
+       const LightSource3d * const ls,
+       const Scene * const scene);
+
+static inline void
+get_light_factors(const HitRecord * const hit,
+                  const LightSource3d * const ls,
+                  const Vector3d norm_v,
+                  const Vector3d reflected_ray,
+                  const Material * const material,
+                  Float * const diffuse_k,
+                  Float * const specular_k);
+
+static inline void
 calculate_color(const Scene * const scene,
-                const Point3d vector_start,
                 const Vector3d vector,
-                Object3d * const * obj_ptr,
-                const Point3d * const point_ptr,
-                const Float * const dist_ptr,
-                const Float intensity,
-                const int recursion_level);
+                const Object3d * const obj,
+                const HitRecord * const hit,
+                const Boolean * const lights_visibility,
+                RayState * const state,
+                Vector3d * const reflected_ray);
 
 // Code
 // --------------------------------------------------------------
@@ -56,86 +185,475 @@ trace(const Scene * const scene,
       const Camera * const camera,
       Vector3d vector) {
     
-    Vector3d r_vector = rotate_vector_x(vector, camera->sin_al_x, camera->cos_al_x);
-    r_vector = rotate_vector_z(r_vector, camera->sin_al_z, camera->cos_al_z);
-    r_vector = rotate_vector_y(r_vector, camera->sin_al_y, camera->cos_al_y);    
+    return trace_ray(scene, camera->camera_position, camera_to_world_vector(camera, vector));
+}
+
+/*
+ * Primary rays of packet are traced together through kd-tree or BVH,
+ * as well as shadow rays from their intersection points to each light source.
+ * Secondary rays are traced one by one
+ */
+void
+trace_packet(const Scene * const scene,
+             const Camera * const camera,
+             const Vector3d * const vectors,
+             Color * const colors) {
+    
+    Point3d starts[PACKET_SIZE];
+    Vector3d r_vectors[PACKET_SIZE];
+    int r;
+    
+    for(r = 0; r < PACKET_SIZE; r++) {
+        starts[r] = camera->camera_position;
+        r_vectors[r] = camera_to_world_vector(camera, vectors[r]);
+    }
+    
+    const RayPacket packet = ray_packet(starts, r_vectors);
     
-    return trace_recursively(scene,
-                             camera->camera_position,
-                             r_vector,
-                             INITIAL_RAY_INTENSITY,
-                             0);
+    Object3d * nearest_objs[PACKET_SIZE];
+    HitRecord nearest_hits[PACKET_SIZE];
+    
+    for(r = 0; r < PACKET_SIZE; r++) {
+        nearest_hits[r].t = FLOAT_MAX;
+        nearest_hits[r].point = starts[r];
+    }
+    
+    const int intersected = find_intersection_packet(scene,
+                                                     &packet,
+                                                     PACKET_MASK,
+                                                     nearest_objs,
+                                                     nearest_hits);
+    
+    Boolean lights_visibility[PACKET_SIZE][MAX_PACKET_LIGHT_SOURCES];
+    const Boolean packet_lights = intersected
+                                  && (scene->light_selection == ALL_LIGHTS)
+                                  && (scene->last_light_source_index < MAX_PACKET_LIGHT_SOURCES);
+    
+    if(packet_lights) {
+        get_lights_visibility_packet(scene, nearest_hits, intersected, lights_visibility);
+    }
+    
+    for(r = 0; r < PACKET_SIZE; r++) {
+        if(intersected & (1 << r)) {
+            colors[r] = trace_reflections(scene,
+                                          starts[r],
+                                          r_vectors[r],
+                                          nearest_objs[r],
+                                          nearest_hits[r],
+                                          packet_lights ? lights_visibility[r] : NULL);
+        } else {
+            colors[r] = scene->background_color;
+        }
+    }
 }
 
 Color
-trace_recursively(const Scene * const scene,
-                  const Point3d vector_start,
-                  const Vector3d vector,
-                  const Float intensity,
-                  const int recursion_level) {
-
-    // possibly - redundant code (was added to prevent overflow of Float)
-    // TODO: remove
-    //normalize_vector(&vector);
+trace_ray(const Scene * const scene,
+          const Point3d vector_start,
+          const Vector3d vector) {
     
     Object3d * nearest_obj = NULL;
-    Point3d nearest_intersection_point;
-    Float nearest_intersection_point_dist = FLOAT_MAX;
-    
-    if(find_intersection_tree(scene->kd_tree,
-                              vector_start,
-                              vector,
-                              &nearest_obj,
-                              &nearest_intersection_point,
-                              &nearest_intersection_point_dist)) {
-
-        return calculate_color(scene,
-                                 vector_start,
-                                 vector,
-                                 &nearest_obj,
-                                 &nearest_intersection_point,
-                                 &nearest_intersection_point_dist,
-                                 intensity,
-                                 recursion_level);
+    HitRecord nearest_hit;
+    nearest_hit.t = FLOAT_MAX;
+    
+    if(find_intersection(scene,
+                         vector_start,
+                         vector,
+                         &nearest_obj,
+                         &nearest_hit)) {
+        
+        return trace_reflections(scene, vector_start, vector, nearest_obj, nearest_hit, NULL);
     }
     
     return scene->background_color;
 }
 
-inline Color
-calculate_color(const Scene * const scene,
-                const Point3d vector_start,
-                const Vector3d vector,
-                Object3d * const * obj_ptr,
-                const Point3d * const point_ptr,
-                const Float * const dist_ptr,
-                const Float intensity,
-                const int recursion_level) {
+/*
+ * Ray hit obj (lights_visibility of this hit can be known).
+ * Reflected rays are traced by the loop, while their intensity is greater
+ * than threshold and the chain isn't too long. Intensity of ray is multiplied
+ * by Kr and by transparency of fog at each hit. Then colors of hits are combined
+ * from the last hit to the first one: each hit mixes in the color of its reflection
+ */
+static inline Color
+trace_reflections(const Scene * const scene,
+                  Point3d vector_start,
+                  Vector3d vector,
+                  Object3d * obj,
+                  HitRecord hit,
+                  const Boolean * lights_visibility) {
+    
+    Float intensity = INITIAL_RAY_INTENSITY;
+    Vector3d reflected_ray;
+    int count = 0;
+    
+    while(True) {
+        RayState * const state = &ray_stack[count++];
+        calculate_color(scene, vector, obj, &hit, lights_visibility, state, &reflected_ray);
+        
+        if(!state->Kr
+           || (intensity <= scene->threshold_ray_intensity)
+           || (count > scene->max_ray_recursion_level)) {
+            break;
+        }
+        
+        intensity *= state->Kr * (1 - state->fog_density);
+        vector_start = offset_ray_origin(hit.point, hit.norm, reflected_ray);
+        vector = reflected_ray;
+        lights_visibility = NULL;
+        
+        hit.t = FLOAT_MAX;
+        if(!find_intersection(scene, vector_start, vector, &obj, &hit))
+            break;
+    }
+    
+    // Color of reflection of the last hit
+    Color color = scene->background_color;
+    
+    while(count--) {
+        color = mix_reflection(scene, &ray_stack[count], color);
+    }
+    return color;
+}
+
+/*
+ * Color of hit with its reflection
+ */
+static inline Color
+mix_reflection(const Scene * const scene,
+               const RayState * const state,
+               const Color reflected_color) {
+    
+    Color color = state->color;
+    if(state->Kr) {
+        color = add_colors(color, mul_color(reflected_color, state->Kr));
+    }
+    
+    if(scene->fog_density) {
+        color = add_colors(mul_color(scene->background_color, state->fog_density),
+                           mul_color(color, 1 - state->fog_density));
+    }
+    return color;
+}
+
+/*
+ * Rays are traced by stages. Each stage intersects all rays of queue,
+ * then traces shadow rays from all their hits to the lights, which are chosen
+ * for them (all, culled or sampled lights), then shades hits,
+ * and their reflected rays become the queue of the next stage.
+ * Colors of chains are combined as by trace_reflections, so they are the same
+ */
+void
+trace_wavefront(const Scene * const scene,
+                const Camera * const camera,
+                const Vector3d * const vectors,
+                const int count,
+                Color * const colors) {
+    
+    QueuedRay * queue = malloc(count * sizeof(QueuedRay));
+    int * states_counts = calloc(count, sizeof(int));
+    int levels = 0;
+    int queue_size = count;
+    int r;
+    
+    // Each level of reflections has the state of every ray of tile
+    RayState * states = malloc((scene->max_ray_recursion_level + 1) * count * sizeof(RayState));
+    
+    // Visibility of lights, which are chosen for hit of each ray, is found by the stage
+    const int slots_count = lights_slots_count(scene);
+    Boolean * lights_visibility = NULL;
+    QueuedShadowRay * shadow_queue = NULL;
+    if(slots_count) {
+        lights_visibility = malloc(count * slots_count * sizeof(Boolean));
+        shadow_queue = malloc(count * slots_count * sizeof(QueuedShadowRay));
+    }
+    
+    for(r = 0; r < count; r++) {
+        queue[r].index = r;
+        queue[r].intensity = INITIAL_RAY_INTENSITY;
+        queue[r].start = camera->camera_position;
+        queue[r].vector = camera_to_world_vector(camera, vectors[r]);
+    }
+    
+    while(queue_size) {
+        queue_size = intersect_queue(scene, queue, queue_size);
+        if(!queue_size)
+            break;
+        
+        if(lights_visibility) {
+            get_lights_visibility_queue(scene, queue, queue_size, slots_count, shadow_queue, lights_visibility);
+        }
+        
+        // All rays of queue are reflected the same number of times
+        RayState * const level_states = states + levels * count;
+        levels++;
+        
+        int next_size = 0;
+        for(r = 0; r < queue_size; r++) {
+            QueuedRay ray = queue[r];
+            RayState * const state = &level_states[ray.index];
+            Vector3d reflected_ray;
+            
+            calculate_color(scene, ray.vector, ray.obj, &ray.hit,
+                            lights_visibility ? &lights_visibility[r * slots_count] : NULL,
+                            state, &reflected_ray);
+            states_counts[ray.index]++;
+            
+            if(!state->Kr
+               || (ray.intensity <= scene->threshold_ray_intensity)
+               || (levels > scene->max_ray_recursion_level)) {
+                continue;
+            }
+            
+            ray.intensity *= state->Kr * (1 - state->fog_density);
+            ray.start = offset_ray_origin(ray.hit.point, ray.hit.norm, reflected_ray);
+            ray.vector = reflected_ray;
+            queue[next_size++] = ray;
+        }
+        queue_size = next_size;
+    }
+    
+    for(r = 0; r < count; r++) {
+        Color color = scene->background_color;
+        int level = states_counts[r];
+        
+        while(level--) {
+            color = mix_reflection(scene, &states[level * count + r], color);
+        }
+        colors[r] = color;
+    }
+    
+    free(queue);
+    free(states_counts);
+    free(states);
+    free(lights_visibility);
+    free(shadow_queue);
+}
+
+/*
+ * Rays are intersected by packets of consecutive rays of queue
+ * (rays of the first stage are grouped by blocks of pixels).
+ * Rays, which missed, are removed from queue. Returns new size of queue
+ */
+static inline int
+intersect_queue(const Scene * const scene,
+                QueuedRay * const queue,
+                const int queue_size) {
+    
+    Point3d starts[PACKET_SIZE];
+    Vector3d vectors[PACKET_SIZE];
+    Object3d * objs[PACKET_SIZE];
+    HitRecord hits[PACKET_SIZE];
+    int from;
+    int r;
+    
+    for(from = 0; from < queue_size; from += PACKET_SIZE) {
+        const int size = (queue_size - from < PACKET_SIZE) ? queue_size - from : PACKET_SIZE;
+        
+        // Lanes after the end of queue repeat its first ray
+        for(r = 0; r < PACKET_SIZE; r++) {
+            const QueuedRay * ray = &queue[from + ((r < size) ? r : 0)];
+            starts[r] = ray->start;
+            vectors[r] = ray->vector;
+            hits[r].t = FLOAT_MAX;
+            hits[r].point = ray->start;
+        }
+        
+        const RayPacket packet = ray_packet(starts, vectors);
+        const int intersected = find_intersection_packet(scene, &packet, (1 << size) - 1, objs, hits);
+        
+        for(r = 0; r < size; r++) {
+            queue[from + r].obj = (intersected & (1 << r)) ? objs[r] : NULL;
+            queue[from + r].hit = hits[r];
+        }
+    }
+    
+    int size = 0;
+    for(r = 0; r < queue_size; r++) {
+        if(queue[r].obj) {
+            queue[size++] = queue[r];
+        }
+    }
+    return size;
+}
+
+/*
+ * Number of lights, which can be chosen for one hit
+ * (0 if hits don't have lights)
+ */
+static inline int
+lights_slots_count(const Scene * const scene) {
+    if(!scene->light_sources_count)
+        return 0;
+    
+    if(uses_all_lights(scene) || (scene->light_selection == CULLED_LIGHTS))
+        return scene->last_light_source_index + 1;
+    
+    return scene->lights_per_hit;
+}
+
+/*
+ * Shadow rays from hits of queue to their lights are queued and sorted by lights,
+ * then consecutive rays of queue are traced as packet: rays of packet go
+ * from neighbouring hits to the same light. Hits, which material isn't lit,
+ * don't trace shadow rays. Visibility of light of slot s from hit of ray r
+ * is lights_visibility[r * slots_count + s]
+ */
+static inline void
+get_lights_visibility_queue(const Scene * const scene,
+                            const QueuedRay * const queue,
+                            const int queue_size,
+                            const int slots_count,
+                            QueuedShadowRay * const shadow_queue,
+                            Boolean * const lights_visibility) {
+    
+    LightSource3d * ls;
+    Point3d starts[PACKET_SIZE];
+    Vector3d rays[PACKET_SIZE];
+    Float dists[PACKET_SIZE];
+    int shadow_queue_size = 0;
+    int from;
+    int r;
+    
+    for(r = 0; r < queue_size; r++) {
+        shadow_queue_size += queue_shadow_rays(scene, &queue[r], r, shadow_queue + shadow_queue_size);
+    }
+    
+    qsort(shadow_queue, shadow_queue_size, sizeof(QueuedShadowRay), compare_shadow_rays);
+    
+    for(from = 0; from < shadow_queue_size; from += PACKET_SIZE) {
+        const int size = (shadow_queue_size - from < PACKET_SIZE) ? shadow_queue_size - from : PACKET_SIZE;
+        const QueuedShadowRay * const rays_of_packet = shadow_queue + from;
+        
+        // Lanes after the end of queue repeat its first ray
+        for(r = 0; r < PACKET_SIZE; r++) {
+            const QueuedShadowRay * shadow_ray = &rays_of_packet[(r < size) ? r : 0];
+            const HitRecord * hit = &queue[shadow_ray->ray].hit;
+            
+            ls = scene->light_sources[shadow_ray->light];
+            starts[r] = offset_ray_origin(hit->point, hit->norm, vector3dp(hit->point, ls->location));
+            rays[r] = vector3dp(starts[r], ls->location);
+            dists[r] = module_vector(rays[r]);
+        }
+        
+        const int mask = (1 << size) - 1;
+        const RayPacket packet = ray_packet(starts, rays);
+        const int shaded = is_intersect_anything_packet(scene, &packet, mask, dists);
+        
+        #ifdef RAY_INTERSECTIONS_STAT
+        shadow_rays += size;
+        #endif // RAY_INTERSECTIONS_STAT
+        
+        for(r = 0; r < size; r++) {
+            lights_visibility[rays_of_packet[r].ray * slots_count + rays_of_packet[r].slot] = !(shaded & (1 << r));
+        }
+    }
+}
+
+/*
+ * Shadow rays of hit to the lights, which get_lights_colors chooses for it
+ * (in the same order). Returns number of queued rays
+ */
+static inline int
+queue_shadow_rays(const Scene * const scene,
+                  const QueuedRay * const ray,
+                  const int index,
+                  QueuedShadowRay * const shadow_queue) {
+    
+    const Material material = ray->obj->get_material(ray->obj->data, &ray->hit);
+    if(!material.Kd && !material.Ks)
+        return 0;
+    
+    int count = 0;
+    int i;
+    
+    if(uses_all_lights(scene)) {
+        for(i = 0; i < scene->last_light_source_index + 1; i++) {
+            if(scene->light_sources[i]) {
+                QueuedShadowRay shadow_ray = {.ray = index, .slot = i, .light = i};
+                shadow_queue[count++] = shadow_ray;
+            }
+        }
+        return count;
+    }
+    
+    // The same normal and reflected ray, as calculate_color gives to get_lights_colors
+    const Vector3d norm = ray->obj->get_normal_vector(ray->obj->data, &ray->hit);
+    const Vector3d reflected_ray = (material.Ks || material.Kr) ? reflect_ray(ray->vector, norm)
+                                                                : vector3df(0, 0, 0);
+    const LightsQuery query = new_lights_query(&ray->hit, norm, reflected_ray, &material);
+    
+    if(scene->light_selection == CULLED_LIGHTS) {
+        LightsCulling culling;
+        start_lights_culling(&culling, scene->light_tree, &query, scene->lights_threshold);
+        
+        while((i = next_light(&culling)) >= 0) {
+            QueuedShadowRay shadow_ray = {.ray = index, .slot = count, .light = i};
+            shadow_queue[count++] = shadow_ray;
+        }
+        return count;
+    }
+    
+    Float probability;
+    int sample;
+    for(sample = 0; sample < scene->lights_per_hit; sample++) {
+        i = sample_light(scene->light_tree, &query, sample, &probability);
+        
+        if((i >= 0) && scene->light_sources[i]) {
+            QueuedShadowRay shadow_ray = {.ray = index, .slot = sample, .light = i};
+            shadow_queue[count++] = shadow_ray;
+        }
+    }
+    return count;
+}
 
-    const Object3d * obj = *obj_ptr;
-    const Point3d point = *point_ptr;
-    const Float dist = *dist_ptr;
+/*
+ * Shadow rays are ordered by lights, rays of each light - by hits
+ */
+static int
+compare_shadow_rays(const void * a,
+                    const void * b) {
     
+    const QueuedShadowRay * ra = a;
+    const QueuedShadowRay * rb = b;
     
-    const Material material = obj->get_material(obj->data, point);
+    if(ra->light != rb->light)
+        return ra->light - rb->light;
     
-    const Vector3d norm = obj->get_normal_vector(obj->data, point);
+    return (ra->ray != rb->ray) ? ra->ray - rb->ray : ra->slot - rb->slot;
+}
+
+/*
+ * Color of hit without reflection. Reflected ray is found,
+ * if material is reflective or specular
+ */
+static inline void
+calculate_color(const Scene * const scene,
+                const Vector3d vector,
+                const Object3d * const obj,
+                const HitRecord * const hit,
+                const Boolean * const lights_visibility,
+                RayState * const state,
+                Vector3d * const reflected_ray) {
     
-    Color obj_color = obj->get_color(obj->data, point);
+    const Material material = obj->get_material(obj->data, hit);
+    
+    const Vector3d norm = obj->get_normal_vector(obj->data, hit);
+    
+    Color obj_color = obj->get_color(obj->data, hit);
     Color ambient_color;
     Color diffuse_color;
-    Color reflected_color;
     Color specular_color;
     
-    Float fog_density = 0;
+    state->fog_density = 0;
     if(scene->fog_density) {
-        fog_density = scene->fog_density(dist, scene->fog_parameters);
+        const Float dist = hit->t * module_vector(vector);
+        state->fog_density = scene->fog_density(dist, scene->fog_parameters);
     }
     
-    
-    Vector3d reflected_ray;
+    *reflected_ray = vector3df(0, 0, 0);
     if((material.Ks) || (material.Kr)) {        
-        reflected_ray = reflect_ray(vector, norm);
+        *reflected_ray = reflect_ray(vector, norm);
     }
     
     // Ambient
@@ -143,44 +661,20 @@ calculate_color(const Scene * const scene,
         ambient_color = mix_colors(scene->background_color, obj_color);
     }
     
-    // Diffuse
-    if(material.Kd) {
+    // Diffuse and specular
+    if((material.Kd) || (material.Ks)) {
         diffuse_color = obj_color;
-        
-        if(scene->light_sources_count) {
-            Color light_color = get_lighting_color(point, norm, scene);
-            diffuse_color = mix_colors(diffuse_color, light_color);
-        }
-    }
-    
-    // Specular
-    if(material.Ks) {
         specular_color = scene->background_color;
         
         if(scene->light_sources_count) {
-            specular_color = get_specular_color(point, reflected_ray, scene, material.p);
-        }
-    }
-    
-    
-    // Reflect
-    if(material.Kr) {
-        // Avoid deep recursion by tracing rays, which have intensity is greather than threshold
-        // and avoid infinite recursion by limiting number of recursive calls
-        if((intensity > THRESHOLD_RAY_INTENSITY)
-           && (recursion_level < MAX_RAY_RECURSION_LEVEL)) {
-            
-            reflected_color = trace_recursively(scene,
-                                                point,
-                                                reflected_ray,
-                                                intensity * material.Kr * (1 - fog_density),
-                                                recursion_level + 1);
-        } else {
-            reflected_color = scene->background_color;
+            Color light_color;
+            get_lights_colors(hit, norm, *reflected_ray, scene, &material, lights_visibility,
+                              &light_color, &specular_color);
+            diffuse_color = mix_colors(diffuse_color, light_color);
         }
     }
     
-    // Result
+    // Result (reflection is mixed by trace_reflections)
     Color result_color = rgb(0, 0, 0);
     if(material.Ka) {
         result_color = add_colors(result_color,
@@ -194,99 +688,208 @@ calculate_color(const Scene * const scene,
         result_color = add_colors(result_color,
                                   mul_color(specular_color, material.Ks));
     }
-    if(material.Kr) {
-        result_color = add_colors(result_color,
-                                  mul_color(reflected_color, material.Kr));
-    }
     
-    if(scene->fog_density) {
-        result_color = add_colors(
-                                  mul_color(scene->background_color, fog_density),
-                                  mul_color(result_color, 1 - fog_density));
-    }
-
-    return result_color;
+    state->color = result_color;
+    state->Kr = material.Kr;
 }
 
-inline Color
-get_lighting_color(const Point3d point,
-                   const Vector3d norm_v,
-                   const Scene * const scene) {
-    
-    Color light_color = rgb(0, 0, 0);
-    
-    // possibly - redundant code (was added to prevent overflow of Float)
-    // TODO: remove
-    //normalize_vector(&norm_v);
+/*
+ * Shadow ray to each light source is traced once: its visibility is shared
+ * by diffuse and specular colors. Shadow rays start from the surface of hit,
+ * norm_v is the normal for shading.
+ * Lights of tree are culled or sampled. If lights_visibility is not NULL,
+ * it is the visibility of lights in the order, in which they are chosen:
+ * of each light, of each culled light or of each sample (see queue_shadow_rays)
+ */
+inline void
+get_lights_colors(const HitRecord * const hit,
+                  const Vector3d norm_v,
+                  const Vector3d reflected_ray,
+                  const Scene * const scene,
+                  const Material * const material,
+                  const Boolean * const lights_visibility,
+                  Color * const diffuse_light_color,
+                  Color * const specular_light_color) {
+    
+    Color diffuse_color = rgb(0, 0, 0);
+    Color specular_color = rgb(0, 0, 0);
     
     LightSource3d * ls;
-    Vector3d v_ls;
-    Float cos_ls;
-    Color color_ls;
+    Float diffuse_k;
+    Float specular_k;
     int i;
     
-    for(i = 0; i < scene->last_light_source_index + 1; i++) {
-        if(scene->light_sources[i]) {
+    if(uses_all_lights(scene)) {
+        for(i = 0; i < scene->last_light_source_index + 1; i++) {
             ls = scene->light_sources[i];
+            
+            if(ls && (lights_visibility ? lights_visibility[i] : is_lit(hit, ls, scene))) {
+                get_light_factors(hit, ls, norm_v, reflected_ray, material, &diffuse_k, &specular_k);
+                diffuse_color = add_colors(diffuse_color, mul_color(ls->color, diffuse_k));
+                specular_color = add_colors(specular_color, mul_color(ls->color, specular_k));
+            }
+        }
+        *diffuse_light_color = diffuse_color;
+        *specular_light_color = specular_color;
+        return;
+    }
+    
+    const LightsQuery query = new_lights_query(hit, norm_v, reflected_ray, material);
+    int slot;
+    
+    if(scene->light_selection == CULLED_LIGHTS) {
+        LightsCulling culling;
+        start_lights_culling(&culling, scene->light_tree, &query, scene->lights_threshold);
         
-            // If not shaded
-            if(is_viewable(ls->location, point, scene)) {
-                v_ls = vector3dp(point, ls->location);
-                
-                // possibly - redundant code (was added to prevent overflow of Float)
-                // TODO: remove
-                //normalize_vector(&v_ls);
+        for(slot = 0; (i = next_light(&culling)) >= 0; slot++) {
+            ls = scene->light_sources[i];
             
-                cos_ls = fabs(cos_vectors(norm_v, v_ls));
-                color_ls = mul_color(ls->color, cos_ls);
-                light_color = add_colors(light_color, color_ls);
+            if(lights_visibility ? lights_visibility[slot] : is_lit(hit, ls, scene)) {
+                get_light_factors(hit, ls, norm_v, reflected_ray, material, &diffuse_k, &specular_k);
+                diffuse_color = add_colors(diffuse_color, mul_color(ls->color, diffuse_k));
+                specular_color = add_colors(specular_color, mul_color(ls->color, specular_k));
             }
         }
+        *diffuse_light_color = diffuse_color;
+        *specular_light_color = specular_color;
+        return;
+    }
+    
+    // Sampled light stands for the lights, which weren't sampled,
+    // so its contribution is large: sum isn't truncated to bytes until the end
+    Float diffuse[3] = {0, 0, 0};
+    Float specular[3] = {0, 0, 0};
+    Float probability;
+    int sample;
+    
+    for(sample = 0; sample < scene->lights_per_hit; sample++) {
+        i = sample_light(scene->light_tree, &query, sample, &probability);
+        ls = (i >= 0) ? scene->light_sources[i] : NULL;
+        
+        if(ls && (lights_visibility ? lights_visibility[sample] : is_lit(hit, ls, scene))) {
+            const Float weight = 1 / (scene->lights_per_hit * probability);
+            get_light_factors(hit, ls, norm_v, reflected_ray, material, &diffuse_k, &specular_k);
+            
+            diffuse[0] += ls->color.r * diffuse_k * weight;
+            diffuse[1] += ls->color.g * diffuse_k * weight;
+            diffuse[2] += ls->color.b * diffuse_k * weight;
+            specular[0] += ls->color.r * specular_k * weight;
+            specular[1] += ls->color.g * specular_k * weight;
+            specular[2] += ls->color.b * specular_k * weight;
+        }
     }
+    *diffuse_light_color = rgb_saturated(diffuse[0], diffuse[1], diffuse[2]);
+    *specular_light_color = rgb_saturated(specular[0], specular[1], specular[2]);
+}
+
+/*
+ * Lights of hit are chosen by the tree of lights, unless all lights are used
+ * (tree is dropped by adding of light source until the next prepare_scene)
+ */
+static inline Boolean
+uses_all_lights(const Scene * const scene) {
+    return (scene->light_selection == ALL_LIGHTS) || !scene->light_tree;
+}
+
+static inline LightsQuery
+new_lights_query(const HitRecord * const hit,
+                 const Vector3d norm_v,
+                 const Vector3d reflected_ray,
+                 const Material * const material) {
+    
+    LightsQuery query;
+    query.point = hit->point;
+    query.norm = norm_v;
+    query.reflected_ray = reflected_ray;
+    query.material = material;
+    normalize_vector(&query.norm);
+    if(material->Ks) {
+        normalize_vector(&query.reflected_ray);
+    }
+    return query;
+}
+
+static inline Boolean
+is_lit(const HitRecord * const hit,
+       const LightSource3d * const ls,
+       const Scene * const scene) {
     
-    return light_color;
+    const Vector3d v_ls = vector3dp(hit->point, ls->location);
+    return is_viewable(ls->location, offset_ray_origin(hit->point, hit->norm, v_ls), scene);
 }
 
-inline Color
-get_specular_color(const Point3d point,
-                   const Vector3d reflected_ray,
-                   const Scene * const scene,
-                   const Float p) {
+/*
+ * Colors of light source are multiplied by these factors
+ * to get its diffuse and specular colors
+ */
+static inline void
+get_light_factors(const HitRecord * const hit,
+                  const LightSource3d * const ls,
+                  const Vector3d norm_v,
+                  const Vector3d reflected_ray,
+                  const Material * const material,
+                  Float * const diffuse_k,
+                  Float * const specular_k) {
+    
+    const Vector3d v_ls = vector3dp(hit->point, ls->location);
+    Float cos_ls;
     
-    Color light_color = rgb(0, 0, 0);
+    *diffuse_k = 0;
+    *specular_k = 0;
     
-    // possibly - redundant code (was added to prevent overflow of Float)
-    // TODO: remove
-    //normalize_vector(&reflected_ray);
+    if(material->Kd) {
+        *diffuse_k = fabs(cos_vectors(norm_v, v_ls));
+    }
+    
+    if(material->Ks) {
+        cos_ls = cos_vectors(reflected_ray, v_ls);
+        if(cos_ls > EPSILON) {
+            *specular_k = pow(cos_ls, material->p);
+        }
+    }
+}
+
+/*
+ * Shadow rays from points of all hits of mask to the same light source are traced as packet
+ * (points of the other hits are the starts of packet)
+ */
+static inline void
+get_lights_visibility_packet(const Scene * const scene,
+                             const HitRecord * const hits,
+                             const int mask,
+                             Boolean lights_visibility[][MAX_PACKET_LIGHT_SOURCES]) {
     
     LightSource3d * ls;
-    Vector3d v_ls;
-    Float cos_ls;
-    Color color_ls;
+    Point3d starts[PACKET_SIZE];
+    Vector3d rays[PACKET_SIZE];
+    Float dists[PACKET_SIZE];
     int i;
+    int r;
     
     for(i = 0; i < scene->last_light_source_index + 1; i++) {
         if(scene->light_sources[i]) {
             ls = scene->light_sources[i];
-        
-            // If not shaded
-            if(is_viewable(ls->location, point, scene)) {
-                v_ls = vector3dp(point, ls->location);
-                
-                // possibly - redundant code (was added to prevent overflow of Float)
-                // TODO: remove
-                //normalize_vector(&v_ls);
             
-                cos_ls = cos_vectors(reflected_ray, v_ls);
-                if(cos_ls > EPSILON) {
-                    color_ls = mul_color(ls->color, pow(cos_ls, p));
-                    light_color = add_colors(light_color, color_ls);
-                }
+            for(r = 0; r < PACKET_SIZE; r++) {
+                starts[r] = (mask & (1 << r))
+                            ? offset_ray_origin(hits[r].point, hits[r].norm, vector3dp(hits[r].point, ls->location))
+                            : hits[r].point;
+                rays[r] = vector3dp(starts[r], ls->location);
+                dists[r] = module_vector(rays[r]);
+            }
+            
+            const RayPacket packet = ray_packet(starts, rays);
+            const int shaded = is_intersect_anything_packet(scene, &packet, mask, dists);
+            
+            #ifdef RAY_INTERSECTIONS_STAT
+            shadow_rays += __builtin_popcount(mask);
+            #endif // RAY_INTERSECTIONS_STAT
+            
+            for(r = 0; r < PACKET_SIZE; r++) {
+                lights_visibility[r][i] = !(shaded & (1 << r));
             }
         }
     }
-    
-    return light_color;
 }
 
 inline Boolean
@@ -297,24 +900,60 @@ is_viewable(const Point3d target_point,
     const Vector3d ray = vector3dp(starting_point, target_point);
     const Float target_dist = module_vector(ray);
     
-    // possibly - redundant code (was added to prevent overflow of Float)
-    // TODO: remove
-    //normalize_vector(&ray);
+    #ifdef RAY_INTERSECTIONS_STAT
+    ++shadow_rays;
+    #endif // RAY_INTERSECTIONS_STAT
     
-    Object3d * nearest_obj = NULL;
-    Point3d nearest_intersection_point;
-    Float nearest_intersection_point_dist = FLOAT_MAX;
+    // Any object between starting point and target point
+    if(scene->bvh)
+        return !is_intersect_anything_bvh(scene->bvh, starting_point, ray, target_dist);
     
-    if(find_intersection_tree(scene->kd_tree,
-                              starting_point,
-                              ray,
-                              &nearest_obj,
-                              &nearest_intersection_point,
-                              &nearest_intersection_point_dist)) {
+    return !is_intersect_anything_tree(scene->kd_tree, starting_point, ray, target_dist);
+}
 
-        // Check if intersection point is closer than target_point
-        return (target_dist < nearest_intersection_point_dist);
+static inline Boolean
+find_intersection(const Scene * const scene,
+                  const Point3d vector_start,
+                  const Vector3d vector,
+                  Object3d ** const nearest_obj_ptr,
+                  HitRecord * const nearest_hit) {
+    
+    if(scene->bvh) {
+        return find_intersection_bvh(scene->bvh,
+                                     vector_start,
+                                     vector,
+                                     nearest_obj_ptr,
+                                     nearest_hit);
     }
-    // Ray doesn't intersect any of scene objects
-    return True;
+    
+    return find_intersection_tree(scene->kd_tree,
+                                  vector_start,
+                                  vector,
+                                  nearest_obj_ptr,
+                                  nearest_hit);
+}
+
+static inline int
+find_intersection_packet(const Scene * const scene,
+                         const RayPacket * const packet,
+                         const int mask,
+                         Object3d ** const nearest_objs,
+                         HitRecord * const nearest_hits) {
+    
+    if(scene->bvh)
+        return find_intersection_bvh_packet(scene->bvh, packet, mask, nearest_objs, nearest_hits);
+    
+    return find_intersection_tree_packet(scene->kd_tree, packet, mask, nearest_objs, nearest_hits);
+}
+
+static inline int
+is_intersect_anything_packet(const Scene * const scene,
+                             const RayPacket * const packet,
+                             const int mask,
+                             const Float * const max_dists) {
+    
+    if(scene->bvh)
+        return is_intersect_anything_bvh_packet(scene->bvh, packet, mask, max_dists);
+    
+    return is_intersect_anything_tree_packet(scene->kd_tree, packet, mask, max_dists);
 }
\ No newline at end of file
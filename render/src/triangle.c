@@ -4,6 +4,10 @@
 #include <render.h>
 #include <canvas.h>
 #include <utils.h>
+#include <kdtree.h>
+
+// Arrays of mesh grow twice from this size, while it is being filled
+#define MESH_INITIAL_CAPACITY 64
 
 // Declarations
 // --------------------------------------------------------------
@@ -21,13 +25,6 @@ struct {
 
     Vector3d norm;
     
-    // distance to the center of coordinates
-	Float d;
-    
-    Vector3d v_p1_p2;
-    Vector3d v_p2_p3;
-    Vector3d v_p3_p1;
-    
     /************
      * Material *
      ************/
@@ -69,7 +66,7 @@ inline static Boolean
 intersect_triangle(const void * data,
                    const Point3d vector_start,
                    const Vector3d vector,
-                   Point3d * const intersection_point);
+                   HitRecord * const hit);
 
 Point3d
 get_min_triangle_boundary_point(const void * data);
@@ -77,40 +74,162 @@ get_min_triangle_boundary_point(const void * data);
 Point3d
 get_max_triangle_boundary_point(const void * data);
 
+static Boolean
+clip_triangle_by_voxel(const void * data,
+                       const Voxel v,
+                       Voxel * const clipped_box);
+
+static inline int
+clip_polygon_by_plane(const Point3d * polygon,
+                      const int vertexes_count,
+                      const int axis,
+                      const Float coord,
+                      const Boolean keep_greater,
+                      Point3d * const result);
+
+static inline Float
+point_coord(const Point3d p,
+            const int axis);
+
 static inline Color
 get_triangle_color(const void * data,
-                   const Point3d intersection_point);
+                   const HitRecord * const hit);
 
 static inline Color
 get_texture_color(const void * data,
-                  const Point3d intersection_point);
+                  const HitRecord * const hit);
+
+static inline Color
+get_texture_pixel(Canvas * canvas,
+                  const Point2d t1,
+                  const Point2d t2,
+                  const Point2d t3,
+                  const Float w1,
+                  const Float w2,
+                  const Float w3);
 
 static inline Vector3d
 get_triangle_normal_vector(const void * data,
-                           const Point3d intersection_point);
+                           const HitRecord * const hit);
 
 static inline Vector3d
 get_phong_normal_vector(const void * data,
-                        const Point3d intersection_point);
+                        const HitRecord * const hit);
 
 static inline Material
 get_triangle_material(const void * data,
-                      const Point3d intersection_point);
+                      const HitRecord * const hit);
 
 static inline void
 release_triangle_data(void * data);
 
+static int
+intersect_triangle_packet(const void * data,
+                          const RayPacket * const packet,
+                          const int mask,
+                          HitRecord * const hits);
+
 static inline Boolean
-check_same_clock_dir(const Vector3d v1,
-                     const Vector3d v2,
-                     const Vector3d norm);
+intersect_vertexes_hit(const Point3d p1,
+                       const Point3d p2,
+                       const Point3d p3,
+                       const Point3d vector_start,
+                       const Vector3d vector,
+                       HitRecord * const hit);
 
-static inline void
-get_weights_of_vertexes(const Triangle3d * const tr,
-                        const Point3d intersection_point,
-                        Float * const w1,
-                        Float * const w2,
-                        Float * const w3);
+static inline int
+intersect_vertexes_packet_hits(const Point3d p1,
+                               const Point3d p2,
+                               const Point3d p3,
+                               const RayPacket * const packet,
+                               const int mask,
+                               HitRecord * const hits);
+
+static inline Boolean
+intersect_vertexes(const Point3d p1,
+                   const Point3d p2,
+                   const Point3d p3,
+                   const Point3d vector_start,
+                   const Vector3d vector,
+                   Float * const t,
+                   Float * const w1,
+                   Float * const w2,
+                   Float * const w3);
+
+static inline int
+intersect_vertexes_packet(const Point3d p1,
+                          const Point3d p2,
+                          const Point3d p3,
+                          const RayPacket * const packet,
+                          const int mask,
+                          PacketFloat * const t,
+                          PacketFloat * const w1,
+                          PacketFloat * const w2,
+                          PacketFloat * const w3);
+
+static inline Voxel
+vertexes_box(const Point3d p1,
+             const Point3d p2,
+             const Point3d p3);
+
+static inline Boolean
+clip_vertexes_by_voxel(const Point3d p1,
+                       const Point3d p2,
+                       const Point3d p3,
+                       const Voxel v,
+                       Voxel * const clipped_box);
+
+static inline Vector3d
+mesh_triangle_normal_vector(const TriangleMesh * const mesh,
+                            const int index);
+
+static Boolean
+intersect_triangle_mesh(const void * data,
+                        const Point3d vector_start,
+                        const Vector3d vector,
+                        HitRecord * const hit);
+
+static int
+intersect_triangle_mesh_packet(const void * data,
+                               const RayPacket * const packet,
+                               const int mask,
+                               HitRecord * const hits);
+
+static Boolean
+is_triangle_mesh_intersected(const void * data,
+                             const Point3d vector_start,
+                             const Vector3d vector,
+                             const Float max_dist);
+
+static int
+is_triangle_mesh_intersected_packet(const void * data,
+                                    const RayPacket * const packet,
+                                    const int mask,
+                                    const Float * const max_dists);
+
+static inline Boolean
+is_zero_vector(const Vector3d v);
+
+static Color
+get_triangle_mesh_color(const void * data,
+                        const HitRecord * const hit);
+
+static Vector3d
+get_triangle_mesh_normal_vector(const void * data,
+                                const HitRecord * const hit);
+
+static Material
+get_triangle_mesh_material(const void * data,
+                           const HitRecord * const hit);
+
+static Point3d
+get_min_triangle_mesh_boundary_point(const void * data);
+
+static Point3d
+get_max_triangle_mesh_boundary_point(const void * data);
+
+static void
+release_triangle_mesh_data(void * data);
 
 // Code
 // --------------------------------------------------------------
@@ -184,15 +303,9 @@ create_plain_triangle(const Point3d p1,
     
     triangle->norm = cross_product(vector3dp(p1, p3), vector3dp(p3, p2));
     
-	triangle->d = -(p1.x * triangle->norm.x + p1.y * triangle->norm.y + p1.z * triangle->norm.z);
-    
     triangle->color = color;
     triangle->material = material;
     
-    triangle->v_p1_p2 = vector3dp(p1, p2);
-    triangle->v_p2_p3 = vector3dp(p2, p3);    
-    triangle->v_p3_p1 = vector3dp(p3, p1);
-    
     return triangle;
 }
 
@@ -203,35 +316,39 @@ wrap_triangle(Triangle3d * triangle) {
 	obj->release_data = release_triangle_data;
 	obj->get_color = get_triangle_color;
 	obj->intersect = intersect_triangle;
+    obj->intersect_packet = intersect_triangle_packet;
+    obj->type = TRIANGLE_OBJECT;
     obj->get_normal_vector = get_triangle_normal_vector;
     obj->get_material = get_triangle_material;
     obj->get_min_boundary_point = get_min_triangle_boundary_point;
     obj->get_max_boundary_point = get_max_triangle_boundary_point;    
+    obj->clip_by_voxel = clip_triangle_by_voxel;
 	return obj;
 }
 
 static inline Color
 get_triangle_color(const void * data,
-                   const Point3d intersection_point) {
+                   const HitRecord * const hit) {
 	const Triangle3d * triangle = data;
 	return triangle->color;
 }
 
 static inline Color
 get_texture_color(const void * data,
-                  const Point3d intersection_point) {
+                  const HitRecord * const hit) {
     
 	const Triangle3d * tr = data;
-    
-    Float w1;
-    Float w2;
-    Float w3;
-    
-    get_weights_of_vertexes(tr, intersection_point, &w1, &w2, &w3);
-    
-    const Point2d t1 = tr->t1;
-    const Point2d t2 = tr->t2;
-    const Point2d t3 = tr->t3;
+    return get_texture_pixel(tr->texture, tr->t1, tr->t2, tr->t3, hit->w1, hit->w2, hit->w3);
+}
+
+static inline Color
+get_texture_pixel(Canvas * canvas,
+                  const Point2d t1,
+                  const Point2d t2,
+                  const Point2d t3,
+                  const Float w1,
+                  const Float w2,
+                  const Float w3) {
     
     Float xf = w1 * t1.x + w2 * t2.x + w3 * t3.x;
     Float yf = w1 * t1.y + w2 * t2.y + w3 * t3.y;
@@ -240,8 +357,6 @@ get_texture_color(const void * data,
     xf = (xf < 0) ? (xf - (int)xf) + 1 : (xf - (int)xf);
     yf = (yf < 0) ? (yf - (int)yf) + 1 : (yf - (int)yf);
     
-    Canvas * canvas = tr->texture;
-    
     int x = (int)(xf * canvas->w);
     int y = (int)(yf * canvas->h);
     
@@ -250,22 +365,20 @@ get_texture_color(const void * data,
 
 static inline Vector3d
 get_triangle_normal_vector(const void * data,
-                           const Point3d intersection_point) {
+                           const HitRecord * const hit) {
   	const Triangle3d * triangle = data;
     return triangle->norm;
 }
 
 static inline Vector3d
 get_phong_normal_vector(const void * data,
-                        const Point3d intersection_point) {
+                        const HitRecord * const hit) {
     
   	const Triangle3d * tr = data;
     
-    Float w1;
-    Float w2;
-    Float w3;
-    
-    get_weights_of_vertexes(tr, intersection_point, &w1, &w2, &w3);
+    const Float w1 = hit->w1;
+    const Float w2 = hit->w2;
+    const Float w3 = hit->w3;
     
     const Vector3d n1 = tr->n1;
     const Vector3d n2 = tr->n2;
@@ -278,7 +391,7 @@ get_phong_normal_vector(const void * data,
 
 static inline Material
 get_triangle_material(const void * data,
-                      const Point3d intersection_point) {
+                      const HitRecord * const hit) {
     const Triangle3d * triangle = data;
     return triangle->material;
 }
@@ -292,119 +405,840 @@ release_triangle_data(void * data) {
 Point3d
 get_min_triangle_boundary_point(const void * data) {
 	const Triangle3d * t = data;
+    const Voxel box = vertexes_box(t->p1, t->p2, t->p3);
+    return point3d(box.x_min, box.y_min, box.z_min);
+}
+
+Point3d
+get_max_triangle_boundary_point(const void * data) {
+	const Triangle3d * t = data;
+    const Voxel box = vertexes_box(t->p1, t->p2, t->p3);
+    return point3d(box.x_max, box.y_max, box.z_max);
+}
+
+static inline Voxel
+vertexes_box(const Point3d p1,
+             const Point3d p2,
+             const Point3d p3) {
+    
+    Float x_min = p1.x;
+    Float y_min = p1.y;
+    Float z_min = p1.z;
+    
+    Float x_max = p1.x;
+    Float y_max = p1.y;
+    Float z_max = p1.z;
     
-    Float x_min = t->p1.x;
-    Float y_min = t->p1.y;
-    Float z_min = t->p1.z;
+    x_min = (x_min < p2.x) ? x_min : p2.x;
+    y_min = (y_min < p2.y) ? y_min : p2.y;
+    z_min = (z_min < p2.z) ? z_min : p2.z;
     
-    x_min = (x_min < t->p2.x) ? x_min : t->p2.x;
-    y_min = (y_min < t->p2.y) ? y_min : t->p2.y;
-    z_min = (z_min < t->p2.z) ? z_min : t->p2.z;
+    x_max = (x_max > p2.x) ? x_max : p2.x;
+    y_max = (y_max > p2.y) ? y_max : p2.y;
+    z_max = (z_max > p2.z) ? z_max : p2.z;
     
-    x_min = (x_min < t->p3.x) ? x_min : t->p3.x;
-    y_min = (y_min < t->p3.y) ? y_min : t->p3.y;
-    z_min = (z_min < t->p3.z) ? z_min : t->p3.z;
+    x_min = (x_min < p3.x) ? x_min : p3.x;
+    y_min = (y_min < p3.y) ? y_min : p3.y;
+    z_min = (z_min < p3.z) ? z_min : p3.z;
     
-    return point3d(x_min - EPSILON, y_min - EPSILON, z_min - EPSILON);
+    x_max = (x_max > p3.x) ? x_max : p3.x;
+    y_max = (y_max > p3.y) ? y_max : p3.y;
+    z_max = (z_max > p3.z) ? z_max : p3.z;
+    
+    Voxel box = {x_min - EPSILON, y_min - EPSILON, z_min - EPSILON,
+                 x_max + EPSILON, y_max + EPSILON, z_max + EPSILON};
+    return box;
 }
 
-Point3d
-get_max_triangle_boundary_point(const void * data) {
+static Boolean
+clip_triangle_by_voxel(const void * data,
+                       const Voxel v,
+                       Voxel * const clipped_box) {
+    
 	const Triangle3d * t = data;
+    return clip_vertexes_by_voxel(t->p1, t->p2, t->p3, v, clipped_box);
+}
+
+/*
+ * Clips triangle by planes of voxel (Sutherland-Hodgman algorithm)
+ * and returns bounding box of the remaining polygon
+ */
+static inline Boolean
+clip_vertexes_by_voxel(const Point3d p1,
+                       const Point3d p2,
+                       const Point3d p3,
+                       const Voxel v,
+                       Voxel * const clipped_box) {
     
-    Float x_max = t->p1.x;
-    Float y_max = t->p1.y;
-    Float z_max = t->p1.z;
+    // Each plane adds at most one vertex to the polygon
+    Point3d polygon[9];
+    Point3d clipped[9];
+    int n = 3;
     
-    x_max = (x_max > t->p2.x) ? x_max : t->p2.x;
-    y_max = (y_max > t->p2.y) ? y_max : t->p2.y;
-    z_max = (z_max > t->p2.z) ? z_max : t->p2.z;
+    polygon[0] = p1;
+    polygon[1] = p2;
+    polygon[2] = p3;
     
-    x_max = (x_max > t->p3.x) ? x_max : t->p3.x;
-    y_max = (y_max > t->p3.y) ? y_max : t->p3.y;
-    z_max = (z_max > t->p3.z) ? z_max : t->p3.z;
+    // Voxel is slightly extended - so triangles, which lie on the boundary
+    // of voxel, are not lost
+    const Float min[3] = {v.x_min - EPSILON, v.y_min - EPSILON, v.z_min - EPSILON};
+    const Float max[3] = {v.x_max + EPSILON, v.y_max + EPSILON, v.z_max + EPSILON};
     
-    return point3d(x_max + EPSILON, y_max + EPSILON, z_max + EPSILON);
+    int axis;
+    int i;
+    for(axis = 0; axis < 3; axis++) {
+        const Float c1 = point_coord(p1, axis);
+        const Float c2 = point_coord(p2, axis);
+        const Float c3 = point_coord(p3, axis);
+        
+        // Planes, which don't cross the triangle, are skipped
+        if((c1 < min[axis]) || (c2 < min[axis]) || (c3 < min[axis])) {
+            n = clip_polygon_by_plane(polygon, n, axis, min[axis], True, clipped);
+            for(i = 0; i < n; i++) {
+                polygon[i] = clipped[i];
+            }
+        }
+        
+        if((c1 > max[axis]) || (c2 > max[axis]) || (c3 > max[axis])) {
+            n = clip_polygon_by_plane(polygon, n, axis, max[axis], False, clipped);
+            for(i = 0; i < n; i++) {
+                polygon[i] = clipped[i];
+            }
+        }
+    }
+    
+    if(!n) {
+        return False;
+    }
+    
+    Voxel box = {.x_min = polygon[0].x, .y_min = polygon[0].y, .z_min = polygon[0].z,
+                 .x_max = polygon[0].x, .y_max = polygon[0].y, .z_max = polygon[0].z};
+    
+    for(i = 1; i < n; i++) {
+        box.x_min = (box.x_min < polygon[i].x) ? box.x_min : polygon[i].x;
+        box.y_min = (box.y_min < polygon[i].y) ? box.y_min : polygon[i].y;
+        box.z_min = (box.z_min < polygon[i].z) ? box.z_min : polygon[i].z;
+        
+        box.x_max = (box.x_max > polygon[i].x) ? box.x_max : polygon[i].x;
+        box.y_max = (box.y_max > polygon[i].y) ? box.y_max : polygon[i].y;
+        box.z_max = (box.z_max > polygon[i].z) ? box.z_max : polygon[i].z;
+    }
+    
+    // The same margins as in get_min/max_triangle_boundary_point,
+    // but box can't be wider than voxel
+    clipped_box->x_min = (box.x_min - EPSILON > v.x_min) ? box.x_min - EPSILON : v.x_min;
+    clipped_box->y_min = (box.y_min - EPSILON > v.y_min) ? box.y_min - EPSILON : v.y_min;
+    clipped_box->z_min = (box.z_min - EPSILON > v.z_min) ? box.z_min - EPSILON : v.z_min;
+    
+    clipped_box->x_max = (box.x_max + EPSILON < v.x_max) ? box.x_max + EPSILON : v.x_max;
+    clipped_box->y_max = (box.y_max + EPSILON < v.y_max) ? box.y_max + EPSILON : v.y_max;
+    clipped_box->z_max = (box.z_max + EPSILON < v.z_max) ? box.z_max + EPSILON : v.z_max;
+    
+    return True;
+}
+
+/*
+ * Keeps part of polygon, which lies on the one side of plane
+ * (coordinate along axis is greater or less than coord).
+ * Returns number of vertexes of the result
+ */
+static inline int
+clip_polygon_by_plane(const Point3d * polygon,
+                      const int vertexes_count,
+                      const int axis,
+                      const Float coord,
+                      const Boolean keep_greater,
+                      Point3d * const result) {
+    
+    int count = 0;
+    int i;
+    for(i = 0; i < vertexes_count; i++) {
+        const Point3d a = polygon[i];
+        const Point3d b = polygon[(i + 1) % vertexes_count];
+        
+        const Float da = (keep_greater) ? point_coord(a, axis) - coord : coord - point_coord(a, axis);
+        const Float db = (keep_greater) ? point_coord(b, axis) - coord : coord - point_coord(b, axis);
+        
+        if(da >= 0) {
+            result[count++] = a;
+        }
+        
+        if(((da >= 0) && (db < 0)) || ((da < 0) && (db >= 0))) {
+            // Edge crosses the plane
+            const Float k = da / (da - db);
+            result[count++] = point3d(a.x + k * (b.x - a.x),
+                                      a.y + k * (b.y - a.y),
+                                      a.z + k * (b.z - a.z));
+        }
+    }
+    
+    return count;
+}
+
+static inline Float
+point_coord(const Point3d p,
+            const int axis) {
+    
+    switch(axis) {
+        case 0:
+            return p.x;
+        case 1:
+            return p.y;
+        default:
+            return p.z;
+    }
 }
 
 inline static Boolean
 intersect_triangle(const void * data,
                    const Point3d vector_start,
                    const Vector3d vector,
-                   Point3d * const intersection_point) {
+                   HitRecord * const hit) {
     
-	const Triangle3d * tr = data;
+    const Triangle3d * tr = data;
+    
+    if(!intersect_vertexes_hit(tr->p1, tr->p2, tr->p3, vector_start, vector, hit))
+        return False;
+    
+    hit->norm = tr->norm;
+    return True;
+}
+
+KDPrimitive
+new_triangle_primitive(const Object3d * const obj) {
+    const Triangle3d * tr = obj->data;
     
-    const Float scalar_product = dot_product(tr->norm, vector);
+    KDPrimitive primitive;
+    primitive.type = TRIANGLE_OBJECT;
+    primitive.data = tr;
+    primitive.geometry.triangle.p1 = tr->p1;
+    primitive.geometry.triangle.p2 = tr->p2;
+    primitive.geometry.triangle.p3 = tr->p3;
+    return primitive;
+}
+
+/*
+ * The same as intersect_triangle, but vertexes are taken from the kd-tree
+ * (triangle itself is read only for the normal of intersected one)
+ */
+Boolean
+intersect_triangle_primitive(const KDPrimitive * const primitive,
+                             const Point3d vector_start,
+                             const Vector3d vector,
+                             HitRecord * const hit) {
     
-    if(fabs(scalar_product) < EPSILON) {
-        // Ray is perpendicular to triangles normal vector (A, B, C)
-        // it means that ray is parellel to triangle
-        // so there is no intersection
+    if(!intersect_vertexes_hit(primitive->geometry.triangle.p1,
+                               primitive->geometry.triangle.p2,
+                               primitive->geometry.triangle.p3,
+                               vector_start, vector, hit)) {
+        
         return False;
     }
     
-	const Float k = - (tr->norm.x * vector_start.x
-                 + tr->norm.y * vector_start.y
-                 + tr->norm.z * vector_start.z
-                 + tr->d)
-            / scalar_product;
+    const Triangle3d * tr = primitive->data;
+    hit->norm = tr->norm;
+    return True;
+}
+
+void
+set_triangle_primitive_hit_norm(const KDPrimitive * const primitive,
+                                HitRecord * const hit) {
     
-    if(k < EPSILON) {
-        // Avoid intersection in the opposite direction
-        return False;
+    const Triangle3d * tr = primitive->data;
+    hit->norm = tr->norm;
+}
+
+int
+intersect_triangle_primitive_packet(const KDPrimitive * const primitive,
+                                    const RayPacket * const packet,
+                                    const int mask,
+                                    HitRecord * const hits) {
+    
+    const int intersected = intersect_vertexes_packet_hits(primitive->geometry.triangle.p1,
+                                                           primitive->geometry.triangle.p2,
+                                                           primitive->geometry.triangle.p3,
+                                                           packet, mask, hits);
+    if(intersected) {
+        const Triangle3d * tr = primitive->data;
+        int r;
+        for(r = 0; intersected >> r; r++) {
+            if(intersected & (1 << r))
+                hits[r].norm = tr->norm;
+        }
     }
+    return intersected;
+}
+
+/*
+ * Fills distance, point and weights of vertexes,
+ * normal vector is set by the caller
+ */
+static inline Boolean
+intersect_vertexes_hit(const Point3d p1,
+                       const Point3d p2,
+                       const Point3d p3,
+                       const Point3d vector_start,
+                       const Vector3d vector,
+                       HitRecord * const hit) {
+    
+    Float t;
+    if(!intersect_vertexes(p1, p2, p3, vector_start, vector, &t, &hit->w1, &hit->w2, &hit->w3))
+        return False;
+    
+    hit->t = t;
+    hit->point = point3d(vector_start.x + vector.x * t,
+                         vector_start.y + vector.y * t,
+                         vector_start.z + vector.z * t);
+    return True;
+}
+
+/*
+ * Watertight test (Woop, Benthin, Wald). Vertexes are moved to the start of ray
+ * and sheared, so the ray goes along z. Then the ray crosses the triangle, if 2d
+ * edge functions u, v, w of vertexes have the same sign. Common edge of adjacent
+ * triangles gives them the same edge function (with opposite sign),
+ * so the ray can't pass between them. u, v, w are also the weights of vertexes
+ */
+static inline Boolean
+intersect_vertexes(const Point3d p1,
+                   const Point3d p2,
+                   const Point3d p3,
+                   const Point3d vector_start,
+                   const Vector3d vector,
+                   Float * const t,
+                   Float * const w1,
+                   Float * const w2,
+                   Float * const w3) {
+    
+    int kx;
+    int ky;
+    int kz;
+    Float sx;
+    Float sy;
+    Float sz;
+    ray_shear(vector, &kx, &ky, &kz, &sx, &sy, &sz);
+    
+    const Float a[3] = {p1.x - vector_start.x, p1.y - vector_start.y, p1.z - vector_start.z};
+    const Float b[3] = {p2.x - vector_start.x, p2.y - vector_start.y, p2.z - vector_start.z};
+    const Float c[3] = {p3.x - vector_start.x, p3.y - vector_start.y, p3.z - vector_start.z};
+    
+    const Float ax = a[kx] - sx * a[kz];
+    const Float ay = a[ky] - sy * a[kz];
+    const Float bx = b[kx] - sx * b[kz];
+    const Float by = b[ky] - sy * b[kz];
+    const Float cx = c[kx] - sx * c[kz];
+    const Float cy = c[ky] - sy * c[kz];
+    
+    const Float u = cx * by - cy * bx;
+    const Float v = ax * cy - ay * cx;
+    const Float w = bx * ay - by * ax;
+    
+    // Both sides of triangle are intersected
+    if(((u < 0) || (v < 0) || (w < 0)) && ((u > 0) || (v > 0) || (w > 0)))
+        return False;
+    
+    const Float det = u + v + w;
+    
+    // Ray is parallel to triangle
+    if(det == 0)
+        return False;
+    
+    *t = (u * (sz * a[kz]) + v * (sz * b[kz]) + w * (sz * c[kz])) / det;
+    
+    // Avoid intersection in the opposite direction
+    if(*t < EPSILON)
+        return False;
+    
+    *w1 = u / det;
+    *w2 = v / det;
+    *w3 = w / det;
+    return True;
+}
+
+static int
+intersect_triangle_packet(const void * data,
+                          const RayPacket * const packet,
+                          const int mask,
+                          HitRecord * const hits) {
 	
-    // Intersection point
-	const Float x = vector_start.x + vector.x * k;
-	const Float y = vector_start.y + vector.y * k;
-	const Float z = vector_start.z + vector.z * k;
-	const Point3d ipt = point3d(x, y, z);
-    
-    if(check_same_clock_dir(tr->v_p1_p2, vector3dp(tr->p1, ipt), tr->norm)
-       && check_same_clock_dir(tr->v_p2_p3, vector3dp(tr->p2, ipt), tr->norm)
-       && check_same_clock_dir(tr->v_p3_p1, vector3dp(tr->p3, ipt), tr->norm)) {
-
-        *intersection_point = ipt;
-        return True;
+	const Triangle3d * tr = data;
+    const int intersected = intersect_vertexes_packet_hits(tr->p1, tr->p2, tr->p3, packet, mask, hits);
+    
+    int r;
+    for(r = 0; intersected >> r; r++) {
+        if(intersected & (1 << r))
+            hits[r].norm = tr->norm;
     }
+    return intersected;
+}
+
+/*
+ * Hits of intersected rays are written to the array, which is indexed by rays
+ * (normal vectors are set by the caller)
+ */
+static inline int
+intersect_vertexes_packet_hits(const Point3d p1,
+                               const Point3d p2,
+                               const Point3d p3,
+                               const RayPacket * const packet,
+                               const int mask,
+                               HitRecord * const hits) {
     
-    // No intersection
-	return False;
+    PacketFloat t;
+    PacketFloat w1;
+    PacketFloat w2;
+    PacketFloat w3;
+    const int intersected = intersect_vertexes_packet(p1, p2, p3, packet, mask, &t, &w1, &w2, &w3);
+    
+    int r;
+    for(r = 0; intersected >> r; r++) {
+        if(intersected & (1 << r)) {
+            HitRecord * const hit = &hits[r];
+            hit->t = t[r];
+            hit->point = point3d(packet->start.x[r] + packet->vector.x[r] * t[r],
+                                 packet->start.y[r] + packet->vector.y[r] * t[r],
+                                 packet->start.z[r] + packet->vector.z[r] * t[r]);
+            hit->w1 = w1[r];
+            hit->w2 = w2[r];
+            hit->w3 = w3[r];
+        }
+    }
+    return intersected;
 }
 
-static inline Boolean
-check_same_clock_dir(const Vector3d v1,
-                     const Vector3d v2,
-                     const Vector3d norm) {
+/*
+ * The same arithmetic as intersect_vertexes for all rays of packet at once.
+ * Rays with different permutations of axes are intersected one by one
+ */
+static inline int
+intersect_vertexes_packet(const Point3d p1,
+                          const Point3d p2,
+                          const Point3d p3,
+                          const RayPacket * const packet,
+                          const int mask,
+                          PacketFloat * const t,
+                          PacketFloat * const w1,
+                          PacketFloat * const w2,
+                          PacketFloat * const w3) {
+    
+    const PacketVector s = packet->start;
+    int r;
+    
+    if(packet->kz < 0) {
+        int hits = 0;
+        for(r = 0; r < PACKET_SIZE; r++) {
+            Float ray_t;
+            Float ray_w1;
+            Float ray_w2;
+            Float ray_w3;
+            
+            if((mask & (1 << r))
+               && intersect_vertexes(p1, p2, p3,
+                                     point3d(s.x[r], s.y[r], s.z[r]),
+                                     vector3df(packet->vector.x[r], packet->vector.y[r], packet->vector.z[r]),
+                                     &ray_t, &ray_w1, &ray_w2, &ray_w3)) {
+                
+                (*t)[r] = ray_t;
+                (*w1)[r] = ray_w1;
+                (*w2)[r] = ray_w2;
+                (*w3)[r] = ray_w3;
+                hits |= 1 << r;
+            }
+        }
+        return hits;
+    }
+    
+    const int kx = packet->kx;
+    const int ky = packet->ky;
+    const int kz = packet->kz;
+    const PacketFloat sx = packet->sx;
+    const PacketFloat sy = packet->sy;
+    const PacketFloat sz = packet->sz;
+    
+    const PacketFloat a[3] = {p1.x - s.x, p1.y - s.y, p1.z - s.z};
+    const PacketFloat b[3] = {p2.x - s.x, p2.y - s.y, p2.z - s.z};
+    const PacketFloat c[3] = {p3.x - s.x, p3.y - s.y, p3.z - s.z};
+    
+    const PacketFloat ax = a[kx] - sx * a[kz];
+    const PacketFloat ay = a[ky] - sy * a[kz];
+    const PacketFloat bx = b[kx] - sx * b[kz];
+    const PacketFloat by = b[ky] - sy * b[kz];
+    const PacketFloat cx = c[kx] - sx * c[kz];
+    const PacketFloat cy = c[ky] - sy * c[kz];
+    
+    const PacketFloat u = cx * by - cy * bx;
+    const PacketFloat v = ax * cy - ay * cx;
+    const PacketFloat w = bx * ay - by * ax;
+    
+    int hits = mask & ~packet_mask_bits(((u < 0) | (v < 0) | (w < 0)) & ((u > 0) | (v > 0) | (w > 0)));
+    
+    const PacketFloat det = u + v + w;
+    hits &= ~packet_mask_bits(det == 0);
+    if(!hits)
+        return 0;
+    
+    const PacketFloat k = (u * (sz * a[kz]) + v * (sz * b[kz]) + w * (sz * c[kz])) / det;
+    hits &= ~packet_mask_bits(k < EPSILON);
+    
+    *t = k;
+    *w1 = u / det;
+    *w2 = v / det;
+    *w3 = w / det;
+    return hits;
+}
+
+
+TriangleMesh *
+new_triangle_mesh(const Boolean with_norms,
+                  Canvas * texture) {
+    
+    TriangleMesh * mesh = calloc(1, sizeof(TriangleMesh));
+    
+    mesh->vertexes_capacity = MESH_INITIAL_CAPACITY;
+    mesh->vertexes = malloc(mesh->vertexes_capacity * sizeof(Point3d));
+    mesh->norms = (with_norms) ? malloc(mesh->vertexes_capacity * sizeof(Vector3d)) : NULL;
+    mesh->texture_points = (texture) ? malloc(mesh->vertexes_capacity * sizeof(Point2d)) : NULL;
+    mesh->texture = texture;
+    
+    mesh->triangles_capacity = MESH_INITIAL_CAPACITY;
+    mesh->triangles = malloc(mesh->triangles_capacity * sizeof(MeshTriangle));
+    
+    return mesh;
+}
+
+int
+add_triangle_mesh_vertex(TriangleMesh * const mesh,
+                         const Point3d p,
+                         const Vector3d n,
+                         const Point2d t) {
+    
+    if(mesh->vertexes_count == mesh->vertexes_capacity) {
+        mesh->vertexes_capacity *= 2;
+        mesh->vertexes = realloc(mesh->vertexes, mesh->vertexes_capacity * sizeof(Point3d));
+        
+        if(mesh->norms)
+            mesh->norms = realloc(mesh->norms, mesh->vertexes_capacity * sizeof(Vector3d));
+        
+        if(mesh->texture_points)
+            mesh->texture_points = realloc(mesh->texture_points, mesh->vertexes_capacity * sizeof(Point2d));
+    }
+    
+    const int index = mesh->vertexes_count++;
+    mesh->vertexes[index] = p;
+    
+    if(mesh->norms)
+        mesh->norms[index] = n;
+    
+    if(mesh->texture_points)
+        mesh->texture_points[index] = t;
+    
+    return index;
+}
+
+int
+add_triangle_mesh_material(TriangleMesh * const mesh,
+                           const Color color,
+                           const Material material) {
+    
+    mesh->materials = realloc(mesh->materials, (mesh->materials_count + 1) * sizeof(MeshMaterial));
+    mesh->materials[mesh->materials_count].color = color;
+    mesh->materials[mesh->materials_count].material = material;
+    return mesh->materials_count++;
+}
+
+void
+add_triangle_mesh_triangle(TriangleMesh * const mesh,
+                           const int v1,
+                           const int v2,
+                           const int v3,
+                           const int material) {
+    
+    if(mesh->triangles_count == mesh->triangles_capacity) {
+        mesh->triangles_capacity *= 2;
+        mesh->triangles = realloc(mesh->triangles, mesh->triangles_capacity * sizeof(MeshTriangle));
+    }
+    
+    MeshTriangle * const tr = &mesh->triangles[mesh->triangles_count++];
+    tr->vertexes[0] = v1;
+    tr->vertexes[1] = v2;
+    tr->vertexes[2] = v3;
+    tr->material = material;
+}
+
+Object3d *
+new_triangle_mesh_object(TriangleMesh * const mesh) {
+    
+    // Mesh is complete - spare capacity of arrays is released
+    if(mesh->vertexes_count && mesh->triangles_count) {
+        mesh->vertexes_capacity = mesh->vertexes_count;
+        mesh->vertexes = realloc(mesh->vertexes, mesh->vertexes_count * sizeof(Point3d));
+        
+        if(mesh->norms)
+            mesh->norms = realloc(mesh->norms, mesh->vertexes_count * sizeof(Vector3d));
+        
+        if(mesh->texture_points)
+            mesh->texture_points = realloc(mesh->texture_points, mesh->vertexes_count * sizeof(Point2d));
+        
+        mesh->triangles_capacity = mesh->triangles_count;
+        mesh->triangles = realloc(mesh->triangles, mesh->triangles_count * sizeof(MeshTriangle));
+    }
+    
+    Voxel * const b = &mesh->bounding_box;
+    b->x_min = b->y_min = b->z_min = FLOAT_MAX;
+    b->x_max = b->y_max = b->z_max = -FLOAT_MAX;
+    
+    int i;
+    for(i = 0; i < mesh->triangles_count; i++) {
+        const Voxel box = get_mesh_triangle_box(mesh, i);
+        
+        b->x_min = (box.x_min < b->x_min) ? box.x_min : b->x_min;
+        b->y_min = (box.y_min < b->y_min) ? box.y_min : b->y_min;
+        b->z_min = (box.z_min < b->z_min) ? box.z_min : b->z_min;
+        
+        b->x_max = (box.x_max > b->x_max) ? box.x_max : b->x_max;
+        b->y_max = (box.y_max > b->y_max) ? box.y_max : b->y_max;
+        b->z_max = (box.z_max > b->z_max) ? box.z_max : b->z_max;
+    }
     
-    const Vector3d norm_v1_v2 = cross_product(v2, v1);
+    if(!mesh->triangles_count) {
+        Voxel empty = {0, 0, 0, 0, 0, 0};
+        *b = empty;
+    }
+    
+    const KDTreeParams params = default_kd_tree_params();
+    mesh->kd_tree = build_mesh_kd_tree(mesh, &params);
+    
+    Object3d * obj = calloc(1, sizeof(Object3d));
+    obj->data = mesh;
+    obj->release_data = release_triangle_mesh_data;
+    obj->get_color = get_triangle_mesh_color;
+    obj->type = MESH_OBJECT;
+    obj->intersect = intersect_triangle_mesh;
+    obj->intersect_packet = intersect_triangle_mesh_packet;
+    obj->is_intersected = is_triangle_mesh_intersected;
+    obj->is_intersected_packet = is_triangle_mesh_intersected_packet;
+    obj->get_normal_vector = get_triangle_mesh_normal_vector;
+    obj->get_material = get_triangle_mesh_material;
+    obj->get_min_boundary_point = get_min_triangle_mesh_boundary_point;
+    obj->get_max_boundary_point = get_max_triangle_mesh_boundary_point;
+    obj->clip_by_voxel = NULL;
+    return obj;
+}
+
+Voxel
+get_mesh_triangle_box(const TriangleMesh * const mesh,
+                      const int index) {
+    
+    const int * v = mesh->triangles[index].vertexes;
+    return vertexes_box(mesh->vertexes[v[0]], mesh->vertexes[v[1]], mesh->vertexes[v[2]]);
+}
+
+Boolean
+clip_mesh_triangle_by_voxel(const TriangleMesh * const mesh,
+                            const int index,
+                            const Voxel v,
+                            Voxel * const clipped_box) {
+    
+    const int * p = mesh->triangles[index].vertexes;
+    return clip_vertexes_by_voxel(mesh->vertexes[p[0]], mesh->vertexes[p[1]], mesh->vertexes[p[2]],
+                                  v, clipped_box);
+}
+
+Boolean
+intersect_mesh_triangle(const TriangleMesh * const mesh,
+                        const int index,
+                        const Point3d vector_start,
+                        const Vector3d vector,
+                        HitRecord * const hit) {
+    
+    const int * v = mesh->triangles[index].vertexes;
     
-    if(dot_product(norm_v1_v2, norm) < 0)
+    if(!intersect_vertexes_hit(mesh->vertexes[v[0]], mesh->vertexes[v[1]], mesh->vertexes[v[2]],
+                               vector_start, vector, hit)) {
+        
         return False;
-    else
-        return True;
+    }
+    
+    hit->norm = mesh_triangle_normal_vector(mesh, index);
+    hit->primitive = index;
+    return True;
 }
 
-static inline void
-get_weights_of_vertexes(const Triangle3d * const tr,
-                        const Point3d intersection_point,
-                        Float * const w1,
-                        Float * const w2,
-                        Float * const w3) {
+void
+set_mesh_triangle_hit_norm(const TriangleMesh * const mesh,
+                           const int index,
+                           HitRecord * const hit) {
+    
+    hit->norm = mesh_triangle_normal_vector(mesh, index);
+    hit->primitive = index;
+}
+
+int
+intersect_mesh_triangle_packet(const TriangleMesh * const mesh,
+                               const int index,
+                               const RayPacket * const packet,
+                               const int mask,
+                               HitRecord * const hits) {
+    
+    const int * v = mesh->triangles[index].vertexes;
+    const int intersected = intersect_vertexes_packet_hits(mesh->vertexes[v[0]],
+                                                           mesh->vertexes[v[1]],
+                                                           mesh->vertexes[v[2]],
+                                                           packet, mask, hits);
+    if(intersected) {
+        const Vector3d norm = mesh_triangle_normal_vector(mesh, index);
+        int r;
+        for(r = 0; intersected >> r; r++) {
+            if(intersected & (1 << r)) {
+                hits[r].norm = norm;
+                hits[r].primitive = index;
+            }
+        }
+    }
+    return intersected;
+}
+
+/*
+ * The same orientation, as the normal of Triangle3d
+ */
+static inline Vector3d
+mesh_triangle_normal_vector(const TriangleMesh * const mesh,
+                            const int index) {
+    
+    const int * v = mesh->triangles[index].vertexes;
+    const Point3d p1 = mesh->vertexes[v[0]];
+    const Point3d p2 = mesh->vertexes[v[1]];
+    const Point3d p3 = mesh->vertexes[v[2]];
+    return cross_product(vector3dp(p1, p3), vector3dp(p3, p2));
+}
+
+/*
+ * Kd-tree of mesh finds the nearest triangle and fills its hit
+ */
+static Boolean
+intersect_triangle_mesh(const void * data,
+                        const Point3d vector_start,
+                        const Vector3d vector,
+                        HitRecord * const hit) {
+    
+    const TriangleMesh * mesh = data;
+    return find_intersection_index_tree(mesh->kd_tree, vector_start, vector, hit) >= 0;
+}
+
+static int
+intersect_triangle_mesh_packet(const void * data,
+                               const RayPacket * const packet,
+                               const int mask,
+                               HitRecord * const hits) {
+    
+    const TriangleMesh * mesh = data;
+    
+    int indexes[PACKET_SIZE];
+    return find_intersection_index_tree_packet(mesh->kd_tree, packet, mask, indexes, hits);
+}
+
+/*
+ * Shadow rays stop at the first triangle of mesh
+ * (hit isn't saved, because its point is not shaded)
+ */
+static Boolean
+is_triangle_mesh_intersected(const void * data,
+                             const Point3d vector_start,
+                             const Vector3d vector,
+                             const Float max_dist) {
+    
+    const TriangleMesh * mesh = data;
+    return is_intersect_anything_tree(mesh->kd_tree, vector_start, vector, max_dist);
+}
+
+static int
+is_triangle_mesh_intersected_packet(const void * data,
+                                    const RayPacket * const packet,
+                                    const int mask,
+                                    const Float * const max_dists) {
     
-    const Vector3d v_p1_p = vector3dp(tr->p1, intersection_point);
-    const Vector3d v_p2_p = vector3dp(tr->p2, intersection_point);
-    const Vector3d v_p3_p = vector3dp(tr->p3, intersection_point);
+    const TriangleMesh * mesh = data;
+    return is_intersect_anything_tree_packet(mesh->kd_tree, packet, mask, max_dists);
+}
+
+static Color
+get_triangle_mesh_color(const void * data,
+                        const HitRecord * const hit) {
     
-    const Float s1 = module_vector(cross_product(v_p2_p, tr->v_p2_p3));
-    const Float s2 = module_vector(cross_product(v_p3_p, tr->v_p3_p1));
-    const Float s3 = module_vector(cross_product(v_p1_p, tr->v_p1_p2));
+    const TriangleMesh * mesh = data;
+    const MeshTriangle * tr = &mesh->triangles[hit->primitive];
     
-    const Float s_sum = s1 + s2 + s3;
+    if(!mesh->texture)
+        return mesh->materials[tr->material].color;
     
-    *w1 = s1 / s_sum;
-    *w2 = s2 / s_sum;
-    *w3 = s3 / s_sum;
+    return get_texture_pixel(mesh->texture,
+                             mesh->texture_points[tr->vertexes[0]],
+                             mesh->texture_points[tr->vertexes[1]],
+                             mesh->texture_points[tr->vertexes[2]],
+                             hit->w1, hit->w2, hit->w3);
 }
 
+static Vector3d
+get_triangle_mesh_normal_vector(const void * data,
+                                const HitRecord * const hit) {
+    
+    const TriangleMesh * mesh = data;
+    const int * v = mesh->triangles[hit->primitive].vertexes;
+    
+    // Triangle is flat, if any vertex has zero normal
+    if(!mesh->norms
+       || is_zero_vector(mesh->norms[v[0]])
+       || is_zero_vector(mesh->norms[v[1]])
+       || is_zero_vector(mesh->norms[v[2]])) {
+        
+        return hit->norm;
+    }
+    
+    const Vector3d n1 = mesh->norms[v[0]];
+    const Vector3d n2 = mesh->norms[v[1]];
+    const Vector3d n3 = mesh->norms[v[2]];
+    
+    return vector3df(hit->w1 * n1.x + hit->w2 * n2.x + hit->w3 * n3.x,
+                     hit->w1 * n1.y + hit->w2 * n2.y + hit->w3 * n3.y,
+                     hit->w1 * n1.z + hit->w2 * n2.z + hit->w3 * n3.z);
+}
+
+static inline Boolean
+is_zero_vector(const Vector3d v) {
+    return (v.x == 0) && (v.y == 0) && (v.z == 0);
+}
+
+static Material
+get_triangle_mesh_material(const void * data,
+                           const HitRecord * const hit) {
+    
+    const TriangleMesh * mesh = data;
+    return mesh->materials[mesh->triangles[hit->primitive].material].material;
+}
+
+static Point3d
+get_min_triangle_mesh_boundary_point(const void * data) {
+    const TriangleMesh * mesh = data;
+    return point3d(mesh->bounding_box.x_min, mesh->bounding_box.y_min, mesh->bounding_box.z_min);
+}
+
+static Point3d
+get_max_triangle_mesh_boundary_point(const void * data) {
+    const TriangleMesh * mesh = data;
+    return point3d(mesh->bounding_box.x_max, mesh->bounding_box.y_max, mesh->bounding_box.z_max);
+}
+
+static void
+release_triangle_mesh_data(void * data) {
+    TriangleMesh * mesh = data;
+    
+    if(mesh->kd_tree)
+        release_kd_tree(mesh->kd_tree);
+    
+    free(mesh->vertexes);
+    free(mesh->norms);
+    free(mesh->texture_points);
+    free(mesh->triangles);
+    free(mesh->materials);
+    free(mesh);
+}